@@ -69,6 +69,15 @@ static void WINCDECL signal_handler(int sig_num) {
   exit_flag = sig_num;
 }
 
+#if !defined(_WIN32)
+static void reopen_logs_handler(int sig_num) {
+  (void) sig_num;
+  if (ctx != NULL) {
+    mg_reopen_logs(ctx);
+  }
+}
+#endif // !_WIN32
+
 static void die(const char *fmt, ...) {
   va_list ap;
   char msg[200];
@@ -249,6 +258,10 @@ static void start_mongoose(int argc, char *argv[]) {
   /* Setup signal handler: quit on Ctrl-C */
   signal(SIGTERM, signal_handler);
   signal(SIGINT, signal_handler);
+#if !defined(_WIN32)
+  // Reopen log files on SIGHUP, so they can be rotated
+  signal(SIGHUP, reopen_logs_handler);
+#endif // !_WIN32
 
   /* Start Mongoose */
   ctx = mg_start(&mongoose_callback, NULL, (const char **) options);
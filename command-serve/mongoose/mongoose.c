@@ -26,6 +26,7 @@
 #define _CRT_SECURE_NO_WARNINGS // Disable deprecation warning in VS2005
 #else
 #define _XOPEN_SOURCE 600     // For flockfile() on Linux
+#define _DEFAULT_SOURCE       // For syscall() on Linux
 #define _LARGEFILE_SOURCE     // Enable 64-bit file offsets
 #define __STDC_FORMAT_MACROS  // <inttypes.h> wants this for C++
 #define __STDC_LIMIT_MACROS   // C++ wants that for INT64_MAX
@@ -55,6 +56,16 @@
 #include <stddef.h>
 #include <stdio.h>
 
+#if !defined(NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define USE_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define USE_NEON
+#endif
+#endif // !NO_SIMD
+
 #if defined(_WIN32) && !defined(__SYMBIAN32__) // Windows specific
 #define _WIN32_WINNT 0x0400 // To make it link in VS2005
 #include <windows.h>
@@ -174,8 +185,11 @@ typedef struct DIR {
 #else    // UNIX  specific
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <stdint.h>
@@ -189,6 +203,51 @@ typedef struct DIR {
 #include <dlfcn.h>
 #endif
 #include <pthread.h>
+#if !defined(NO_POLLER)
+#if defined(__linux__)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#elif defined(__FreeBSD__) || defined(__DragonFly__) || defined(__MACH__)
+#define USE_KQUEUE
+#include <sys/event.h>
+#endif
+#endif // !NO_POLLER
+#if !defined(NO_FUTEX)
+#if defined(__linux__)
+#define USE_FUTEX
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#elif defined(__FreeBSD__)
+#define USE_FUTEX
+#include <sys/umtx.h>
+#endif
+#endif // !NO_FUTEX
+#if !defined(NO_SENDFILE)
+#if defined(__linux__)
+#define USE_SENDFILE
+#include <sys/sendfile.h>
+#elif defined(__FreeBSD__)
+#define USE_SENDFILE
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#endif
+#endif // !NO_SENDFILE
+#if !defined(NO_FILE_CACHE)
+#define USE_FILE_CACHE
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif // !NO_FILE_CACHE
+#if !defined(NO_ZLIB)
+#define USE_ZLIB
+#include <zlib.h>
+#endif // !NO_ZLIB
+#if defined(__linux__)
+#include <sys/syscall.h>  // For SYS_syncfs
+#endif
+#if !defined(NO_CGI) && !defined(NO_FASTCGI)
+#define USE_FASTCGI
+#include <sys/un.h>
+#endif // !NO_CGI && !NO_FASTCGI
 #if defined(__MACH__)
 #define SSL_LIB   "libssl.dylib"
 #define CRYPTO_LIB  "libcrypto.dylib"
@@ -260,6 +319,10 @@ typedef int socklen_t;
 #define MSG_NOSIGNAL 0
 #endif
 
+#if !defined(MSG_MORE)
+#define MSG_MORE 0
+#endif
+
 #if !defined(SOMAXCONN)
 #define SOMAXCONN 100
 #endif
@@ -272,36 +335,103 @@ static const char *http_500_error = "Internal Server Error";
 typedef struct ssl_st SSL;
 typedef struct ssl_method_st SSL_METHOD;
 typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_session_st SSL_SESSION;
+typedef struct bio_st BIO;
+typedef struct evp_md_st EVP_MD;
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+typedef struct engine_st ENGINE;
+typedef int (*alpn_select_cb_t)(SSL *, const unsigned char **,
+                                unsigned char *, const unsigned char *,
+                                unsigned int, void *);
 
 #define SSL_ERROR_WANT_READ 2
 #define SSL_ERROR_WANT_WRITE 3
 #define SSL_FILETYPE_PEM 1
 #define CRYPTO_LOCK  1
+#define SSL_CTRL_GET_SESSION_REUSED 8
+#define SSL_CTRL_OPTIONS 32
+#define SSL_CTRL_SET_SESS_CACHE_SIZE 42
+#define SSL_CTRL_SET_SESS_CACHE_MODE 44
+#define SSL_CTRL_SET_TLSEXT_TICKET_KEYS 59
+#define SSL_SESS_CACHE_OFF 0
+#define SSL_SESS_CACHE_SERVER 2
+#define SSL_OP_ENABLE_KTLS 0x00000008UL        // OpenSSL 3.0 and later
+#define SSL_OP_NO_TICKET 0x00004000UL
+#define SSL_OP_NO_COMPRESSION 0x00020000UL
+#define SSL_OP_NO_SSLv2 0x01000000UL           // OpenSSL 1.0 only
+#define SSL_OP_NO_SSLv3 0x02000000UL
+#define SSL_TLSEXT_ERR_OK 0
+#define SSL_TLSEXT_ERR_NOACK 3
+#define BIO_CTRL_GET_KTLS_SEND 73
 
 #if defined(NO_SSL_DL)
+// Linking directly requires OpenSSL 1.1.0 or later. Build with -DNO_KTLS
+// for versions before 3.0, they have no SSL_sendfile().
 extern void SSL_free(SSL *);
 extern int SSL_accept(SSL *);
 extern int SSL_connect(SSL *);
 extern int SSL_read(SSL *, void *, int);
 extern int SSL_write(SSL *, const void *, int);
 extern int SSL_get_error(const SSL *, int);
+extern int SSL_pending(const SSL *);
 extern int SSL_set_fd(SSL *, int);
 extern SSL *SSL_new(SSL_CTX *);
-extern SSL_CTX *SSL_CTX_new(SSL_METHOD *);
-extern SSL_METHOD *SSLv23_server_method(void);
-extern SSL_METHOD *SSLv23_client_method(void);
-extern int SSL_library_init(void);
-extern void SSL_load_error_strings(void);
+extern SSL_CTX *SSL_CTX_new(const SSL_METHOD *);
 extern int SSL_CTX_use_PrivateKey_file(SSL_CTX *, const char *, int);
 extern int SSL_CTX_use_certificate_file(SSL_CTX *, const char *, int);
 extern int SSL_CTX_use_certificate_chain_file(SSL_CTX *, const char *);
 extern void SSL_CTX_set_default_passwd_cb(SSL_CTX *, mg_callback_t);
 extern void SSL_CTX_free(SSL_CTX *);
+extern long SSL_CTX_ctrl(SSL_CTX *, int, long, void *);
+extern long SSL_ctrl(SSL *, int, long, void *);
+extern int SSL_CTX_set_session_id_context(SSL_CTX *, const unsigned char *,
+                                          unsigned int);
+extern long SSL_CTX_set_timeout(SSL_CTX *, long);
+extern BIO *SSL_get_wbio(const SSL *);
+extern SSL_SESSION *SSL_get1_session(SSL *);
+extern int SSL_set_session(SSL *, SSL_SESSION *);
+extern void SSL_SESSION_free(SSL_SESSION *);
+extern int SSL_shutdown(SSL *);
+extern int OPENSSL_init_ssl(uint64_t, const void *);
+extern const SSL_METHOD *TLS_server_method(void);
+extern const SSL_METHOD *TLS_client_method(void);
+extern uint64_t SSL_CTX_set_options(SSL_CTX *, uint64_t);
+extern int SSL_session_reused(const SSL *);
+extern void SSL_CTX_set_alpn_select_cb(SSL_CTX *, alpn_select_cb_t, void *);
+extern int SSL_CTX_set_alpn_protos(SSL_CTX *, const unsigned char *,
+                                   unsigned int);
+extern void SSL_get0_alpn_selected(const SSL *, const unsigned char **,
+                                   unsigned int *);
 extern unsigned long ERR_get_error(void);
 extern char *ERR_error_string(unsigned long, char *);
-extern int CRYPTO_num_locks(void);
-extern void CRYPTO_set_locking_callback(void (*)(int, int, const char *, int));
-extern void CRYPTO_set_id_callback(unsigned long (*)(void));
+extern long BIO_ctrl(BIO *, int, long, void *);
+extern EVP_MD_CTX *EVP_MD_CTX_new(void);
+extern void EVP_MD_CTX_free(EVP_MD_CTX *);
+extern const EVP_MD *EVP_sha256(void);
+extern int EVP_DigestInit_ex(EVP_MD_CTX *, const EVP_MD *, ENGINE *);
+extern int EVP_DigestUpdate(EVP_MD_CTX *, const void *, size_t);
+extern int EVP_DigestFinal_ex(EVP_MD_CTX *, unsigned char *, unsigned int *);
+
+#define HAVE_OPENSSL_INIT 1
+#define HAVE_SSL_SET_OPTIONS 1
+#define HAVE_SSL_SESSION_REUSED 1
+#define HAVE_SSL_ALPN 1
+#define HAVE_CRYPTO_LOCKS 0
+#define HAVE_EVP_SHA256 1
+#define SSL_library_init() (void) 0
+#define SSL_load_error_strings()
+#define SSLv23_server_method() NULL
+#define SSLv23_client_method() NULL
+#define CRYPTO_num_locks() 0
+#define CRYPTO_set_locking_callback(cb) (void) (cb)
+#define CRYPTO_set_id_callback(cb) (void) (cb)
+#if defined(NO_KTLS)
+#define HAVE_SSL_SENDFILE 0
+#define SSL_sendfile(ssl, fd, off, len, flags) ((ssize_t) -1)
+#else
+#define HAVE_SSL_SENDFILE 1
+extern ssize_t SSL_sendfile(SSL *, int, off_t, size_t, int);
+#endif // NO_KTLS
 #else
 // Dynamically loaded SSL functionality
 struct ssl_func {
@@ -317,28 +447,92 @@ struct ssl_func {
 #define SSL_get_error (* (int (*)(SSL *, int)) ssl_sw[5].ptr)
 #define SSL_set_fd (* (int (*)(SSL *, SOCKET)) ssl_sw[6].ptr)
 #define SSL_new (* (SSL * (*)(SSL_CTX *)) ssl_sw[7].ptr)
-#define SSL_CTX_new (* (SSL_CTX * (*)(SSL_METHOD *)) ssl_sw[8].ptr)
-#define SSLv23_server_method (* (SSL_METHOD * (*)(void)) ssl_sw[9].ptr)
-#define SSL_library_init (* (int (*)(void)) ssl_sw[10].ptr)
+#define SSL_CTX_new (* (SSL_CTX * (*)(const SSL_METHOD *)) ssl_sw[8].ptr)
 #define SSL_CTX_use_PrivateKey_file (* (int (*)(SSL_CTX *, \
-        const char *, int)) ssl_sw[11].ptr)
+        const char *, int)) ssl_sw[9].ptr)
 #define SSL_CTX_use_certificate_file (* (int (*)(SSL_CTX *, \
-        const char *, int)) ssl_sw[12].ptr)
+        const char *, int)) ssl_sw[10].ptr)
 #define SSL_CTX_set_default_passwd_cb \
-  (* (void (*)(SSL_CTX *, mg_callback_t)) ssl_sw[13].ptr)
-#define SSL_CTX_free (* (void (*)(SSL_CTX *)) ssl_sw[14].ptr)
-#define SSL_load_error_strings (* (void (*)(void)) ssl_sw[15].ptr)
+  (* (void (*)(SSL_CTX *, mg_callback_t)) ssl_sw[11].ptr)
+#define SSL_CTX_free (* (void (*)(SSL_CTX *)) ssl_sw[12].ptr)
 #define SSL_CTX_use_certificate_chain_file \
-  (* (int (*)(SSL_CTX *, const char *)) ssl_sw[16].ptr)
-#define SSLv23_client_method (* (SSL_METHOD * (*)(void)) ssl_sw[17].ptr)
-
-#define CRYPTO_num_locks (* (int (*)(void)) crypto_sw[0].ptr)
+  (* (int (*)(SSL_CTX *, const char *)) ssl_sw[13].ptr)
+#define SSL_pending (* (int (*)(SSL *)) ssl_sw[14].ptr)
+#define SSL_CTX_ctrl \
+  (* (long (*)(SSL_CTX *, int, long, void *)) ssl_sw[15].ptr)
+#define SSL_ctrl (* (long (*)(SSL *, int, long, void *)) ssl_sw[16].ptr)
+#define SSL_CTX_set_session_id_context (* (int (*)(SSL_CTX *, \
+        const unsigned char *, unsigned int)) ssl_sw[17].ptr)
+#define SSL_CTX_set_timeout (* (long (*)(SSL_CTX *, long)) ssl_sw[18].ptr)
+#define SSL_get_wbio (* (BIO * (*)(const SSL *)) ssl_sw[19].ptr)
+#define SSL_get1_session (* (SSL_SESSION * (*)(SSL *)) ssl_sw[20].ptr)
+#define SSL_set_session (* (int (*)(SSL *, SSL_SESSION *)) ssl_sw[21].ptr)
+#define SSL_SESSION_free (* (void (*)(SSL_SESSION *)) ssl_sw[22].ptr)
+#define SSL_shutdown (* (int (*)(SSL *)) ssl_sw[23].ptr)
+
+// Optional functions. Which of them are there depends on the library
+// version, the missing ones stay NULL.
+#define OPENSSL_init_ssl \
+  (* (int (*)(uint64_t, const void *)) ssl_opt_sw[0].ptr)
+#define TLS_server_method (* (const SSL_METHOD * (*)(void)) ssl_opt_sw[1].ptr)
+#define TLS_client_method (* (const SSL_METHOD * (*)(void)) ssl_opt_sw[2].ptr)
+#define SSL_CTX_set_options \
+  (* (uint64_t (*)(SSL_CTX *, uint64_t)) ssl_opt_sw[3].ptr)
+#define SSL_session_reused (* (int (*)(const SSL *)) ssl_opt_sw[4].ptr)
+#define SSL_CTX_set_alpn_select_cb (* (void (*)(SSL_CTX *, \
+        alpn_select_cb_t, void *)) ssl_opt_sw[5].ptr)
+#define SSL_CTX_set_alpn_protos (* (int (*)(SSL_CTX *, \
+        const unsigned char *, unsigned int)) ssl_opt_sw[6].ptr)
+#define SSL_get0_alpn_selected (* (void (*)(const SSL *, \
+        const unsigned char **, unsigned int *)) ssl_opt_sw[7].ptr)
+#define SSL_sendfile \
+  (* (ssize_t (*)(SSL *, int, off_t, size_t, int)) ssl_opt_sw[8].ptr)
+#define SSL_library_init (* (int (*)(void)) ssl_opt_sw[9].ptr)
+#define SSL_load_error_strings (* (void (*)(void)) ssl_opt_sw[10].ptr)
+#define SSLv23_server_method \
+  (* (const SSL_METHOD * (*)(void)) ssl_opt_sw[11].ptr)
+#define SSLv23_client_method \
+  (* (const SSL_METHOD * (*)(void)) ssl_opt_sw[12].ptr)
+
+#define ERR_get_error (* (unsigned long (*)(void)) crypto_sw[0].ptr)
+#define ERR_error_string (* (char * (*)(unsigned long,char *)) crypto_sw[1].ptr)
+#define BIO_ctrl (* (long (*)(BIO *, int, long, void *)) crypto_sw[2].ptr)
+
+#define CRYPTO_num_locks (* (int (*)(void)) crypto_opt_sw[0].ptr)
 #define CRYPTO_set_locking_callback \
-  (* (void (*)(void (*)(int, int, const char *, int))) crypto_sw[1].ptr)
+  (* (void (*)(void (*)(int, int, const char *, int))) crypto_opt_sw[1].ptr)
 #define CRYPTO_set_id_callback \
-  (* (void (*)(unsigned long (*)(void))) crypto_sw[2].ptr)
-#define ERR_get_error (* (unsigned long (*)(void)) crypto_sw[3].ptr)
-#define ERR_error_string (* (char * (*)(unsigned long,char *)) crypto_sw[4].ptr)
+  (* (void (*)(unsigned long (*)(void))) crypto_opt_sw[2].ptr)
+#define EVP_MD_CTX_new (* (EVP_MD_CTX * (*)(void)) crypto_opt_sw[3].ptr)
+#define EVP_MD_CTX_free (* (void (*)(EVP_MD_CTX *)) crypto_opt_sw[4].ptr)
+#define EVP_sha256 (* (const EVP_MD * (*)(void)) crypto_opt_sw[5].ptr)
+#define EVP_DigestInit_ex (* (int (*)(EVP_MD_CTX *, const EVP_MD *, \
+        ENGINE *)) crypto_opt_sw[6].ptr)
+#define EVP_DigestUpdate \
+  (* (int (*)(EVP_MD_CTX *, const void *, size_t)) crypto_opt_sw[7].ptr)
+#define EVP_DigestFinal_ex (* (int (*)(EVP_MD_CTX *, unsigned char *, \
+        unsigned int *)) crypto_opt_sw[8].ptr)
+
+// OpenSSL 1.1 and LibreSSL have OPENSSL_init_ssl(). OpenSSL 1.1 made
+// the library thread safe by itself, only 1.0 wants locking callbacks.
+// SSL_sendfile() is there since OpenSSL 3.0, the first version with kTLS.
+#define HAVE_OPENSSL_INIT (ssl_opt_sw[0].ptr != NULL)
+#define HAVE_SSL_SET_OPTIONS (ssl_opt_sw[3].ptr != NULL)
+#define HAVE_SSL_SESSION_REUSED (ssl_opt_sw[4].ptr != NULL)
+#define HAVE_SSL_ALPN (ssl_opt_sw[5].ptr != NULL && \
+                       ssl_opt_sw[6].ptr != NULL && ssl_opt_sw[7].ptr != NULL)
+#define HAVE_SSL_SENDFILE (ssl_opt_sw[8].ptr != NULL)
+#define HAVE_CRYPTO_LOCKS (crypto_opt_sw[0].ptr != NULL && \
+                           crypto_opt_sw[1].ptr != NULL && \
+                           crypto_opt_sw[2].ptr != NULL)
+// EVP_MD_CTX_new() is called EVP_MD_CTX_create() before OpenSSL 1.1,
+// those use the builtin SHA-256.
+#define HAVE_EVP_SHA256 (crypto_opt_sw[3].ptr != NULL && \
+                         crypto_opt_sw[4].ptr != NULL && \
+                         crypto_opt_sw[5].ptr != NULL && \
+                         crypto_opt_sw[6].ptr != NULL && \
+                         crypto_opt_sw[7].ptr != NULL && \
+                         crypto_opt_sw[8].ptr != NULL)
 
 // set_ssl_option() function updates this array.
 // It loads SSL library dynamically and changes NULLs to the actual addresses
@@ -354,26 +548,60 @@ static struct ssl_func ssl_sw[] = {
   {"SSL_set_fd",   NULL},
   {"SSL_new",   NULL},
   {"SSL_CTX_new",   NULL},
-  {"SSLv23_server_method", NULL},
-  {"SSL_library_init",  NULL},
   {"SSL_CTX_use_PrivateKey_file", NULL},
   {"SSL_CTX_use_certificate_file",NULL},
   {"SSL_CTX_set_default_passwd_cb",NULL},
   {"SSL_CTX_free",  NULL},
-  {"SSL_load_error_strings", NULL},
   {"SSL_CTX_use_certificate_chain_file", NULL},
+  {"SSL_pending", NULL},
+  {"SSL_CTX_ctrl", NULL},
+  {"SSL_ctrl", NULL},
+  {"SSL_CTX_set_session_id_context", NULL},
+  {"SSL_CTX_set_timeout", NULL},
+  {"SSL_get_wbio", NULL},
+  {"SSL_get1_session", NULL},
+  {"SSL_set_session", NULL},
+  {"SSL_SESSION_free", NULL},
+  {"SSL_shutdown", NULL},
+  {NULL,    NULL}
+};
+
+#if !defined(NO_SSL)
+static struct ssl_func ssl_opt_sw[] = {
+  {"OPENSSL_init_ssl", NULL},
+  {"TLS_server_method", NULL},
+  {"TLS_client_method", NULL},
+  {"SSL_CTX_set_options", NULL},
+  {"SSL_session_reused", NULL},
+  {"SSL_CTX_set_alpn_select_cb", NULL},
+  {"SSL_CTX_set_alpn_protos", NULL},
+  {"SSL_get0_alpn_selected", NULL},
+  {"SSL_sendfile", NULL},
+  {"SSL_library_init",  NULL},
+  {"SSL_load_error_strings", NULL},
+  {"SSLv23_server_method", NULL},
   {"SSLv23_client_method", NULL},
   {NULL,    NULL}
 };
 
 // Similar array as ssl_sw. These functions could be located in different lib.
-#if !defined(NO_SSL)
 static struct ssl_func crypto_sw[] = {
+  {"ERR_get_error",  NULL},
+  {"ERR_error_string", NULL},
+  {"BIO_ctrl", NULL},
+  {NULL,    NULL}
+};
+
+static struct ssl_func crypto_opt_sw[] = {
   {"CRYPTO_num_locks",  NULL},
   {"CRYPTO_set_locking_callback", NULL},
   {"CRYPTO_set_id_callback", NULL},
-  {"ERR_get_error",  NULL},
-  {"ERR_error_string", NULL},
+  {"EVP_MD_CTX_new", NULL},
+  {"EVP_MD_CTX_free", NULL},
+  {"EVP_sha256", NULL},
+  {"EVP_DigestInit_ex", NULL},
+  {"EVP_DigestUpdate", NULL},
+  {"EVP_DigestFinal_ex", NULL},
   {NULL,    NULL}
 };
 #endif // NO_SSL
@@ -405,58 +633,314 @@ struct mgstat {
   int is_directory;  // Directory marker
   int64_t size;      // File size
   time_t mtime;      // Modification time
+  int64_t dev;       // Device and inode numbers, 0 on Windows
+  int64_t ino;
+};
+
+// Content codings of precompressed sibling files, in order of preference.
+// A file is served as "path.gz" when the client accepts gzip and the
+// sibling is at least as new as the file itself.
+static const struct {
+  const char *name;       // Content-Encoding: value
+  const char *extension;  // Suffix of the sibling file
+} content_codings[] = {
+  {"zstd", ".zst"},
+  {"gzip", ".gz"}
+};
+#define NUM_CODINGS 2
+
+// Satisfiable part of a Range: request header, clipped to the file size
+struct byte_range {
+  int64_t start;
+  int64_t len;
 };
+#define MAX_BYTE_RANGES 16  // Range: headers with more ranges are ignored
 
 // Describes listening socket, or socket which was accept()-ed by the master
-// thread and queued for future handling by the worker thread.
+// thread and queued for future handling by the worker thread, or idle
+// keep-alive connection parked in the poller until the client sends more.
 struct socket {
   struct socket *next;  // Linkage
+  struct socket *prev;  // Linkage of parked connections
   SOCKET sock;          // Listening socket
   union usa lsa;        // Local socket address
   union usa rsa;        // Remote socket address
   int is_ssl;           // Is socket SSL-ed
+  int is_parked;        // Idle keep-alive connection, watched by the poller
+  SSL *ssl;             // SSL state of a parked connection
+  int num_requests;     // Requests served on this connection so far
+  time_t deadline;      // Connection must be closed by then, 0 if no limit
+  time_t idle_expires;  // Parked connection is closed at that time
+};
+
+// Cell of the accepted sockets queue. The sequence number tells whether
+// the cell is free for the producer at position pos (seq == pos), or holds
+// a socket for the consumer at position pos (seq == pos + 1).
+struct sq_cell {
+  volatile long seq;
+  struct socket socket;
+};
+
+// Eventcount: lets threads park when a lock-free structure has nothing for
+// them, without making the fast path take a lock. Waiter takes a key with
+// ec_prepare_wait(), re-checks the condition and then blocks in ec_wait()
+// until ec_notify() bumps the epoch.
+struct eventcount {
+  volatile int epoch;       // Futex word, bumped by every notification
+  volatile long waiters;    // Threads parked or about to park
+#if !defined(USE_FUTEX)
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif // !USE_FUTEX
+};
+
+// Contents of a frequently requested file, mapped into memory and shared
+// by all workers. An entry is valid while the file's identity (device and
+// inode), size and modification time match those of the request's stat.
+struct file_cache_entry {
+  struct file_cache_entry *hash_next;  // Next entry in the same bucket
+  struct file_cache_entry *lru_prev;   // Towards most recently used
+  struct file_cache_entry *lru_next;   // Towards least recently used
+  char *path;
+  struct mgstat st;
+  char *data;                          // Mapped file contents
+  int refcount;                        // Cache itself plus responses in flight
+};
+
+#define FILE_CACHE_BUCKETS 256
+
+// Headers of a file response that do not change while the file stays the
+// same: Last-Modified, Etag, Content-Type and Content-Length. The cache is
+// direct mapped, a path evicts whatever other path shared its slot.
+struct header_cache_slot {
+  char *path;              // NULL if the slot is empty
+  int encoded;             // Precompressed sibling, typed by the plain name
+  struct mgstat st;
+  int fixed_len;           // Length of the block without Content-Length
+  int len;                 // Length of the whole block
+  char headers[256];
+};
+
+#define HEADER_CACHE_SLOTS 512
+
+// Rendered directory listing. Listings are cached by URI, directory stats,
+// sort order and format, and shared by the requests that send them.
+// Files rewritten in place do not change the directory stats, so cached
+// listings also expire after a few seconds to pick up new sizes and dates.
+struct dir_listing {
+  char *uri;               // Request URI the listing was rendered for
+  struct mgstat st;        // Directory stats at the time of rendering
+  char query[5];           // Sort field, 'a' or 'd' direction, 'j' for JSON,
+                           //   'z' if data is gzip encoded. "p" for PROPFIND
+                           //   properties of the entries, "s" for an SSI
+                           //   template, uri is then the file path
+  size_t dirs;             // PROPFIND: offset of subdirectory names in data
+  int refs;                // Cache slot and requests holding the listing
+  int failed;              // Memory allocation failed while rendering
+  char *data;
+  size_t len;              // Bytes rendered
+  size_t size;             // Bytes allocated
+  time_t expires;          // Cached listing is not served after this time
+};
+
+#define LISTING_CACHE_SLOTS 256
+#define LISTING_CACHE_TTL 5  // Seconds, unless path_cache_ttl is set
+#define LISTING_CACHE_MAX_SIZE (8 * 1024 * 1024)  // Larger are not kept
+#define LISTING_CACHE_MAX_BYTES (64 * 1024 * 1024)  // All cached listings
+
+// Slot of the extension to mime type hash table. Extensions include the
+// leading dot and are matched case-insensitively. Strings point either
+// to builtin_mime_types or into the extra_mime_types option value, so they
+// are not 0-terminated.
+struct mime_entry {
+  const char *extension;  // NULL if slot is empty
+  size_t ext_len;
+  const char *mime_type;
+  size_t mime_len;
+};
+
+// Lines logged by one worker thread that are not written to the log file
+// yet. The worker is the only producer and moves head, the logger thread
+// is the only consumer and moves tail, so neither has to take a lock.
+struct log_ring {
+  struct log_ring *next;   // Linkage in ctx->log_rings, under log_mutex
+  volatile long head;      // Total bytes appended by the worker
+  volatile long tail;      // Total bytes written out by the logger
+  char buf[16384];         // Size must be a power of 2
+};
+
+enum {ACCESS_LOG, ERROR_LOG, NUM_LOGS};
+
+// Node of the compiled access control list: a path-compressed binary trie
+// of subnets. Every node on the path from the root to an address is a
+// subnet that contains it.
+struct acl_node {
+  struct acl_node *child[2];  // Subnets with the next bit 0 and 1
+  unsigned char prefix[16];   // Network byte order, bits past len are 0
+  int len;                    // Prefix length, in bits
+  int rule;                   // Index of the rule in the list, -1 if none
+  int allow;                  // Rule flag, 1 for '+' and 0 for '-'
+};
+
+struct acl {
+  struct acl_node *ipv4;
+  struct acl_node *ipv6;
+};
+
+// Glob pattern compiled from the match_prefix() syntax. Every '|'
+// alternative is a run of ops terminated by GLOB_MATCH. The ops, the
+// alternative offsets and the literal text share one allocation.
+enum {GLOB_TEXT, GLOB_ANY, GLOB_STAR, GLOB_STARSTAR, GLOB_END, GLOB_MATCH};
+#define GLOB_MAX_STARS 16  // Per alternative, bounds the backtrack stack
+
+struct glob_op {
+  int type;
+  int len;           // Length of GLOB_TEXT literal
+  const char *text;  // GLOB_TEXT literal, not NUL-terminated
+};
+
+struct glob {
+  struct glob_op *ops;
+  int *alts;         // Index of the first op of every alternative
+  int num_alts;
+};
+
+// Password file entry. Strings share a single allocation with the entry.
+struct auth_user {
+  struct auth_user *next;    // Next entry in the same bucket
+  char *user;
+  char *domain;
+  char *ha1;
+};
+
+// Passwords file loaded into memory, valid while the file stays the same.
+struct auth_file {
+  struct auth_file *next;    // Next file in the same bucket
+  char *path;
+  struct mgstat st;
+  struct auth_user **users;  // Hashed by user and domain
+  unsigned long users_mask;  // Number of buckets minus one, 2^n - 1
+};
+
+#define AUTH_FILE_BUCKETS 64
+
+// What a request URI maps to in the file system, as far as handle_request()
+// needs to know before opening the file.
+struct resolved_uri {
+  int stat_result;          // mg_stat() result for the mapped path
+  struct mgstat st;
+  int hidden;               // Path matches hide_files_patterns
+  int index;                // Position of directory's index file in
+  struct mgstat index_st;   //   index_files, or -1 if there is none
+  int auth_found;           // A passwords file guards the path
+  struct mgstat auth_st;
+  int codings;              // Bit i set if there is a fresh precompressed
+  struct mgstat coding_st[NUM_CODINGS];  // sibling for content_codings[i]
+};
+
+// Resolved URIs, kept for path_cache_ttl seconds. The cache is direct
+// mapped, slots are spread over a few mutexes so workers rarely contend.
+struct path_cache_slot {
+  char *uri;                // NULL if the slot is empty. Path and auth_path
+  char *path;               //   share the allocation of uri
+  char *auth_path;
+  struct resolved_uri ru;
+  time_t expires;
+};
+
+#define PATH_CACHE_SLOTS 1024
+#define PATH_CACHE_LOCKS 16
+
+#define FCGI_MAX_PROCESSES 64  // Per FastCGI program
+
+#define PUT_BUF_SIZE (256 * 1024)  // Uploads are written in such pieces
+enum { PUT_FSYNC_NO, PUT_FSYNC_YES, PUT_FSYNC_BATCH };
+
+#define CLIENT_BUF_SIZE 16384    // Response headers must fit in it
+#define CLIENT_POOL_SIZE 8       // Idle connections kept per server
+#define CLIENT_IDLE_TIMEOUT 30   // Seconds an idle connection is kept
+#define DNS_CACHE_SIZE 16        // Host names mg_connect() remembers
+#define DNS_CACHE_TTL 60         // Seconds a resolved address is used
+
+// Address of a host name, resolved by mg_connect() not long ago
+struct dns_entry {
+  char host[256];
+  union usa usa;       // Port is not set
+  socklen_t len;
+  time_t expires;      // 0 if the entry is empty
 };
 
 // NOTE(lsm): this enum shoulds be in sync with the config_options below.
 enum {
-  CGI_EXTENSIONS, CGI_ENVIRONMENT, PUT_DELETE_PASSWORDS_FILE, CGI_INTERPRETER,
-  MAX_REQUEST_SIZE, PROTECT_URI, AUTHENTICATION_DOMAIN, SSI_EXTENSIONS,
+  FASTCGI_PROCESSES, CGI_EXTENSIONS, CONNECTION_DEADLINE, CGI_ENVIRONMENT,
+  FILE_CACHE_SIZE,
+  PUT_DELETE_PASSWORDS_FILE, CGI_INTERPRETER, PARK_IDLE_CONNECTIONS,
+  SSL_SESSION_CACHE_SIZE, MAX_REQUEST_SIZE, KEEP_ALIVE_MAX_REQUESTS,
+  SSL_SESSION_TIMEOUT, PROTECT_URI,
+  AUTHENTICATION_DOMAIN, SSI_EXTENSIONS, PATH_CACHE_TTL, DAV_DEPTH_INFINITY,
+  IDLE_TIMEOUT,
+  COMPRESSION_CPU_BUDGET,
   ACCESS_LOG_FILE, SSL_CHAIN_FILE, ENABLE_DIRECTORY_LISTING, ERROR_LOG_FILE,
-  GLOBAL_PASSWORDS_FILE, INDEX_FILES, ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST,
-  EXTRA_MIME_TYPES, LISTENING_PORTS, DOCUMENT_ROOT, SSL_CERTIFICATE,
-  NUM_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES,
+  FASTCGI_PATTERN, GLOBAL_PASSWORDS_FILE, INDEX_FILES, SSL_TICKET_KEY_FILE,
+  ENABLE_KEEP_ALIVE,
+  ACCESS_CONTROL_LIST,
+  EXTRA_MIME_TYPES, LISTENING_PORTS, SOCKET_QUEUE_SIZE, DOCUMENT_ROOT,
+  SSL_CERTIFICATE,
+  NUM_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES, PUT_FSYNC,
+  SERVE_PRECOMPRESSED_FILES,
   NUM_OPTIONS
 };
 
 static const char *config_options[] = {
+  "B", "fastcgi_processes", "4",
   "C", "cgi_pattern", "**.cgi$|**.pl$|**.php$",
+  "D", "connection_deadline", "0",
   "E", "cgi_environment", NULL,
+  "F", "file_cache_size", "0",
   "G", "put_delete_passwords_file", NULL,
   "I", "cgi_interpreter", NULL,
+  "K", "park_idle_connections", "no",
+  "L", "ssl_session_cache_size", "20480",
   "M", "max_request_size", "16384",
+  "N", "keep_alive_max_requests", "100",
+  "O", "ssl_session_timeout", "300",
   "P", "protect_uri", NULL,
   "R", "authentication_domain", "mydomain.com",
   "S", "ssi_pattern", "**.shtml$|**.shtm$",
+  "T", "path_cache_ttl", "0",
+  "V", "dav_depth_infinity", "yes",
+  "W", "idle_timeout", "0",
+  "Z", "compression_cpu_budget", "0",
   "a", "access_log_file", NULL,
   "c", "ssl_chain_file", NULL,
   "d", "enable_directory_listing", "yes",
   "e", "error_log_file", NULL,
+  "f", "fastcgi_pattern", NULL,
   "g", "global_passwords_file", NULL,
   "i", "index_files", "index.html,index.htm,index.cgi,index.shtml,index.php",
+  "j", "ssl_ticket_key_file", NULL,
   "k", "enable_keep_alive", "no",
   "l", "access_control_list", NULL,
   "m", "extra_mime_types", NULL,
   "p", "listening_ports", "8080",
+  "q", "socket_queue_size", "64",
   "r", "document_root",  ".",
   "s", "ssl_certificate", NULL,
   "t", "num_threads", "10",
   "u", "run_as_user", NULL,
   "w", "url_rewrite_patterns", NULL,
   "x", "hide_files_patterns", NULL,
+  "y", "put_fsync", "no",
+  "z", "serve_precompressed_files", "no",
   NULL
 };
 #define ENTRIES_PER_CONFIG_OPTION 3
 
+// Options that name the log files, indexed by ACCESS_LOG and ERROR_LOG
+static const int log_file_options[NUM_LOGS] = {
+  ACCESS_LOG_FILE, ERROR_LOG_FILE
+};
+
 struct mg_context {
   volatile int stop_flag;       // Should we stop event loop
   SSL_CTX *ssl_ctx;             // SSL context
@@ -465,17 +949,105 @@ struct mg_context {
   mg_callback_t user_callback;  // User-defined callback function
   void *user_data;              // User-defined data
 
+  struct acl *acl;             // Compiled access_control_list, or NULL
+  pthread_mutex_t auth_mutex;  // Protects auth_files
+  struct auth_file *auth_files[AUTH_FILE_BUCKETS];  // Loaded passwords files
   struct socket *listening_sockets;
+  struct socket *parked_sockets;  // Idle keep-alive connections
+  SOCKET poll_fd;            // epoll/kqueue descriptor, used by master thread
+  SOCKET wakeup_fds[2];      // Pipe used by mg_stop() to wake up the master
+  int accept_stalled;        // Out of descriptors, backlog is retried later
 
   volatile int num_threads;  // Number of threads
-  pthread_mutex_t mutex;     // Protects (max|num)_threads
+  pthread_mutex_t mutex;     // Protects (max|num)_threads, parked_sockets
   pthread_cond_t  cond;      // Condvar for tracking workers terminations
 
-  struct socket queue[20];   // Accepted sockets
-  volatile int sq_head;      // Head of the socket queue
-  volatile int sq_tail;      // Tail of the socket queue
-  pthread_cond_t sq_full;    // Signaled when socket is produced
-  pthread_cond_t sq_empty;   // Signaled when socket is consumed
+  struct sq_cell *queue;     // Accepted sockets, lock-free ring
+  unsigned long sq_mask;     // Ring size minus one, ring size is 2^n
+  char sq_pad1[64];          // Keep head and tail on separate cache lines
+  volatile long sq_head;     // Head of the socket queue, master writes here
+  char sq_pad2[64];
+  volatile long sq_tail;     // Tail of the socket queue, workers read here
+  char sq_pad3[64];
+  struct eventcount sq_full;   // Notified when socket is produced
+  struct eventcount sq_empty;  // Notified when socket is consumed
+
+  pthread_mutex_t fc_mutex;  // Protects the file cache
+  struct file_cache_entry **fc_buckets;  // NULL if file cache is disabled
+  struct file_cache_entry *fc_lru_head;  // Most recently used entry
+  struct file_cache_entry *fc_lru_tail;  // Eviction candidate
+  int64_t fc_size;           // Bytes currently mapped by the cache
+  int64_t fc_budget;         // Value of file_cache_size option
+
+  pthread_mutex_t lc_mutex;  // Protects lc_slots, lc_bytes and listing refs
+  struct dir_listing *lc_slots[LISTING_CACHE_SLOTS];
+  size_t lc_bytes;           // Data size of listings in lc_slots
+
+  int precompressed;         // Value of serve_precompressed_files option
+  pthread_mutex_t z_mutex;   // Protects z_window and z_used
+  long z_budget;             // Compression CPU microseconds per second
+  time_t z_window;           // Second z_used is counted for
+  long z_used;               // Microseconds spent compressing in z_window
+
+  pthread_mutex_t hc_mutex;  // Protects header cache and cached date
+  struct header_cache_slot *hc_slots;
+  time_t date_time;          // Second the cached Date value was rendered at
+  char date[64];             // Cached Date header value
+
+  pthread_mutex_t pc_mutexes[PATH_CACHE_LOCKS];  // Protect pc_slots
+  struct path_cache_slot *pc_slots;  // NULL if path cache is disabled
+  int pc_ttl;                // Value of path_cache_ttl option
+
+  pthread_mutex_t fcgi_mutex;   // Protects FastCGI pools
+  struct fcgi_pool *fcgi_pools;  // Started on the first request of a program
+  int fcgi_processes;           // Value of fastcgi_processes option
+  char fcgi_dir[64];            // Holds sockets of the pools, "" if not made
+
+  int put_fsync;              // Value of put_fsync option, PUT_FSYNC_*
+  pthread_mutex_t put_mutex;  // Protects put_* sync counters below
+  pthread_cond_t put_cond;    // Signalled when a batched sync is done
+  int put_syncing;            // A thread is running a batched sync
+  int64_t put_tickets;        // Number of uploads that asked for a sync
+  int64_t put_synced;         // Uploads up to this ticket are durable
+  int64_t put_synced_dev;     // File system the last batched sync was on
+#if !defined(_WIN32)
+  mode_t put_umask;           // Process umask, applied to new uploads
+#endif
+
+  pthread_mutex_t client_mutex;       // Protects client_pool and dns_cache
+  struct mg_connection *client_pool;  // Idle kept-alive client connections
+  struct dns_entry dns_cache[DNS_CACHE_SIZE];
+
+  int max_requests;   // Value of keep_alive_max_requests option, 0 no limit
+  int idle_timeout;   // Value of idle_timeout option, 0 if no limit
+  int deadline;       // Value of connection_deadline option, 0 if no limit
+
+  struct glob *cgi_glob;   // Compiled cgi_pattern
+  struct glob *fcgi_glob;  // Compiled fastcgi_pattern, or NULL
+  struct glob *ssi_glob;   // Compiled ssi_pattern
+  struct glob *hide_glob;  // Passwords files plus hide_files_patterns
+
+  struct mime_entry *mime_table;  // Hashed by the last extension of a path
+  unsigned long mime_mask;        // Table size minus one, size is 2^n
+  struct mime_entry *mime_suffixes;  // User types like ".tar.gz", checked
+  int num_mime_suffixes;             // by suffix before the table lookup
+
+  pthread_mutex_t log_mutex;  // Protects log files and log_rings lists
+  FILE *log_files[NUM_LOGS];  // Access and error logs, open while running
+  struct log_ring *log_rings[NUM_LOGS];  // Buffers of all worker threads
+  volatile int log_flush;     // Set by workers whose ring is filling up
+  volatile int log_reopen;    // Set by mg_reopen_logs()
+  volatile int log_stop;      // 1: logger must exit, 2: logger has exited
+};
+
+// Decoding state of a request body in chunked transfer encoding
+enum {
+  CHUNK_NONE,      // Body is not chunked
+  CHUNK_SIZE,      // Chunk size line is next
+  CHUNK_DATA,      // Reading chunk data, chunk_left bytes left
+  CHUNK_CRLF,      // Line break after chunk data is next
+  CHUNK_TRAILER,   // Last chunk seen, reading trailer lines
+  CHUNK_DONE       // Body has been read completely
 };
 
 struct mg_connection {
@@ -495,16 +1067,45 @@ struct mg_connection {
   int buf_size;               // Buffer size
   int request_len;            // Size of the request + headers in a buffer
   int data_len;               // Total size of data in a buffer
+  char *out_buf;              // Buffered response data, NULL if unbuffered
+  int out_len;                // Size of the buffered response data
+  int out_size;               // Output buffer size, 0 disables buffering
+  struct compressor *zs;      // Compresses mg_write() data, or NULL
+  int chunked;                // Response body goes out in chunked encoding
+  int chunk_state;            // Request body decoding state, CHUNK_*
+  int64_t chunk_left;         // Bytes left in the request body chunk
+  char *peer;                 // "host:port" of a client connection
+  struct mg_connection *next_idle;  // Linkage of the client pool
+  struct log_ring *log_rings[NUM_LOGS];  // Worker thread's log buffers
 };
 
 const char **mg_get_valid_option_names(void) {
   return config_options;
 }
 
+static int64_t flush_output(struct mg_connection *conn, const char *data,
+                            int64_t len, int flags);
+
 static void *call_user(struct mg_connection *conn, enum mg_event event) {
+  void *result;
+  int out_size;
+
   conn->request_info.user_data = conn->ctx->user_data;
-  return conn->ctx->user_callback == NULL ? NULL :
-    conn->ctx->user_callback(event, conn);
+  if (conn->ctx->user_callback == NULL) {
+    return NULL;
+  }
+
+  // User callbacks expect mg_write() to hit the socket right away, so
+  // push out whatever is buffered and write unbuffered until they return.
+  if (conn->out_len > 0) {
+    (void) flush_output(conn, NULL, 0, 0);
+  }
+  out_size = conn->out_size;
+  conn->out_size = 0;
+  result = conn->ctx->user_callback(event, conn);
+  conn->out_size = out_size;
+
+  return result;
 }
 
 static int get_option_index(const char *name) {
@@ -545,12 +1146,32 @@ static void sockaddr_to_string(char *buf, size_t len,
 #endif
 }
 
-// Print error message to the opened error log stream.
+static void write_log(struct mg_connection *conn, int log,
+                      const char *line, int len);
+
+// Append formatted text to the log line, truncate if it does not fit.
+static void append_to_line(char *line, int *len, size_t size,
+                           const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(line + *len, size - *len, fmt, ap);
+  va_end(ap);
+
+  if (n < 0 || (size_t) n >= size - *len) {
+    *len = (int) size - 1;
+  } else {
+    *len += n;
+  }
+}
+
+// Print error message to the error log.
 static void cry(struct mg_connection *conn, const char *fmt, ...) {
-  char buf[MG_BUF_LEN], src_addr[20];
+  char buf[MG_BUF_LEN], line[MG_BUF_LEN + 256], src_addr[20];
   va_list ap;
-  FILE *fp;
   time_t timestamp;
+  int len = 0;
 
   va_start(ap, fmt);
   (void) vsnprintf(buf, sizeof(buf), fmt, ap);
@@ -560,30 +1181,23 @@ static void cry(struct mg_connection *conn, const char *fmt, ...) {
   // I suppose this is fine, since function cannot disappear in the
   // same way string option can.
   conn->request_info.log_message = buf;
-  if (call_user(conn, MG_EVENT_LOG) == NULL) {
-    fp = conn->ctx->config[ERROR_LOG_FILE] == NULL ? NULL :
-      mg_fopen(conn->ctx->config[ERROR_LOG_FILE], "a+");
-
-    if (fp != NULL) {
-      flockfile(fp);
-      timestamp = time(NULL);
-
-      sockaddr_to_string(src_addr, sizeof(src_addr), &conn->client.rsa);
-      fprintf(fp, "[%010lu] [error] [client %s] ", (unsigned long) timestamp,
-              src_addr);
-
-      if (conn->request_info.request_method != NULL) {
-        fprintf(fp, "%s %s: ", conn->request_info.request_method,
-                conn->request_info.uri);
-      }
-
-      (void) fprintf(fp, "%s", buf);
-      fputc('\n', fp);
-      funlockfile(fp);
-      if (fp != stderr) {
-        fclose(fp);
-      }
+  if (call_user(conn, MG_EVENT_LOG) == NULL &&
+      conn->ctx->config[ERROR_LOG_FILE] != NULL) {
+    timestamp = time(NULL);
+
+    sockaddr_to_string(src_addr, sizeof(src_addr), &conn->client.rsa);
+    append_to_line(line, &len, sizeof(line), "[%010lu] [error] [client %s] ",
+                   (unsigned long) timestamp, src_addr);
+
+    if (conn->request_info.request_method != NULL) {
+      append_to_line(line, &len, sizeof(line), "%s %s: ",
+                     conn->request_info.request_method,
+                     conn->request_info.uri);
     }
+
+    append_to_line(line, &len, sizeof(line), "%s\n", buf);
+    line[len - 1] = '\n';
+    write_log(conn, ERROR_LOG, line, len);
   }
   conn->request_info.log_message = NULL;
 }
@@ -836,6 +1450,189 @@ static int match_prefix(const char *pattern, int pattern_len, const char *str) {
   return j;
 }
 
+// Compile a match_prefix() pattern. Return NULL on error.
+static struct glob *compile_glob(struct mg_context *ctx, const char *pattern) {
+  struct glob *g;
+  struct glob_op *op;
+  char *text;
+  size_t len = strlen(pattern);
+  int i, num_ops = 1, stars = 0;
+
+  for (i = 0; pattern[i] != '\0'; i++) {
+    if (pattern[i] == '|') {
+      num_ops++;
+    }
+  }
+
+  // Worst case is one op per pattern character plus one GLOB_MATCH per
+  // alternative, of which there are num_ops at this point.
+  if ((g = (struct glob *) malloc(sizeof(*g) +
+                                  (len + num_ops) * sizeof(g->ops[0]) +
+                                  num_ops * sizeof(g->alts[0]) +
+                                  len + 1)) == NULL) {
+    cry(fc(ctx), "%s: cannot allocate pattern [%s]", __func__, pattern);
+    return NULL;
+  }
+  g->ops = op = (struct glob_op *) (g + 1);
+  g->alts = (int *) (g->ops + len + num_ops);
+  text = (char *) (g->alts + num_ops);
+  memcpy(text, pattern, len + 1);
+  g->alts[0] = 0;
+  g->num_alts = 1;
+
+  for (i = 0; ; i++) {
+    if (text[i] == '|' || text[i] == '\0') {
+      op->type = GLOB_MATCH;
+      op++;
+      if (text[i] == '\0') {
+        break;
+      }
+      g->alts[g->num_alts++] = (int) (op - g->ops);
+      stars = 0;
+    } else if (text[i] == '?' || text[i] == '$') {
+      op->type = text[i] == '?' ? GLOB_ANY : GLOB_END;
+      op++;
+    } else if (text[i] == '*') {
+      if (++stars > GLOB_MAX_STARS) {
+        cry(fc(ctx), "%s: too many wildcards in [%s]", __func__, pattern);
+        free(g);
+        return NULL;
+      }
+      op->type = text[i + 1] == '*' ? GLOB_STARSTAR : GLOB_STAR;
+      i += op->type == GLOB_STARSTAR;
+      op++;
+    } else {
+      op->type = GLOB_TEXT;
+      op->text = text + i;
+      op->len = (int) strcspn(text + i, "|?$*");
+      i += op->len - 1;
+      op++;
+    }
+  }
+
+  return g;
+}
+
+// Match one alternative of a compiled pattern against the beginning of str.
+// Return the same as match_prefix() does: the length of the matched prefix,
+// or -1. Stars grab as much as they can and give characters back one at a
+// time, innermost star first, until the rest of the pattern matches.
+static int match_glob_ops(const struct glob_op *ops, const char *str,
+                          int str_len) {
+  struct { int op, pos, len; } stars[GLOB_MAX_STARS];
+  const char *slash;
+  int i = 0, j = 0, n = 0, len;
+
+  for (;;) {
+    if (ops[i].type == GLOB_MATCH) {
+      return j;
+    } else if (ops[i].type == GLOB_END) {
+      if (j == str_len) {
+        return j;
+      }
+    } else if (ops[i].type == GLOB_ANY) {
+      if (j < str_len) {
+        i++;
+        j++;
+        continue;
+      }
+    } else if (ops[i].type == GLOB_TEXT) {
+      if (str_len - j >= ops[i].len &&
+          memcmp(str + j, ops[i].text, ops[i].len) == 0) {
+        j += ops[i].len;
+        i++;
+        continue;
+      }
+    } else {
+      len = str_len - j;
+      if (ops[i].type == GLOB_STAR &&
+          (slash = (const char *) memchr(str + j, '/', len)) != NULL) {
+        len = (int) (slash - (str + j));
+      }
+      if (ops[++i].type == GLOB_MATCH) {
+        return j + len;
+      } else if (ops[i].type == GLOB_TEXT && ops[i + 1].type == GLOB_END) {
+        // "**.cgi$" - the star can only stop right before the suffix
+        if (len >= str_len - j - ops[i].len && str_len - j >= ops[i].len) {
+          j = str_len - ops[i].len;
+          continue;
+        }
+      } else {
+        stars[n].op = i;
+        stars[n].pos = j;
+        stars[n].len = len;
+        n++;
+        j += len;
+        continue;
+      }
+    }
+
+    // Mismatch. Take characters back from the innermost star that still
+    // has any, and retry the rest of the pattern after it. A literal can
+    // only match where its first character is.
+    while (n > 0 && stars[n - 1].len == 0) {
+      n--;
+    }
+    if (n == 0) {
+      return -1;
+    }
+    i = stars[n - 1].op;
+    j = stars[n - 1].pos;
+    len = stars[n - 1].len - 1;
+    if (ops[i].type == GLOB_TEXT) {
+      while (len > 0 && str[j + len] != ops[i].text[0]) {
+        len--;
+      }
+    }
+    stars[n - 1].len = len;
+    j += len;
+  }
+}
+
+// Compiled counterpart of match_prefix(). The first alternative that
+// matches a non-empty prefix wins, otherwise the last one decides.
+static int match_glob(const struct glob *g, const char *str, int str_len) {
+  int i, res = -1;
+
+  for (i = 0; g != NULL && i < g->num_alts; i++) {
+    if ((res = match_glob_ops(g->ops + g->alts[i], str, str_len)) > 0) {
+      break;
+    }
+  }
+  return res;
+}
+
+static int set_glob_option(struct mg_context *ctx) {
+  char *hide;
+  size_t len;
+
+  if ((ctx->cgi_glob = compile_glob(ctx, ctx->config[CGI_EXTENSIONS])) ==
+      NULL ||
+      (ctx->ssi_glob = compile_glob(ctx, ctx->config[SSI_EXTENSIONS])) ==
+      NULL ||
+      (ctx->config[FASTCGI_PATTERN] != NULL &&
+       (ctx->fcgi_glob = compile_glob(ctx, ctx->config[FASTCGI_PATTERN])) ==
+       NULL)) {
+    return 0;
+  }
+
+  // Passwords files are always hidden
+  if (ctx->config[HIDE_FILES] == NULL) {
+    ctx->hide_glob = compile_glob(ctx, "**" PASSWORDS_FILE_NAME "$");
+  } else {
+    len = strlen(ctx->config[HIDE_FILES]) + sizeof(PASSWORDS_FILE_NAME) + 5;
+    if ((hide = (char *) malloc(len)) == NULL) {
+      cry(fc(ctx), "%s: cannot allocate pattern", __func__);
+      return 0;
+    }
+    mg_snprintf(fc(ctx), hide, len, "**%s$|%s", PASSWORDS_FILE_NAME,
+                ctx->config[HIDE_FILES]);
+    ctx->hide_glob = compile_glob(ctx, hide);
+    free(hide);
+  }
+  return ctx->hide_glob != NULL;
+}
+
 // HTTP 1.1 assumes keep alive if "Connection:" header is not set
 // This function must tolerate situations when connection info is not
 // set up, for example if request parsing failed.
@@ -845,6 +1642,9 @@ static int should_keep_alive(const struct mg_connection *conn) {
   if (conn->must_close ||
       conn->request_info.status_code == 401 ||
       mg_strcasecmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes") != 0 ||
+      (conn->ctx->max_requests > 0 &&
+       conn->client.num_requests >= conn->ctx->max_requests) ||
+      (conn->client.deadline > 0 && time(NULL) >= conn->client.deadline) ||
       (header != NULL && mg_strcasecmp(header, "keep-alive") != 0) ||
       (header == NULL && http_version && strcmp(http_version, "1.1"))) {
     return 0;
@@ -1081,6 +1881,7 @@ static int mg_stat(const char *path, struct mgstat *stp) {
     stp->size = MAKEUQUAD(info.nFileSizeLow, info.nFileSizeHigh);
     stp->mtime = SYS2UNIX_TIME(info.ftLastWriteTime.dwLowDateTime,
                                info.ftLastWriteTime.dwHighDateTime);
+    stp->dev = stp->ino = 0;
     stp->is_directory =
       info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY;
     ok = 0;  // Success
@@ -1089,6 +1890,19 @@ static int mg_stat(const char *path, struct mgstat *stp) {
   return ok;
 }
 
+static int mg_fstat(int fd, struct mgstat *stp) {
+  struct _stati64 st;
+
+  if (_fstati64(fd, &st) != 0) {
+    return -1;
+  }
+  stp->size = st.st_size;
+  stp->mtime = st.st_mtime;
+  stp->dev = stp->ino = 0;
+  stp->is_directory = (st.st_mode & _S_IFDIR) != 0;
+  return 0;
+}
+
 static int mg_remove(const char *path) {
   wchar_t wbuf[PATH_MAX];
   to_unicode(path, wbuf, ARRAY_SIZE(wbuf));
@@ -1267,21 +2081,39 @@ static int set_non_blocking_mode(SOCKET sock) {
   return ioctlsocket(sock, FIONBIO, &on);
 }
 
+static int set_blocking_mode(SOCKET sock) {
+  unsigned long off = 0;
+  return ioctlsocket(sock, FIONBIO, &off);
+}
+
 #else
+static int set_mgstat(int stat_result, const struct stat *st,
+                      struct mgstat *stp) {
+  if (stat_result != 0) {
+    return -1;
+  }
+  stp->size = st->st_size;
+  stp->mtime = st->st_mtime;
+  stp->dev = (int64_t) st->st_dev;
+  stp->ino = (int64_t) st->st_ino;
+  stp->is_directory = S_ISDIR(st->st_mode);
+  return 0;
+}
+
 static int mg_stat(const char *path, struct mgstat *stp) {
   struct stat st;
-  int ok;
+  return set_mgstat(stat(path, &st), &st, stp);
+}
 
-  if (stat(path, &st) == 0) {
-    ok = 0;
-    stp->size = st.st_size;
-    stp->mtime = st.st_mtime;
-    stp->is_directory = S_ISDIR(st.st_mode);
-  } else {
-    ok = -1;
-  }
+static int mg_fstat(int fd, struct mgstat *stp) {
+  struct stat st;
+  return set_mgstat(fstat(fd, &st), &st, stp);
+}
 
-  return ok;
+// Stat a file in an open directory without looking the directory up again
+static int mg_stat_in_dir(DIR *dirp, const char *name, struct mgstat *stp) {
+  struct stat st;
+  return set_mgstat(fstatat(dirfd(dirp), name, &st, 0), &st, stp);
 }
 
 static void set_close_on_exec(int fd) {
@@ -1310,8 +2142,8 @@ static pid_t spawn_process(struct mg_connection *conn, const char *prog,
   envblk = NULL; // Unused
 
   if ((pid = fork()) == -1) {
-    // Parent
-    send_http_error(conn, 500, http_500_error, "fork(): %s", strerror(ERRNO));
+    // Parent. The caller sends the error response.
+    cry(conn, "%s: fork(): %s", __func__, strerror(ERRNO));
   } else if (pid == 0) {
     // Child
     if (chdir(dir) != 0) {
@@ -1354,6 +2186,15 @@ static int set_non_blocking_mode(SOCKET sock) {
 
   return 0;
 }
+
+static int set_blocking_mode(SOCKET sock) {
+  int flags;
+
+  flags = fcntl(sock, F_GETFL, 0);
+  (void) fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+
+  return 0;
+}
 #endif // _WIN32
 
 // Write data to the IO channel - opened file descriptor, socket or SSL
@@ -1388,26 +2229,114 @@ static int64_t push(FILE *fp, SOCKET sock, SSL *ssl, const char *buf,
   return sent;
 }
 
+// Send buffered response data followed by len bytes of data, and empty
+// the output buffer. Plain connections send both with one sendmsg() call
+// per iteration; flags are passed to it, e.g. MSG_MORE when more data
+// follows right away. Return number of bytes of data sent.
+static int64_t flush_output(struct mg_connection *conn, const char *data,
+                            int64_t len, int flags) {
+  int64_t sent = 0;
+#if !defined(_WIN32)
+  struct iovec iov[2];
+  struct msghdr msg;
+  ssize_t n;
+
+  if (conn->ssl == NULL) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    iov[0].iov_base = conn->out_buf;
+    iov[0].iov_len = (size_t) conn->out_len;
+    while (iov[0].iov_len > 0 || sent < len) {
+      // Send in 1GB chunks to stay within ssize_t on 32-bit systems
+      iov[1].iov_base = (void *) (data + sent);
+      iov[1].iov_len = len - sent > (1 << 30) ? (size_t) 1 << 30 :
+        (size_t) (len - sent);
+      if ((n = sendmsg(conn->client.sock, &msg, MSG_NOSIGNAL | flags)) < 0 &&
+          ERRNO == EINTR) {
+        continue;
+      } else if (n <= 0) {
+        break;
+      } else if ((size_t) n < iov[0].iov_len) {
+        iov[0].iov_base = (char *) iov[0].iov_base + n;
+        iov[0].iov_len -= (size_t) n;
+      } else {
+        sent += n - (ssize_t) iov[0].iov_len;
+        iov[0].iov_len = 0;
+      }
+    }
+    conn->out_len = 0;
+    return sent;
+  }
+#endif // !_WIN32
+  (void) flags;
+  if (conn->out_len > 0 &&
+      push(NULL, conn->client.sock, conn->ssl, conn->out_buf,
+           (int64_t) conn->out_len) != conn->out_len) {
+    len = 0;
+  }
+  conn->out_len = 0;
+  if (len > 0) {
+    sent = push(NULL, conn->client.sock, conn->ssl, data, len);
+  }
+
+  return sent;
+}
+
+// Wait up to milliseconds for data on the socket. Return 1 if it is
+// readable, 0 on timeout, negative on error. Socket numbers may exceed
+// FD_SETSIZE once idle connections are parked, which an fd_set cannot hold.
+// Windows fd_set is a list of handles, not a bitmap, and has no such limit.
+static int poll_socket(SOCKET sock, int milliseconds) {
+#if defined(_WIN32)
+  struct timeval tv;
+  fd_set set;
+
+  tv.tv_sec = milliseconds / 1000;
+  tv.tv_usec = (milliseconds % 1000) * 1000;
+  FD_ZERO(&set);
+  FD_SET(sock, &set);
+  return select((int) sock + 1, &set, NULL, NULL, &tv);
+#else
+  struct pollfd pfd;
+
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return poll(&pfd, 1, milliseconds);
+#endif
+}
+
 // This function is needed to prevent Mongoose to be stuck in a blocking
-// socket read when user requested exit. To do that, we sleep in select
+// socket read when user requested exit. To do that, we sleep in poll
 // with a timeout, and when returned, check the context for the stop flag.
 // If it is set, we return 0, and this means that we must not continue
 // reading, must give up and close the connection and exit serving thread.
+// We also give up when the client stays silent for idle_timeout seconds,
+// or when the connection runs past its deadline.
 static int wait_until_socket_is_readable(struct mg_connection *conn) {
   int result;
-  struct timeval tv;
-  fd_set set;
+  time_t expires = 0;
+
+  // Data SSL has already decrypted does not show on the socket
+  if (conn->ssl != NULL && SSL_pending(conn->ssl) > 0) {
+    return 1;
+  }
+  if (conn->ctx->idle_timeout > 0) {
+    expires = time(NULL) + conn->ctx->idle_timeout;
+  }
+  if (conn->client.deadline > 0 &&
+      (expires == 0 || conn->client.deadline < expires)) {
+    expires = conn->client.deadline;
+  }
 
   do {
-    tv.tv_sec = 0;
-    tv.tv_usec = 300 * 1000;
-    FD_ZERO(&set);
-    FD_SET(conn->client.sock, &set);
-    result = select(conn->client.sock + 1, &set, NULL, NULL, &tv);
+    result = poll_socket(conn->client.sock, 300);
   } while ((result == 0 || (result < 0 && ERRNO == EINTR)) &&
-           conn->ctx->stop_flag == 0);
+           conn->ctx->stop_flag == 0 &&
+           (expires == 0 || time(NULL) < expires));
 
-  return conn->ctx->stop_flag || result < 0 ? 0 : 1;
+  return conn->ctx->stop_flag || result <= 0 ? 0 : 1;
 }
 
 // Read from IO channel - opened file descriptor, socket, or SSL descriptor.
@@ -1415,6 +2344,11 @@ static int wait_until_socket_is_readable(struct mg_connection *conn) {
 static int pull(FILE *fp, struct mg_connection *conn, char *buf, int len) {
   int nread;
 
+  // Whatever the client is waiting for must be on the wire before we block
+  if (fp == NULL && conn->out_len > 0) {
+    (void) flush_output(conn, NULL, 0, 0);
+  }
+
   if (fp != NULL) {
     // Use read() instead of fread(), because if we're reading from the CGI
     // pipe, fread() may block until IO buffer is filled up. We cannot afford
@@ -1431,22 +2365,138 @@ static int pull(FILE *fp, struct mg_connection *conn, char *buf, int len) {
   return conn->ctx->stop_flag ? -1 : nread;
 }
 
-int mg_read(struct mg_connection *conn, void *buf, size_t len) {
-  int n, buffered_len, nread;
+// Read more of a chunked request body into the free space of conn->buf,
+// after the data buffered between conn->body and conn->next_request.
+// Return number of bytes read, 0 if the client closed, -1 on error or if
+// there is no room left.
+static int fill_body_buffer(struct mg_connection *conn) {
+  char *start = conn->buf + conn->request_len;
+  int n, len = (int) (conn->next_request - conn->body);
 
-  assert(conn->next_request != NULL &&
-         conn->body != NULL &&
-         conn->next_request >= conn->body);
-  nread = 0;
-  if (conn->consumed_content < conn->content_len) {
+  // Move the unread data down to make room, request headers stay intact
+  if (conn->body > start) {
+    memmove(start, conn->body, (size_t) len);
+    conn->body = start;
+    conn->next_request = start + len;
+  }
+  if (conn->next_request >= conn->buf + conn->buf_size) {
+    return -1;
+  }
+  n = pull(NULL, conn, conn->next_request,
+           (int) (conn->buf + conn->buf_size - conn->next_request));
+  if (n > 0) {
+    conn->next_request += n;
+  }
+  conn->data_len = (int) (conn->next_request - conn->buf);
 
-    // Adjust number of bytes to read.
-    int64_t to_read = conn->content_len - conn->consumed_content;
-    if (to_read < (int64_t) len) {
-      len = (size_t) to_read;
+  return n;
+}
+
+// Advance the chunked request body decoder up to the next chunk data,
+// skipping line breaks, chunk extensions and trailer lines. Return 1 if
+// chunk data follows, 0 at the end of the body, -1 on error.
+static int read_chunk_header(struct mg_connection *conn) {
+  char *line, *eol, *end;
+  int64_t size;
+
+  while (conn->chunk_state != CHUNK_DATA && conn->chunk_state != CHUNK_DONE) {
+    while ((eol = (char *) memchr(conn->body, '\n',
+                                  conn->next_request - conn->body)) == NULL) {
+      if (fill_body_buffer(conn) <= 0) {
+        return -1;
+      }
+    }
+    line = conn->body;
+    conn->body = eol + 1;
+    if (eol > line && eol[-1] == '\r') {
+      eol--;
     }
 
-    // Return buffered data
+    if (conn->chunk_state == CHUNK_CRLF) {
+      if (eol != line) {
+        return -1;
+      }
+      conn->chunk_state = CHUNK_SIZE;
+    } else if (conn->chunk_state == CHUNK_TRAILER) {
+      if (eol == line) {
+        conn->chunk_state = CHUNK_DONE;
+      }
+    } else {
+      // Up to 15 hex digits, so that the size cannot overflow
+      size = isxdigit(* (unsigned char *) line) ?
+        strtoll(line, &end, 16) : -1;
+      if (size < 0 || end - line > 15 ||
+          (end != eol && *end != ';' && *end != ' ' && *end != '\t')) {
+        return -1;
+      }
+      conn->chunk_left = size;
+      conn->chunk_state = size == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+    }
+  }
+
+  return conn->chunk_state == CHUNK_DATA;
+}
+
+// Read up to len bytes of chunked request body data
+static int read_chunked_body(struct mg_connection *conn, char *buf,
+                             size_t len) {
+  int64_t to_read;
+  int n, nread = 0;
+
+  while (len > 0) {
+    if (conn->chunk_state == CHUNK_DATA && conn->chunk_left == 0) {
+      conn->chunk_state = CHUNK_CRLF;
+    }
+    if ((n = read_chunk_header(conn)) <= 0) {
+      if (n < 0 && nread == 0) {
+        nread = -1;
+      }
+      break;
+    }
+
+    // Buffered data first, then straight from the socket into buf
+    to_read = conn->chunk_left < (int64_t) len ? conn->chunk_left :
+      (int64_t) len;
+    if ((n = (int) (conn->next_request - conn->body)) > 0) {
+      if ((int64_t) n > to_read) {
+        n = (int) to_read;
+      }
+      memcpy(buf, conn->body, (size_t) n);
+      conn->body += n;
+    } else if ((n = pull(NULL, conn, buf, (int) to_read)) <= 0) {
+      if (nread == 0) {
+        nread = -1;
+      }
+      break;
+    }
+    conn->chunk_left -= n;
+    conn->consumed_content += n;
+    nread += n;
+    buf += n;
+    len -= n;
+  }
+
+  return nread;
+}
+
+int mg_read(struct mg_connection *conn, void *buf, size_t len) {
+  int n, buffered_len, nread;
+
+  assert(conn->next_request != NULL &&
+         conn->body != NULL &&
+         conn->next_request >= conn->body);
+  nread = 0;
+  if (conn->chunk_state != CHUNK_NONE) {
+    nread = read_chunked_body(conn, (char *) buf, len);
+  } else if (conn->consumed_content < conn->content_len) {
+
+    // Adjust number of bytes to read.
+    int64_t to_read = conn->content_len - conn->consumed_content;
+    if (to_read < (int64_t) len) {
+      len = (size_t) to_read;
+    }
+
+    // Return buffered data
     buffered_len = conn->next_request - conn->body;
     if (buffered_len > 0) {
       if (len < (size_t) buffered_len) {
@@ -1467,6 +2517,10 @@ int mg_read(struct mg_connection *conn, void *buf, size_t len) {
         nread = n;  // Propagate the error
         break;
       } else if (n == 0) {
+        // Response body which ends when the server closes the connection
+        if (conn->content_len == INT64_MAX) {
+          conn->content_len = conn->consumed_content;
+        }
         break;  // No more data to read
       } else {
         buf = (char *) buf + n;
@@ -1479,9 +2533,295 @@ int mg_read(struct mg_connection *conn, void *buf, size_t len) {
   return nread;
 }
 
+// Small writes are collected in the connection's output buffer and go out
+// together at the next flush point: when the buffer fills up, before
+// reading from the client, when a request is done or the connection closes.
+static int write_output(struct mg_connection *conn, const char *buf,
+                        size_t len) {
+  if (conn->out_size > 0 && len <= (size_t) (conn->out_size - conn->out_len)) {
+    memcpy(conn->out_buf + conn->out_len, buf, len);
+    conn->out_len += (int) len;
+    return (int) len;
+  }
+  return (int) flush_output(conn, buf, (int64_t) len, 0);
+}
+
+// Write response body data, framed as a chunk if the body is chunked
+static int write_body(struct mg_connection *conn, const char *buf,
+                      size_t len) {
+  char size[20];
+  int n;
+
+  if (!conn->chunked) {
+    return write_output(conn, buf, len);
+  } else if (len == 0) {
+    return 0;  // Empty chunk would end the body
+  }
+  n = mg_snprintf(conn, size, sizeof(size), "%lx\r\n", (unsigned long) len);
+  if (write_output(conn, size, (size_t) n) != n ||
+      write_output(conn, buf, len) != (int) len ||
+      write_output(conn, "\r\n", 2) != 2) {
+    return -1;
+  }
+  return (int) len;
+}
+
+// Return 1 if a response body of unknown length can go out in chunked
+// encoding, which HTTP/1.0 clients do not understand. Otherwise mark the
+// connection to be closed, closing it ends the body.
+static int use_chunked_encoding(struct mg_connection *conn) {
+  if (!strcmp(conn->request_info.http_version, "1.1")) {
+    return 1;
+  }
+  conn->must_close = 1;
+  return 0;
+}
+
+// End chunked response body with the last, empty chunk
+static void finish_chunked_body(struct mg_connection *conn) {
+  if (conn->chunked) {
+    conn->chunked = 0;
+    (void) write_output(conn, "0\r\n\r\n", 5);
+  }
+}
+
+// Return 1 if the Accept-Encoding: header allows the content coding,
+// by its name or by "*", with a non-zero quality value.
+static int accepts_coding(const struct mg_connection *conn, const char *name) {
+  const char *list = mg_get_header(conn, "Accept-Encoding"), *q;
+  size_t name_len = strlen(name);
+  struct vec vec;
+  int found = 0, star = 0, accepted;
+
+  while ((list = next_option(list, &vec, NULL)) != NULL) {
+    while (vec.len > 0 && isspace(* (const unsigned char *) vec.ptr)) {
+      vec.ptr++;
+      vec.len--;
+    }
+    // Quality value "q=0", "q=0.0" etc. refuses the coding
+    accepted = 1;
+    if ((q = (const char *) memchr(vec.ptr, ';', vec.len)) != NULL) {
+      vec.len = q - vec.ptr;
+      q += strspn(q, "; \t");
+      accepted = (q[0] != 'q' && q[0] != 'Q') || q[1] != '=' ||
+        strtod(q + 2, NULL) > 0;
+    }
+    while (vec.len > 0 &&
+           isspace(((const unsigned char *) vec.ptr)[vec.len - 1])) {
+      vec.len--;
+    }
+    if (vec.len == name_len && !mg_strncasecmp(vec.ptr, name, name_len)) {
+      return accepted;
+    } else if (vec.len == 1 && vec.ptr[0] == '*') {
+      found = 1;
+      star = accepted;
+    }
+  }
+
+  return found && star;
+}
+
+// Return 1 if on-the-fly compression may run now: the budget is set and
+// not yet spent within the current second.
+static int compression_allowed(struct mg_context *ctx) {
+  time_t now = time(NULL);
+  int allowed;
+
+  if (ctx->z_budget <= 0) {
+    return 0;
+  }
+  (void) pthread_mutex_lock(&ctx->z_mutex);
+  if (ctx->z_window != now) {
+    ctx->z_window = now;
+    ctx->z_used = 0;
+  }
+  allowed = ctx->z_used < ctx->z_budget;
+  (void) pthread_mutex_unlock(&ctx->z_mutex);
+
+  return allowed;
+}
+
+#if defined(USE_ZLIB)
+// Thread CPU time in microseconds, for compression_cpu_budget accounting
+static long thread_cpu_usec(void) {
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+    return (long) ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+  }
+#endif
+  return (long) ((double) clock() * 1000000.0 / CLOCKS_PER_SEC);
+}
+
+// Account CPU time spent compressing. Return 1 if the budget of the
+// current second is still not exhausted.
+static int charge_compression(struct mg_context *ctx, long usec) {
+  time_t now = time(NULL);
+  int allowed;
+
+  (void) pthread_mutex_lock(&ctx->z_mutex);
+  if (ctx->z_window != now) {
+    ctx->z_window = now;
+    ctx->z_used = 0;
+  }
+  ctx->z_used += usec < 0 ? 0 : usec;
+  allowed = ctx->z_used < ctx->z_budget;
+  (void) pthread_mutex_unlock(&ctx->z_mutex);
+
+  return allowed;
+}
+
+// Gzip stream wrapped around mg_write() while a generated response body
+// is being sent. When the CPU budget runs out mid-stream, the rest of the
+// stream is stored rather than compressed.
+struct compressor {
+  z_stream zs;
+  int throttled;
+};
+
+// Allocate gzip compressor for the response, if the client accepts gzip
+// and the CPU budget allows. It is installed with start_compression()
+// once the response headers are written.
+static struct compressor *new_compressor(struct mg_connection *conn) {
+  struct compressor *z;
+
+  if (!accepts_coding(conn, "gzip") || !compression_allowed(conn->ctx) ||
+      (z = (struct compressor *) calloc(1, sizeof(*z))) == NULL) {
+    return NULL;
+  }
+  // 15 window bits plus 16 select the gzip wrapper
+  if (deflateInit2(&z->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    cry(conn, "%s: deflateInit2 failed", __func__);
+    free(z);
+    return NULL;
+  }
+
+  return z;
+}
+
+static void free_compressor(struct compressor *z) {
+  (void) deflateEnd(&z->zs);
+  free(z);
+}
+
+// Feed data to the connection's compressor and write out what it produces.
+// Return number of bytes of data consumed, or -1 on write error.
+static int compress_output(struct mg_connection *conn, const char *data,
+                           size_t len, int flush) {
+  struct compressor *z = conn->zs;
+  char buf[MG_BUF_LEN];
+  int status, have;
+  long usec;
+
+  z->zs.next_in = (Bytef *) data;
+  z->zs.avail_in = (uInt) len;
+  do {
+    z->zs.next_out = (Bytef *) buf;
+    z->zs.avail_out = sizeof(buf);
+    usec = thread_cpu_usec();
+    status = deflate(&z->zs, flush);
+    if (!charge_compression(conn->ctx, thread_cpu_usec() - usec) &&
+        !z->throttled && status == Z_OK) {
+      // Flushes what is pending at the old level, may need more room
+      z->throttled = deflateParams(&z->zs, Z_NO_COMPRESSION,
+                                   Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+    have = (int) (sizeof(buf) - z->zs.avail_out);
+    if (have > 0 && write_body(conn, buf, (size_t) have) != have) {
+      return -1;
+    }
+  } while (status != Z_STREAM_ERROR &&
+           (z->zs.avail_out == 0 || z->zs.avail_in > 0));
+
+  return (int) len;
+}
+
+// Install the compressor, so that mg_write() compresses from now on
+static void start_compression(struct mg_connection *conn,
+                              struct compressor *z) {
+  conn->zs = z;
+}
+
+// Write the gzip trailer and go back to plain mg_write()
+static void finish_compression(struct mg_connection *conn) {
+  if (conn->zs != NULL) {
+    (void) compress_output(conn, NULL, 0, Z_FINISH);
+    free_compressor(conn->zs);
+    conn->zs = NULL;
+  }
+}
+
+// Replace the listing with its gzip encoding. Return 0 on error.
+static int compress_listing(struct mg_context *ctx, struct dir_listing *dl) {
+  z_stream zs;
+  uLong size;
+  char *data;
+  long usec;
+  int status;
+
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return 0;
+  }
+  // Gzip header and trailer are not included in the bound
+  size = deflateBound(&zs, (uLong) dl->len) + 32;
+  if ((data = (char *) malloc(size)) == NULL) {
+    (void) deflateEnd(&zs);
+    return 0;
+  }
+
+  zs.next_in = (Bytef *) dl->data;
+  zs.avail_in = (uInt) dl->len;
+  zs.next_out = (Bytef *) data;
+  zs.avail_out = (uInt) size;
+  usec = thread_cpu_usec();
+  status = deflate(&zs, Z_FINISH);
+  (void) charge_compression(ctx, thread_cpu_usec() - usec);
+  (void) deflateEnd(&zs);
+
+  if (status != Z_STREAM_END) {
+    free(data);
+    return 0;
+  }
+  free(dl->data);
+  dl->data = data;
+  dl->len = size - zs.avail_out;
+  dl->size = size;
+
+  return 1;
+}
+#else
+static struct compressor *new_compressor(struct mg_connection *conn) {
+  (void) conn;
+  return NULL;
+}
+
+static void start_compression(struct mg_connection *conn,
+                              struct compressor *z) {
+  (void) conn;
+  (void) z;
+}
+
+static void finish_compression(struct mg_connection *conn) {
+  (void) conn;
+}
+
+static int compress_listing(struct mg_context *ctx, struct dir_listing *dl) {
+  (void) ctx;
+  (void) dl;
+  return 0;
+}
+#endif // USE_ZLIB
+
 int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
-  return (int) push(NULL, conn->client.sock, conn->ssl, (const char *) buf,
-                    (int64_t) len);
+#if defined(USE_ZLIB)
+  if (conn->zs != NULL) {
+    return compress_output(conn, (const char *) buf, len, Z_NO_FLUSH);
+  }
+#endif
+  return write_body(conn, (const char *) buf, len);
 }
 
 int mg_printf(struct mg_connection *conn, const char *fmt, ...) {
@@ -1663,8 +3003,8 @@ static int convert_uri_to_file_name(struct mg_connection *conn, char *buf,
     for (p = buf + strlen(buf); p > buf + 1; p--) {
       if (*p == '/') {
         *p = '\0';
-        if (match_prefix(conn->ctx->config[CGI_EXTENSIONS],
-                         strlen(conn->ctx->config[CGI_EXTENSIONS]), buf) > 0 &&
+        if ((match_glob(conn->ctx->cgi_glob, buf, (int) (p - buf)) > 0 ||
+             match_glob(conn->ctx->fcgi_glob, buf, (int) (p - buf)) > 0) &&
             (stat_result = mg_stat(buf, st)) == 0) {
           // Shift PATH_INFO block one character right, e.g.
           //  "/x.cgi/foo/bar\x00" => "/x.cgi\x00/foo/bar\x00"
@@ -1692,28 +3032,78 @@ static int sslize(struct mg_connection *conn, SSL_CTX *s, int (*func)(SSL *)) {
     func(conn->ssl) == 1;
 }
 
+// Return the offset of the first control character, \r and \n included,
+// among the 16 bytes at p, or 16 if there is none. Header text has one
+// every few dozen bytes, so the request scanner jumps from one to the next.
+static int find_control_char(const unsigned char *p) {
+#if defined(USE_SSE2)
+  __m128i v = _mm_loadu_si128((const __m128i *) p);
+  __m128i low = _mm_set1_epi8(0x1f);
+  __m128i ctl = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, low), low),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+  unsigned int mask = (unsigned int) _mm_movemask_epi8(ctl) | 0x10000;
+#if defined(_MSC_VER)
+  unsigned long i;
+  _BitScanForward(&i, mask);
+  return (int) i;
+#else
+  return __builtin_ctz(mask);
+#endif
+#elif defined(USE_NEON)
+  uint8x16_t v = vld1q_u8(p);
+  uint8x16_t ctl = vorrq_u8(vcleq_u8(v, vdupq_n_u8(0x1f)),
+                            vceqq_u8(v, vdupq_n_u8(0x7f)));
+  // Narrow the byte mask to four bits per byte
+  uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+      vshrn_n_u16(vreinterpretq_u16_u8(ctl), 4)), 0);
+  return mask == 0 ? 16 : __builtin_ctzll(mask) >> 2;
+#else
+  int i;
+
+  for (i = 0; i < 16 && p[i] >= 0x20 && p[i] != 0x7f; i++) {
+  }
+  return i;
+#endif
+}
+
 // Check whether full request is buffered. Return:
 //   -1  if request is malformed
 //    0  if request is not yet fully buffered
 //   >0  actual request length, including last \r\n\r\n
-static int get_request_len(const char *buf, int buflen) {
-  const char *s, *e;
-  int len = 0;
-
-  for (s = buf, e = s + buflen - 1; len <= 0 && s < e; s++)
-    // Control characters are not allowed but >=128 is.
-    if (!isprint(* (const unsigned char *) s) && *s != '\r' &&
-        *s != '\n' && * (const unsigned char *) s < 128) {
-      len = -1;
-      break; // [i_a] abort scan as soon as one malformed character is found; don't let subsequent \r\n\r\n win us over anyhow
-    } else if (s[0] == '\n' && s[1] == '\n') {
-      len = (int) (s - buf) + 2;
-    } else if (s[0] == '\n' && &s[1] < e &&
-        s[1] == '\r' && s[2] == '\n') {
-      len = (int) (s - buf) + 3;
+// Scanning starts at *scanned, and on return *scanned is set to the point
+// the next call may resume from once more data is appended to buf.
+static int scan_request(const char *buf, int buflen, int *scanned) {
+  const unsigned char *s = (const unsigned char *) buf;
+  int i, n, last = buflen - 1;
+
+  for (i = *scanned; i < last; i++) {
+    while (i + 16 <= last && (n = find_control_char(s + i)) > 0) {
+      i += n;
+    }
+    if (i >= last) {
+      break;
+    } else if (s[i] == '\n' && s[i + 1] == '\n') {
+      return i + 2;
+    } else if (s[i] == '\n' && s[i + 1] == '\r') {
+      if (i + 2 >= buflen) {
+        break;  // Need one more byte to tell whether this is the end
+      } else if (s[i + 2] == '\n') {
+        return i + 3;
+      }
+    } else if ((s[i] < 0x20 && s[i] != '\r' && s[i] != '\n') ||
+               s[i] == 0x7f) {
+      // Control characters are not allowed but >=128 is.
+      return -1;
     }
+  }
+  *scanned = i;
 
-  return len;
+  return 0;
+}
+
+static int get_request_len(const char *buf, int buflen) {
+  int scanned = 0;
+  return scan_request(buf, buflen, &scanned);
 }
 
 // Convert month to the month number. Return -1 on error, or month number
@@ -1825,6 +3215,13 @@ static const struct {
   {".asf", 4, "video/x-ms-asf"},
   {".avi", 4, "video/x-msvideo"},
   {".bmp", 4, "image/bmp"},
+  {".pkg", 4, "application/octet-stream"},
+  {".txz", 4, "application/x-xz"},
+  {".xz",  3, "application/x-xz"},
+  {".tbz", 4, "application/x-bzip2"},
+  {".bz2", 4, "application/x-bzip2"},
+  {".tzst", 5, "application/zstd"},
+  {".zst", 4, "application/zstd"},
   {NULL,  0, NULL}
 };
 
@@ -1845,30 +3242,129 @@ const char *mg_get_builtin_mime_type(const char *path) {
   return "text/plain";
 }
 
-// Look at the "path" extension and figure what mime type it has.
-// Store mime type in the vector.
-static void get_mime_type(struct mg_context *ctx, const char *path,
-                          struct vec *vec) {
+static unsigned long hash_extension(const char *ext, size_t len) {
+  unsigned long hash = 5381;
+
+  while (len-- > 0) {
+    hash = hash * 33 + (unsigned long) lowercase(ext++);
+  }
+  return hash;
+}
+
+// Add the mapping unless the extension is already in the table, so the
+// first definition wins.
+static void insert_mime_type(struct mg_context *ctx, const char *ext,
+                             size_t ext_len, const char *mime_type,
+                             size_t mime_len) {
+  struct mime_entry *e;
+  unsigned long i;
+
+  for (i = hash_extension(ext, ext_len); ; i++) {
+    e = &ctx->mime_table[i & ctx->mime_mask];
+    if (e->extension == NULL) {
+      e->extension = ext;
+      e->ext_len = ext_len;
+      e->mime_type = mime_type;
+      e->mime_len = mime_len;
+      return;
+    } else if (e->ext_len == ext_len &&
+               mg_strncasecmp(e->extension, ext, ext_len) == 0) {
+      return;
+    }
+  }
+}
+
+// Build the mime type table from extra_mime_types and builtin_mime_types.
+// User-defined types go in first, so they override builtin ones. Those
+// that are not a single ".ext" keep the old suffix matching semantics.
+static int set_mime_option(struct mg_context *ctx) {
   struct vec ext_vec, mime_vec;
-  const char *list, *ext;
-  size_t path_len;
+  const char *list;
+  size_t i, n, size;
 
-  path_len = strlen(path);
+  n = ARRAY_SIZE(builtin_mime_types);
+  list = ctx->config[EXTRA_MIME_TYPES];
+  while ((list = next_option(list, &ext_vec, &mime_vec)) != NULL) {
+    n++;
+  }
+
+  // Keep the load factor under 1/4, so lookups rarely probe twice
+  for (size = 1; size < n * 4; size <<= 1)
+    ;
+  ctx->mime_mask = (unsigned long) size - 1;
+  ctx->mime_table = (struct mime_entry *)
+    calloc(size, sizeof(ctx->mime_table[0]));
+  ctx->mime_suffixes = (struct mime_entry *)
+    calloc(n, sizeof(ctx->mime_suffixes[0]));
+  if (ctx->mime_table == NULL || ctx->mime_suffixes == NULL) {
+    cry(fc(ctx), "%s: cannot allocate mime types table", __func__);
+    return 0;
+  }
 
-  // Scan user-defined mime types first, in case user wants to
-  // override default mime types.
   list = ctx->config[EXTRA_MIME_TYPES];
   while ((list = next_option(list, &ext_vec, &mime_vec)) != NULL) {
-    // ext now points to the path suffix
-    ext = path + path_len - ext_vec.len;
-    if (mg_strncasecmp(ext, ext_vec.ptr, ext_vec.len) == 0) {
-      *vec = mime_vec;
+    if (ext_vec.len > 1 && ext_vec.ptr[0] == '.' &&
+        memchr(ext_vec.ptr + 1, '.', ext_vec.len - 1) == NULL) {
+      insert_mime_type(ctx, ext_vec.ptr, ext_vec.len,
+                       mime_vec.ptr, mime_vec.len);
+    } else {
+      ctx->mime_suffixes[ctx->num_mime_suffixes].extension = ext_vec.ptr;
+      ctx->mime_suffixes[ctx->num_mime_suffixes].ext_len = ext_vec.len;
+      ctx->mime_suffixes[ctx->num_mime_suffixes].mime_type = mime_vec.ptr;
+      ctx->mime_suffixes[ctx->num_mime_suffixes].mime_len = mime_vec.len;
+      ctx->num_mime_suffixes++;
+    }
+  }
+  for (i = 0; builtin_mime_types[i].extension != NULL; i++) {
+    insert_mime_type(ctx, builtin_mime_types[i].extension,
+                     builtin_mime_types[i].ext_len,
+                     builtin_mime_types[i].mime_type,
+                     strlen(builtin_mime_types[i].mime_type));
+  }
+
+  return 1;
+}
+
+// Look at the "path" extension and figure what mime type it has.
+// Store mime type in the vector.
+static void get_mime_type(struct mg_context *ctx, const char *path,
+                          struct vec *vec) {
+  const struct mime_entry *e;
+  const char *ext, *end;
+  unsigned long i;
+  int k;
+
+  end = path + strlen(path);
+
+  for (k = 0; k < ctx->num_mime_suffixes; k++) {
+    e = &ctx->mime_suffixes[k];
+    if ((size_t) (end - path) > e->ext_len &&
+        mg_strncasecmp(end - e->ext_len, e->extension, e->ext_len) == 0) {
+      vec->ptr = e->mime_type;
+      vec->len = e->mime_len;
       return;
     }
   }
 
-  vec->ptr = mg_get_builtin_mime_type(path);
-  vec->len = strlen(vec->ptr);
+  for (ext = end; ext > path && ext[-1] != '.' && ext[-1] != '/'; ext--)
+    ;
+  if (ext > path + 1 && ext[-1] == '.') {
+    ext--;
+    for (i = hash_extension(ext, end - ext); ; i++) {
+      e = &ctx->mime_table[i & ctx->mime_mask];
+      if (e->extension == NULL) {
+        break;
+      } else if (e->ext_len == (size_t) (end - ext) &&
+                 mg_strncasecmp(e->extension, ext, e->ext_len) == 0) {
+        vec->ptr = e->mime_type;
+        vec->len = e->mime_len;
+        return;
+      }
+    }
+  }
+
+  vec->ptr = "text/plain";
+  vec->len = 10;
 }
 
 #ifndef HAVE_MD5
@@ -2059,6 +3555,167 @@ static void MD5Final(unsigned char digest[16], MD5_CTX *ctx) {
 }
 #endif // !HAVE_MD5
 
+// SHA-256 of uploaded files, see FIPS 180-4
+struct sha256_ctx {
+  uint32_t state[8];
+  uint64_t len;            // Number of bytes hashed
+  unsigned char buf[64];   // Partial block
+};
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_init(struct sha256_ctx *ctx) {
+  static const uint32_t h[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  memcpy(ctx->state, h, sizeof(h));
+  ctx->len = 0;
+}
+
+static void sha256_transform(uint32_t state[8], const unsigned char *p) {
+  uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+
+  for (i = 0; i < 16; i++, p += 4) {
+    w[i] = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+      (uint32_t) p[2] << 8 | p[3];
+  }
+  for (; i < 64; i++) {
+    w[i] = w[i - 16] + w[i - 7] +
+      (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+      (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+  }
+
+  a = state[0], b = state[1], c = state[2], d = state[3];
+  e = state[4], f = state[5], g = state[6], h = state[7];
+  for (i = 0; i < 64; i++) {
+    t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+      (g ^ (e & (f ^ g))) + sha256_k[i] + w[i];
+    t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+      ((a & b) | (c & (a | b)));
+    h = g, g = f, f = e, e = d + t1;
+    d = c, c = b, b = a, a = t1 + t2;
+  }
+  state[0] += a, state[1] += b, state[2] += c, state[3] += d;
+  state[4] += e, state[5] += f, state[6] += g, state[7] += h;
+}
+
+static void sha256_update(struct sha256_ctx *ctx, const unsigned char *data,
+                          size_t len) {
+  size_t n, used = (size_t) (ctx->len & 63);
+
+  ctx->len += len;
+  if (used > 0) {
+    n = 64 - used < len ? 64 - used : len;
+    memcpy(ctx->buf + used, data, n);
+    data += n;
+    len -= n;
+    if (used + n < 64) {
+      return;
+    }
+    sha256_transform(ctx->state, ctx->buf);
+  }
+  for (; len >= 64; data += 64, len -= 64) {
+    sha256_transform(ctx->state, data);
+  }
+  memcpy(ctx->buf, data, len);
+}
+
+static void sha256_final(unsigned char digest[32], struct sha256_ctx *ctx) {
+  unsigned char pad[72];
+  uint64_t bits = ctx->len * 8;
+  size_t n = 64 - (size_t) ((ctx->len + 8) & 63);  // 0x80 and zeros
+  int i;
+
+  memset(pad, 0, sizeof(pad));
+  pad[0] = 0x80;
+  for (i = 0; i < 8; i++) {
+    pad[n + i] = (unsigned char) (bits >> (56 - 8 * i));
+  }
+  sha256_update(ctx, pad, n + 8);
+  for (i = 0; i < 32; i++) {
+    digest[i] = (unsigned char) (ctx->state[i / 4] >> (24 - 8 * (i % 4)));
+  }
+}
+
+// SHA-256 of an upload. libcrypto's implementation is used when it is
+// loaded, it is several times faster than the code above on CPUs with
+// SHA instructions.
+struct upload_hash {
+  struct sha256_ctx sha;
+  EVP_MD_CTX *evp;
+};
+
+static void upload_hash_init(struct upload_hash *h) {
+  h->evp = NULL;
+#if !defined(NO_SSL)
+  if (HAVE_EVP_SHA256 && (h->evp = EVP_MD_CTX_new()) != NULL &&
+      !EVP_DigestInit_ex(h->evp, EVP_sha256(), NULL)) {
+    EVP_MD_CTX_free(h->evp);
+    h->evp = NULL;
+  }
+#endif // !NO_SSL
+  sha256_init(&h->sha);
+}
+
+static void upload_hash_update(struct upload_hash *h, const void *data,
+                               size_t len) {
+#if !defined(NO_SSL)
+  if (h->evp != NULL) {
+    (void) EVP_DigestUpdate(h->evp, data, len);
+    return;
+  }
+#endif // !NO_SSL
+  sha256_update(&h->sha, (const unsigned char *) data, len);
+}
+
+static void upload_hash_final(unsigned char digest[32],
+                              struct upload_hash *h) {
+#if !defined(NO_SSL)
+  if (h->evp != NULL) {
+    (void) EVP_DigestFinal_ex(h->evp, digest, NULL);
+    EVP_MD_CTX_free(h->evp);
+    return;
+  }
+#endif // !NO_SSL
+  sha256_final(digest, &h->sha);
+}
+
+// Encode src_len bytes of src in base64. Output buffer must be at least
+// (src_len + 2) / 3 * 4 + 1 bytes.
+static void base64_encode(const unsigned char *src, int src_len, char *dst) {
+  static const char *b64 =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  int i, j = 0, a, b, c;
+
+  for (i = 0; i < src_len; i += 3) {
+    a = src[i];
+    b = i + 1 < src_len ? src[i + 1] : 0;
+    c = i + 2 < src_len ? src[i + 2] : 0;
+    dst[j++] = b64[a >> 2];
+    dst[j++] = b64[((a & 3) << 4) | (b >> 4)];
+    dst[j++] = i + 1 < src_len ? b64[((b & 15) << 2) | (c >> 6)] : '=';
+    dst[j++] = i + 2 < src_len ? b64[c & 63] : '=';
+  }
+  dst[j] = '\0';
+}
+
 // Stringify binary data. Output buffer must be twice as big as input,
 // because each byte takes 2 bytes in string representation
 static void bin2str(char *to, const unsigned char *p, size_t len) {
@@ -2118,36 +3775,192 @@ static int check_password(const char *method, const char *ha1, const char *uri,
   return mg_strcasecmp(response, expected_response) == 0;
 }
 
-// Use the global passwords file, if specified by auth_gpass option,
-// or search for .htpasswd in the requested directory.
-static FILE *open_auth_file(struct mg_connection *conn, const char *path) {
-  struct mg_context *ctx = conn->ctx;
-  char name[PATH_MAX];
-  const char *p, *e;
-  struct mgstat st;
-  FILE *fp;
+static int same_file(const struct mgstat *a, const struct mgstat *b) {
+  return a->size == b->size && a->mtime == b->mtime &&
+    a->dev == b->dev && a->ino == b->ino;
+}
 
-  if (ctx->config[GLOBAL_PASSWORDS_FILE] != NULL) {
+static unsigned long hash_path(const char *path) {
+  unsigned long hash = 5381;
+
+  while (*path != '\0') {
+    hash = hash * 33 + (unsigned char) *path++;
+  }
+  return hash;
+}
+
+static unsigned long hash_user(const char *user, const char *domain) {
+  return hash_path(user) * 31 + hash_path(domain);
+}
+
+static void free_auth_file(struct auth_file *f) {
+  struct auth_user *u, *next;
+  unsigned long i;
+
+  for (i = 0; f->users != NULL && i <= f->users_mask; i++) {
+    for (u = f->users[i]; u != NULL; u = next) {
+      next = u->next;
+      free(u);
+    }
+  }
+  free(f->users);
+  free(f->path);
+  free(f);
+}
+
+// Read the whole passwords file into memory. Return NULL on error.
+static struct auth_file *load_auth_file(const char *path,
+                                        const struct mgstat *stp) {
+  char line[256], f_user[256], ha1[256], f_domain[256];
+  struct auth_file *f;
+  struct auth_user *u, **bucket;
+  size_t len_user, len_domain, len_ha1;
+  unsigned long n = 0, size;
+  FILE *fp;
+
+  if ((fp = mg_fopen(path, "r")) == NULL) {
+    return NULL;
+  }
+
+  // Size the hash for the number of lines, an entry takes at least one
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    n++;
+  }
+  rewind(fp);
+
+  if ((f = (struct auth_file *) calloc(1, sizeof(*f))) == NULL ||
+      (f->path = mg_strdup(path)) == NULL) {
+    free(f);
+    (void) fclose(fp);
+    return NULL;
+  }
+  for (size = 1; size < n; size <<= 1)
+    ;
+  f->users_mask = size - 1;
+  if ((f->users = (struct auth_user **)
+       calloc(size, sizeof(f->users[0]))) == NULL) {
+    free_auth_file(f);
+    (void) fclose(fp);
+    return NULL;
+  }
+  f->st = *stp;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "%[^:]:%[^:]:%s", f_user, f_domain, ha1) != 3) {
+      continue;
+    }
+    len_user = strlen(f_user) + 1;
+    len_domain = strlen(f_domain) + 1;
+    len_ha1 = strlen(ha1) + 1;
+    if ((u = (struct auth_user *) malloc(sizeof(*u) + len_user +
+                                         len_domain + len_ha1)) == NULL) {
+      break;
+    }
+    u->user = (char *) (u + 1);
+    u->domain = u->user + len_user;
+    u->ha1 = u->domain + len_domain;
+    memcpy(u->user, f_user, len_user);
+    memcpy(u->domain, f_domain, len_domain);
+    memcpy(u->ha1, ha1, len_ha1);
+
+    // Append, so that the first entry for the user wins, like with a scan
+    bucket = &f->users[hash_user(f_user, f_domain) & f->users_mask];
+    while (*bucket != NULL) {
+      bucket = &(*bucket)->next;
+    }
+    u->next = NULL;
+    *bucket = u;
+  }
+  (void) fclose(fp);
+
+  return f;
+}
+
+// Find user's HA1 in the passwords file and copy it into the buffer. The
+// file is read once and kept in memory until its size or mtime changes.
+// Return 1 if the user is found.
+static int lookup_ha1(struct mg_context *ctx, const char *path,
+                      const struct mgstat *stp, const char *user,
+                      const char *domain, char *ha1, size_t ha1_len) {
+  struct auth_file *f, *loaded = NULL, **pp;
+  struct auth_user *u;
+  int found = 0;
+
+  (void) pthread_mutex_lock(&ctx->auth_mutex);
+  for (;;) {
+    for (pp = &ctx->auth_files[hash_path(path) % AUTH_FILE_BUCKETS];
+         (f = *pp) != NULL; pp = &f->next) {
+      if (!strcmp(f->path, path)) {
+        break;
+      }
+    }
+    if (f != NULL && !same_file(&f->st, stp)) {
+      // Passwords file has changed, forget the old one
+      *pp = f->next;
+      free_auth_file(f);
+      f = NULL;
+    }
+    if (f == NULL && loaded != NULL) {
+      loaded->next = *pp;
+      *pp = f = loaded;
+    } else if (f == NULL) {
+      // Read the file without holding the lock, then look again
+      (void) pthread_mutex_unlock(&ctx->auth_mutex);
+      if ((loaded = load_auth_file(path, stp)) == NULL) {
+        return 0;
+      }
+      (void) pthread_mutex_lock(&ctx->auth_mutex);
+      continue;
+    } else if (loaded != NULL) {
+      // Another worker has loaded it meanwhile
+      free_auth_file(loaded);
+    }
+    break;
+  }
+
+  for (u = f->users[hash_user(user, domain) & f->users_mask]; u != NULL;
+       u = u->next) {
+    if (!strcmp(u->user, user) && !strcmp(u->domain, domain)) {
+      mg_strlcpy(ha1, u->ha1, ha1_len);
+      found = 1;
+      break;
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->auth_mutex);
+
+  return found;
+}
+
+// Use the global passwords file, if specified by auth_gpass option,
+// or search for .htpasswd in the requested directory. Return 0 if there
+// is no passwords file, 1 if it is found and stat-ed into *stp.
+static int get_auth_file(struct mg_connection *conn, const char *path,
+                         char *name, size_t name_len, struct mgstat *stp) {
+  struct mg_context *ctx = conn->ctx;
+  const char *p, *e;
+  struct mgstat st;
+
+  if (ctx->config[GLOBAL_PASSWORDS_FILE] != NULL) {
     // Use global passwords file
-    fp =  mg_fopen(ctx->config[GLOBAL_PASSWORDS_FILE], "r");
-    if (fp == NULL)
-      cry(fc(ctx), "fopen(%s): %s",
-          ctx->config[GLOBAL_PASSWORDS_FILE], strerror(ERRNO));
+    mg_strlcpy(name, ctx->config[GLOBAL_PASSWORDS_FILE], name_len);
+    if (mg_stat(name, stp) != 0) {
+      cry(fc(ctx), "fopen(%s): %s", name, strerror(ERRNO));
+      return 0;
+    }
+    return 1;
   } else if (!mg_stat(path, &st) && st.is_directory) {
-    (void) mg_snprintf(conn, name, sizeof(name), "%s%c%s",
+    (void) mg_snprintf(conn, name, name_len, "%s%c%s",
         path, DIRSEP, PASSWORDS_FILE_NAME);
-    fp = mg_fopen(name, "r");
   } else {
      // Try to find .htpasswd in requested directory.
     for (p = path, e = p + strlen(p) - 1; e > p; e--)
       if (IS_DIRSEP_CHAR(*e))
         break;
-    (void) mg_snprintf(conn, name, sizeof(name), "%.*s%c%s",
+    (void) mg_snprintf(conn, name, name_len, "%.*s%c%s",
         (int) (e - p), p, DIRSEP, PASSWORDS_FILE_NAME);
-    fp = mg_fopen(name, "r");
   }
 
-  return fp;
+  return mg_stat(name, stp) == 0;
 }
 
 // Parsed Authorization header
@@ -2211,6 +4024,8 @@ static int parse_auth_header(struct mg_connection *conn, char *buf,
 
   // CGI needs it as REMOTE_USER
   if (ah->user != NULL) {
+    // Set anew by every check of the request against a passwords file
+    free((void *) conn->request_info.remote_user);
     conn->request_info.remote_user = mg_strdup(ah->user);
   } else {
     return 0;
@@ -2219,65 +4034,51 @@ static int parse_auth_header(struct mg_connection *conn, char *buf,
   return 1;
 }
 
-// Authorize against the opened passwords file. Return 1 if authorized.
-static int authorize(struct mg_connection *conn, FILE *fp) {
+// Authorize against the passwords file. Return 1 if authorized.
+static int authorize(struct mg_connection *conn, const char *path,
+                     const struct mgstat *stp) {
   struct ah ah;
-  char line[256], f_user[256], ha1[256], f_domain[256], buf[MG_BUF_LEN];
+  char ha1[256], buf[MG_BUF_LEN];
 
-  if (!parse_auth_header(conn, buf, sizeof(buf), &ah)) {
+  if (!parse_auth_header(conn, buf, sizeof(buf), &ah) ||
+      !lookup_ha1(conn->ctx, path, stp, ah.user,
+                  conn->ctx->config[AUTHENTICATION_DOMAIN], ha1,
+                  sizeof(ha1))) {
     return 0;
   }
 
-  // Loop over passwords file
-  while (fgets(line, sizeof(line), fp) != NULL) {
-    if (sscanf(line, "%[^:]:%[^:]:%s", f_user, f_domain, ha1) != 3) {
-      continue;
-    }
-
-    if (!strcmp(ah.user, f_user) &&
-        !strcmp(conn->ctx->config[AUTHENTICATION_DOMAIN], f_domain))
-      return check_password(
-            conn->request_info.request_method,
-            ha1, ah.uri, ah.nonce, ah.nc, ah.cnonce, ah.qop,
-            ah.response);
-  }
-
-  return 0;
+  return check_password(conn->request_info.request_method, ha1, ah.uri,
+                        ah.nonce, ah.nc, ah.cnonce, ah.qop, ah.response);
 }
 
-// Return 1 if request is authorised, 0 otherwise.
-static int check_authorization(struct mg_connection *conn, const char *path) {
-  FILE *fp;
-  char fname[PATH_MAX];
+// Find the passwords file that guards the given URI and path. Return 1 and
+// fill in its name and stats if there is one.
+static int find_auth_file(struct mg_connection *conn, const char *uri,
+                          const char *path, char *fname, size_t fname_len,
+                          struct mgstat *stp) {
   struct vec uri_vec, filename_vec;
   const char *list;
-  int authorized;
-
-  fp = NULL;
-  authorized = 1;
+  int found = 0;
 
   list = conn->ctx->config[PROTECT_URI];
   while ((list = next_option(list, &uri_vec, &filename_vec)) != NULL) {
-    if (!memcmp(conn->request_info.uri, uri_vec.ptr, uri_vec.len)) {
-      (void) mg_snprintf(conn, fname, sizeof(fname), "%.*s",
+    if (!memcmp(uri, uri_vec.ptr, uri_vec.len)) {
+      (void) mg_snprintf(conn, fname, fname_len, "%.*s",
           filename_vec.len, filename_vec.ptr);
-      if ((fp = mg_fopen(fname, "r")) == NULL) {
+      if (mg_stat(fname, stp) == 0) {
+        found = 1;
+      } else {
         cry(conn, "%s: cannot open %s: %s", __func__, fname, strerror(errno));
       }
       break;
     }
   }
 
-  if (fp == NULL) {
-    fp = open_auth_file(conn, path);
-  }
-
-  if (fp != NULL) {
-    authorized = authorize(conn, fp);
-    (void) fclose(fp);
+  if (!found) {
+    found = get_auth_file(conn, path, fname, fname_len, stp);
   }
 
-  return authorized;
+  return found;
 }
 
 static void send_authorization_request(struct mg_connection *conn) {
@@ -2292,18 +4093,11 @@ static void send_authorization_request(struct mg_connection *conn) {
 }
 
 static int is_authorized_for_put(struct mg_connection *conn) {
-  FILE *fp;
-  int ret = 0;
-
-  fp = conn->ctx->config[PUT_DELETE_PASSWORDS_FILE] == NULL ? NULL :
-    mg_fopen(conn->ctx->config[PUT_DELETE_PASSWORDS_FILE], "r");
-
-  if (fp != NULL) {
-    ret = authorize(conn, fp);
-    (void) fclose(fp);
-  }
+  const char *path = conn->ctx->config[PUT_DELETE_PASSWORDS_FILE];
+  struct mgstat st;
 
-  return ret;
+  return path != NULL && mg_stat(path, &st) == 0 &&
+    authorize(conn, path, &st);
 }
 
 int mg_modify_passwords_file(const char *fname, const char *domain,
@@ -2395,7 +4189,55 @@ static void url_encode(const char *src, char *dst, size_t dst_len) {
   *dst = '\0';
 }
 
-static void print_dir_entry(struct de *de) {
+// Send response headers and a body that is already in memory. Buffered
+// headers and the body go out together in a single sendmsg() call.
+static void send_headers_and_body(struct mg_connection *conn,
+                                  const char *headers, int headers_len,
+                                  const char *body, int64_t body_len) {
+  if (mg_write(conn, headers, (size_t) headers_len) == headers_len) {
+    conn->num_bytes_sent += flush_output(conn, body, body_len, 0);
+  }
+}
+
+// Make room for need more bytes in the listing buffer
+static int grow_listing(struct dir_listing *dl, size_t need) {
+  size_t size = dl->size == 0 ? MG_BUF_LEN : dl->size;
+  char *data;
+
+  while (size - dl->len < need) {
+    size *= 2;
+  }
+  if (size != dl->size) {
+    if ((data = (char *) realloc(dl->data, size)) == NULL) {
+      dl->failed = 1;
+      return 0;
+    }
+    dl->data = data;
+    dl->size = size;
+  }
+  return 1;
+}
+
+static void listing_printf(struct dir_listing *dl, const char *fmt, ...) {
+  va_list ap;
+  size_t avail;
+  int n;
+
+  while (grow_listing(dl, 256)) {
+    avail = dl->size - dl->len;
+    va_start(ap, fmt);
+    n = vsnprintf(dl->data + dl->len, avail, fmt, ap);
+    va_end(ap);
+    if (n >= 0 && (size_t) n < avail) {
+      dl->len += n;
+      break;
+    } else if (!grow_listing(dl, n < 0 ? avail * 2 : (size_t) n + 1)) {
+      break;
+    }
+  }
+}
+
+static void print_dir_entry(struct dir_listing *dl, const struct de *de) {
   char size[64], mod[64], href[PATH_MAX];
 
   if (de->st.is_directory) {
@@ -2419,53 +4261,105 @@ static void print_dir_entry(struct de *de) {
   }
   (void) strftime(mod, sizeof(mod), "%d-%b-%Y %H:%M", localtime(&de->st.mtime));
   url_encode(de->file_name, href, sizeof(href));
-  de->conn->num_bytes_sent += mg_printf(de->conn,
+  listing_printf(dl,
       "<tr><td><a href=\"%s%s%s\">%s%s</a></td>"
       "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
-      de->conn->request_info.uri, href, de->st.is_directory ? "/" : "",
+      dl->uri, href, de->st.is_directory ? "/" : "",
       de->file_name, de->st.is_directory ? "/" : "", mod, size);
 }
 
-// This function is called from send_directory() and used for
-// sorting directory entries by size, or name, or modification time.
+// Copy the string into buffer, escaped for a JSON string literal
+static void json_escape(const char *src, char *dst, size_t dst_len) {
+  static const char *hex = "0123456789abcdef";
+  const char *end = dst + dst_len - 1;
+  unsigned char c;
+
+  for (; *src != '\0' && dst < end; src++) {
+    c = * (const unsigned char *) src;
+    if (c == '"' || c == '\\') {
+      if (dst + 1 < end) {
+        *dst++ = '\\';
+        *dst++ = (char) c;
+      }
+    } else if (c < 0x20) {
+      if (dst + 5 < end) {
+        memcpy(dst, "\\u00", 4);
+        dst[4] = hex[c >> 4];
+        dst[5] = hex[c & 0xf];
+        dst += 6;
+      }
+    } else {
+      *dst++ = (char) c;
+    }
+  }
+
+  *dst = '\0';
+}
+
+static void print_json_dir_entry(struct dir_listing *dl, const struct de *de,
+                                 int is_first) {
+  char name[PATH_MAX];
+
+  json_escape(de->file_name, name, sizeof(name));
+  listing_printf(dl, "%s\n{\"name\":\"%s\",\"type\":\"%s\","
+                 "\"size\":%" INT64_FMT ",\"mtime\":%lu}",
+                 is_first ? "" : ",", name,
+                 de->st.is_directory ? "directory" : "file",
+                 de->st.size, (unsigned long) de->st.mtime);
+}
+
+// These functions are used for sorting directory entries by name, size or
+// modification time, directories first. Descending order is made by
+// reversing the sorted directories and files separately.
 // On windows, __cdecl specification is needed in case if project is built
 // with __stdcall convention. qsort always requires __cdels callback.
-static int WINCDECL compare_dir_entries(const void *p1, const void *p2) {
+static int WINCDECL compare_dir_names(const void *p1, const void *p2) {
+  const struct de *a = (const struct de *) p1, *b = (const struct de *) p2;
+
+  if (a->st.is_directory != b->st.is_directory) {
+    return a->st.is_directory ? -1 : 1;
+  }
+  return strcmp(a->file_name, b->file_name);
+}
+
+static int WINCDECL compare_dir_sizes(const void *p1, const void *p2) {
   const struct de *a = (const struct de *) p1, *b = (const struct de *) p2;
-  const char *query_string = a->conn->request_info.query_string;
-  int cmp_result = 0;
 
-  if (query_string == NULL) {
-    query_string = "na";
+  if (a->st.is_directory != b->st.is_directory) {
+    return a->st.is_directory ? -1 : 1;
   }
+  return a->st.size == b->st.size ? 0 : a->st.size > b->st.size ? 1 : -1;
+}
 
-  if (a->st.is_directory && !b->st.is_directory) {
-    return -1;  // Always put directories on top
-  } else if (!a->st.is_directory && b->st.is_directory) {
-    return 1;   // Always put directories on top
-  } else if (*query_string == 'n') {
-    cmp_result = strcmp(a->file_name, b->file_name);
-  } else if (*query_string == 's') {
-    cmp_result = a->st.size == b->st.size ? 0 :
-      a->st.size > b->st.size ? 1 : -1;
-  } else if (*query_string == 'd') {
-    cmp_result = a->st.mtime == b->st.mtime ? 0 :
-      a->st.mtime > b->st.mtime ? 1 : -1;
+static int WINCDECL compare_dir_mtimes(const void *p1, const void *p2) {
+  const struct de *a = (const struct de *) p1, *b = (const struct de *) p2;
+
+  if (a->st.is_directory != b->st.is_directory) {
+    return a->st.is_directory ? -1 : 1;
   }
+  return a->st.mtime == b->st.mtime ? 0 : a->st.mtime > b->st.mtime ? 1 : -1;
+}
+
+static void reverse_dir_entries(struct de *entries, int n) {
+  struct de tmp;
+  int i;
 
-  return query_string[1] == 'd' ? -cmp_result : cmp_result;
+  for (i = 0; i < n / 2; i++) {
+    tmp = entries[i];
+    entries[i] = entries[n - 1 - i];
+    entries[n - 1 - i] = tmp;
+  }
 }
 
 static int must_hide_file(struct mg_connection *conn, const char *path) {
-  const char *pw_pattern = "**" PASSWORDS_FILE_NAME "$";
-  const char *pattern = conn->ctx->config[HIDE_FILES];
-  return match_prefix(pw_pattern, strlen(pw_pattern), path) > 0 ||
-    (pattern != NULL && match_prefix(pattern, strlen(pattern), path) > 0);
+  return match_glob(conn->ctx->hide_glob, path, (int) strlen(path)) > 0;
 }
 
 static int scan_directory(struct mg_connection *conn, const char *dir,
                           void *data, void (*cb)(struct de *, void *)) {
+#if defined(_WIN32)
   char path[PATH_MAX];
+#endif
   struct dirent *dp;
   DIR *dirp;
   struct de de;
@@ -2483,14 +4377,17 @@ static int scan_directory(struct mg_connection *conn, const char *dir,
         continue;
       }
 
-      mg_snprintf(conn, path, sizeof(path), "%s%c%s", dir, DIRSEP, dp->d_name);
-
       // If we don't memset stat structure to zero, mtime will have
       // garbage and strftime() will segfault later on in
       // print_dir_entry(). memset is required only if mg_stat()
       // fails. For more details, see
       // http://code.google.com/p/mongoose/issues/detail?id=79
+#if defined(_WIN32)
+      mg_snprintf(conn, path, sizeof(path), "%s%c%s", dir, DIRSEP, dp->d_name);
       if (mg_stat(path, &de.st) != 0) {
+#else
+      if (mg_stat_in_dir(dirp, dp->d_name, &de.st) != 0) {
+#endif
         memset(&de.st, 0, sizeof(de.st));
       }
       de.file_name = dp->d_name;
@@ -2502,79 +4399,303 @@ static int scan_directory(struct mg_connection *conn, const char *dir,
   return 1;
 }
 
+// Names of the entries of a directory being listed are copied into blocks
+// that never move, so a large directory does not cost a malloc() per entry.
+struct name_block {
+  struct name_block *next;
+  size_t used;
+  char data[16384];
+};
+
 struct dir_scan_data {
   struct de *entries;
   int num_entries;
   int arr_size;
+  struct name_block *names;
+  int failed;               // Memory allocation failed
 };
 
+static char *copy_dir_entry_name(struct dir_scan_data *dsd, const char *name) {
+  struct name_block *block = dsd->names;
+  size_t len = strlen(name) + 1;
+
+  if (len > sizeof(block->data)) {
+    return NULL;
+  } else if (block == NULL || sizeof(block->data) - block->used < len) {
+    if ((block = (struct name_block *) malloc(sizeof(*block))) == NULL) {
+      return NULL;
+    }
+    block->next = dsd->names;
+    block->used = 0;
+    dsd->names = block;
+  }
+  memcpy(block->data + block->used, name, len);
+  block->used += len;
+
+  return block->data + block->used - len;
+}
+
 static void dir_scan_callback(struct de *de, void *data) {
   struct dir_scan_data *dsd = (struct dir_scan_data *) data;
+  struct de *entries;
 
-  if (dsd->entries == NULL || dsd->num_entries >= dsd->arr_size) {
-    dsd->arr_size *= 2;
-    dsd->entries = (struct de *) realloc(dsd->entries, dsd->arr_size *
-                                         sizeof(dsd->entries[0]));
+  if (dsd->failed) {
+    return;
+  } else if (dsd->num_entries >= dsd->arr_size) {
+    dsd->arr_size = dsd->arr_size == 0 ? 128 : dsd->arr_size * 2;
+    if ((entries = (struct de *) realloc(dsd->entries, dsd->arr_size *
+                                         sizeof(dsd->entries[0]))) == NULL) {
+      dsd->failed = 1;
+      return;
+    }
+    dsd->entries = entries;
   }
-  if (dsd->entries == NULL) {
-    // TODO(lsm): propagate an error to the caller
-    dsd->num_entries = 0;
+
+  entries = &dsd->entries[dsd->num_entries];
+  if ((entries->file_name = copy_dir_entry_name(dsd, de->file_name)) == NULL) {
+    dsd->failed = 1;
   } else {
-    dsd->entries[dsd->num_entries].file_name = mg_strdup(de->file_name);
-    dsd->entries[dsd->num_entries].st = de->st;
-    dsd->entries[dsd->num_entries].conn = de->conn;
+    entries->st = de->st;
+    entries->conn = de->conn;
     dsd->num_entries++;
   }
 }
 
-static void handle_directory_request(struct mg_connection *conn,
-                                     const char *dir) {
-  int i, sort_direction;
-  struct dir_scan_data data = { NULL, 0, 128 };
+// Normalize the sort order and format asked for in the query string, like
+// "sd" or "json&na", to the form kept in dir_listing. Content coding is
+// left for the caller to choose.
+static void get_listing_query(const char *query_string, char *query) {
+  const char *qs = query_string == NULL ? "" : query_string;
+  int json = 0;
+
+  if (!strncmp(qs, "json", 4)) {
+    json = 1;
+    qs += qs[4] == '&' ? 5 : 4;
+  }
+  query[0] = qs[0] == 's' || qs[0] == 'd' ? qs[0] : 'n';
+  query[1] = qs[0] != '\0' && qs[1] == 'd' ? 'd' : 'a';
+  query[2] = json ? 'j' : 'h';
+  query[3] = query[4] = '\0';
+}
+
+static void free_dir_listing(struct dir_listing *dl) {
+  free(dl->data);
+  free(dl);
+}
+
+static unsigned long listing_cache_slot(const char *uri, const char *query) {
+  return (hash_path(uri) * 33 + hash_path(query)) % LISTING_CACHE_SLOTS;
+}
+
+static struct dir_listing *get_cached_listing(struct mg_context *ctx,
+                                              const char *uri,
+                                              const struct mgstat *stp,
+                                              const char *query) {
+  struct dir_listing *dl;
+
+  (void) pthread_mutex_lock(&ctx->lc_mutex);
+  dl = ctx->lc_slots[listing_cache_slot(uri, query)];
+  if (dl != NULL && same_file(&dl->st, stp) && dl->expires > time(NULL) &&
+      !strcmp(dl->uri, uri) && !strcmp(dl->query, query)) {
+    dl->refs++;
+  } else {
+    dl = NULL;
+  }
+  (void) pthread_mutex_unlock(&ctx->lc_mutex);
+
+  return dl;
+}
+
+static void release_listing(struct mg_context *ctx, struct dir_listing *dl) {
+  int refs;
+
+  (void) pthread_mutex_lock(&ctx->lc_mutex);
+  refs = --dl->refs;
+  (void) pthread_mutex_unlock(&ctx->lc_mutex);
+  if (refs == 0) {
+    free_dir_listing(dl);
+  }
+}
+
+// Keep the listing, unless the cache would grow over its size limit
+static void put_cached_listing(struct mg_context *ctx,
+                               struct dir_listing *dl) {
+  struct dir_listing *old;
+  unsigned long i = listing_cache_slot(dl->uri, dl->query);
+  size_t bytes;
+
+  dl->expires = time(NULL) +
+    (ctx->pc_ttl > 0 ? ctx->pc_ttl : LISTING_CACHE_TTL);
+  (void) pthread_mutex_lock(&ctx->lc_mutex);
+  old = ctx->lc_slots[i];
+  bytes = ctx->lc_bytes - (old == NULL ? 0 : old->len) + dl->len;
+  if (bytes <= LISTING_CACHE_MAX_BYTES) {
+    ctx->lc_slots[i] = dl;
+    ctx->lc_bytes = bytes;
+    dl->refs++;
+  } else {
+    old = NULL;
+  }
+  (void) pthread_mutex_unlock(&ctx->lc_mutex);
+  if (old != NULL) {
+    release_listing(ctx, old);
+  }
+}
+
+static void listing_cache_clear(struct mg_context *ctx) {
+  int i;
+
+  for (i = 0; i < LISTING_CACHE_SLOTS; i++) {
+    if (ctx->lc_slots[i] != NULL) {
+      release_listing(ctx, ctx->lc_slots[i]);
+      ctx->lc_slots[i] = NULL;
+    }
+  }
+  ctx->lc_bytes = 0;
+}
+
+// Read, sort and render the directory into a new listing holding one
+// reference. Return NULL on error.
+static struct dir_listing *render_listing(struct mg_connection *conn,
+                                          const char *dir,
+                                          const struct mgstat *stp,
+                                          const char *query) {
+  const char *uri = conn->request_info.uri;
+  struct dir_scan_data data;
+  struct dir_listing *dl;
+  struct name_block *block;
+  int i, num_dirs, sort_direction;
 
+  memset(&data, 0, sizeof(data));
   if (!scan_directory(conn, dir, &data, dir_scan_callback)) {
-    send_http_error(conn, 500, "Cannot open directory",
-                    "Error: opendir(%s): %s", dir, strerror(ERRNO));
-    return;
+    return NULL;
   }
 
-  sort_direction = conn->request_info.query_string != NULL &&
-    conn->request_info.query_string[1] == 'd' ? 'a' : 'd';
+  if (!data.failed &&
+      (dl = (struct dir_listing *) calloc(1, sizeof(*dl) +
+                                          strlen(uri) + 1)) != NULL) {
+    dl->uri = (char *) (dl + 1);
+    strcpy(dl->uri, uri);
+    strcpy(dl->query, query);
+    dl->st = *stp;
+    dl->refs = 1;
 
-  conn->must_close = 1;
-  mg_printf(conn, "%s",
-            "HTTP/1.1 200 OK\r\n"
-            "Connection: close\r\n"
-            "Content-Type: text/html; charset=utf-8\r\n\r\n");
-
-  conn->num_bytes_sent += mg_printf(conn,
-      "<html><head><title>Index of %s</title>"
-      "<style>th {text-align: left;}</style></head>"
-      "<body><h1>Index of %s</h1><pre><table cellpadding=\"0\">"
-      "<tr><th><a href=\"?n%c\">Name</a></th>"
-      "<th><a href=\"?d%c\">Modified</a></th>"
-      "<th><a href=\"?s%c\">Size</a></th></tr>"
-      "<tr><td colspan=\"3\"><hr></td></tr>",
-      conn->request_info.uri, conn->request_info.uri,
-      sort_direction, sort_direction, sort_direction);
-
-  // Print first entry - link to a parent directory
-  conn->num_bytes_sent += mg_printf(conn,
-      "<tr><td><a href=\"%s%s\">%s</a></td>"
-      "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
-      conn->request_info.uri, "..", "Parent directory", "-", "-");
+    if (data.num_entries > 0) {
+      qsort(data.entries, (size_t) data.num_entries, sizeof(data.entries[0]),
+            query[0] == 's' ? compare_dir_sizes :
+            query[0] == 'd' ? compare_dir_mtimes : compare_dir_names);
+    }
+    if (query[1] == 'd') {
+      for (num_dirs = 0; num_dirs < data.num_entries &&
+           data.entries[num_dirs].st.is_directory; num_dirs++) {
+      }
+      reverse_dir_entries(data.entries, num_dirs);
+      reverse_dir_entries(data.entries + num_dirs,
+                          data.num_entries - num_dirs);
+    }
+
+    if (query[2] == 'j') {
+      listing_printf(dl, "%s", "[");
+      for (i = 0; i < data.num_entries; i++) {
+        print_json_dir_entry(dl, &data.entries[i], i == 0);
+      }
+      listing_printf(dl, "%s", "\n]\n");
+    } else {
+      sort_direction = query[1] == 'd' ? 'a' : 'd';
+      listing_printf(dl,
+          "<html><head><title>Index of %s</title>"
+          "<style>th {text-align: left;}</style></head>"
+          "<body><h1>Index of %s</h1><pre><table cellpadding=\"0\">"
+          "<tr><th><a href=\"?n%c\">Name</a></th>"
+          "<th><a href=\"?d%c\">Modified</a></th>"
+          "<th><a href=\"?s%c\">Size</a></th></tr>"
+          "<tr><td colspan=\"3\"><hr></td></tr>",
+          uri, uri, sort_direction, sort_direction, sort_direction);
+
+      // Print first entry - link to a parent directory
+      listing_printf(dl,
+          "<tr><td><a href=\"%s%s\">%s</a></td>"
+          "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
+          uri, "..", "Parent directory", "-", "-");
+
+      for (i = 0; i < data.num_entries; i++) {
+        print_dir_entry(dl, &data.entries[i]);
+      }
+      listing_printf(dl, "%s", "</table></body></html>");
+    }
 
-  // Sort and print directory entries
-  qsort(data.entries, (size_t) data.num_entries, sizeof(data.entries[0]),
-        compare_dir_entries);
-  for (i = 0; i < data.num_entries; i++) {
-    print_dir_entry(&data.entries[i]);
-    free(data.entries[i].file_name);
+    if (dl->failed) {
+      free_dir_listing(dl);
+      dl = NULL;
+    } else if (query[3] == 'z' && !compress_listing(conn->ctx, dl)) {
+      dl->query[3] = '\0';
+    }
+  } else {
+    dl = NULL;
+  }
+
+  while ((block = data.names) != NULL) {
+    data.names = block->next;
+    free(block);
   }
   free(data.entries);
 
-  conn->num_bytes_sent += mg_printf(conn, "%s", "</table></body></html>");
+  return dl;
+}
+
+// Send a directory listing, HTML by default or JSON if the query string
+// starts with "json". Rendered listings are kept until the directory
+// changes, unless it changed within the current second. Gzip encoded
+// listings are cached separately, so a cached one costs no CPU to send.
+static void handle_directory_request(struct mg_connection *conn,
+                                     const char *dir,
+                                     const struct mgstat *stp) {
+  char query[5], headers[MG_BUF_LEN];
+  struct dir_listing *dl;
+  int headers_len, vary = conn->ctx->z_budget > 0;
+
+  get_listing_query(conn->request_info.query_string, query);
+  dl = NULL;
+  if (vary && accepts_coding(conn, "gzip")) {
+    query[3] = 'z';
+    if ((dl = get_cached_listing(conn->ctx, conn->request_info.uri, stp,
+                                 query)) == NULL &&
+        !compression_allowed(conn->ctx)) {
+      query[3] = '\0';
+    }
+  }
+  if (dl == NULL &&
+      (dl = get_cached_listing(conn->ctx, conn->request_info.uri, stp,
+                               query)) == NULL) {
+    if ((dl = render_listing(conn, dir, stp, query)) == NULL) {
+      send_http_error(conn, 500, "Cannot open directory",
+                      "Error: opendir(%s): %s", dir, strerror(ERRNO));
+      return;
+    } else if (dl->len <= LISTING_CACHE_MAX_SIZE &&
+               stp->mtime < time(NULL)) {
+      put_cached_listing(conn->ctx, dl);
+    }
+  }
+
   conn->request_info.status_code = 200;
+  headers_len = mg_snprintf(conn, headers, sizeof(headers),
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: %s; charset=utf-8\r\n"
+      "%s%s"
+      "Content-Length: %lu\r\n"
+      "Connection: %s\r\n\r\n",
+      query[2] == 'j' ? "application/json" : "text/html",
+      dl->query[3] == 'z' ? "Content-Encoding: gzip\r\n" : "",
+      vary ? "Vary: Accept-Encoding\r\n" : "",
+      (unsigned long) dl->len, suggest_connection_header(conn));
+
+  if (strcmp(conn->request_info.request_method, "HEAD") == 0) {
+    (void) mg_write(conn, headers, (size_t) headers_len);
+  } else {
+    send_headers_and_body(conn, headers, headers_len, dl->data,
+                          (int64_t) dl->len);
+  }
+  release_listing(conn->ctx, dl);
 }
 
 // Send len bytes from the opened file to the client.
@@ -2602,85 +4723,772 @@ static void send_file_data(struct mg_connection *conn, FILE *fp, int64_t len) {
     // Both read and were successful, adjust counters
     conn->num_bytes_sent += num_written;
     len -= num_written;
-  }
-}
 
-static int parse_range_header(const char *header, int64_t *a, int64_t *b) {
-  return sscanf(header, "bytes=%" INT64_FMT "-%" INT64_FMT, a, b);
+    // Short read means the source ran dry for now, e.g. a CGI pipe.
+    // Do not hold back what we have while waiting for more.
+    if (num_read < to_read) {
+      (void) flush_output(conn, NULL, 0, 0);
+    }
+  }
 }
 
-static void gmt_time_string(char *buf, size_t buf_len, time_t *t) {
-  strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", gmtime(t));
+#if defined(USE_SENDFILE) && !defined(NO_SSL)
+// Kernel TLS encrypts what is written to the socket, OpenSSL has only set
+// the keys up. Such connections can send files with sendfile(2), too.
+static int ssl_uses_ktls(SSL *ssl) {
+  return HAVE_SSL_SENDFILE &&
+    BIO_ctrl(SSL_get_wbio(ssl), BIO_CTRL_GET_KTLS_SEND, 0, NULL) > 0;
 }
+#endif
 
-static void construct_etag(char *buf, size_t buf_len,
-                           const struct mgstat *stp) {
-  snprintf(buf, buf_len, "\"%lx.%" INT64_FMT "\"",
-           (unsigned long) stp->mtime, stp->size);
-}
+// Send len bytes of the opened file, starting at given offset. Plain
+// connections, and SSL connections offloaded to kernel TLS, use
+// sendfile(2), so the file contents never pass through user space.
+// Other SSL connections, and systems without sendfile, copy the data
+// through send_file_data().
+static void send_file_range(struct mg_connection *conn, FILE *fp,
+                            int64_t offset, int64_t len) {
+#if defined(USE_SENDFILE)
+  off_t off = (off_t) offset;
+  size_t chunk;
+  int64_t sent = 0;
+  int fd = fileno(fp);
+  int use_sendfile = conn->ssl == NULL;
+#if defined(__linux__)
+  ssize_t n;
+#else
+  off_t n;
+  int nopush = 0;
+#endif
 
-static void handle_file_request(struct mg_connection *conn, const char *path,
-                                struct mgstat *stp) {
-  char date[64], lm[64], etag[64], range[64];
-  const char *msg = "OK", *hdr;
-  time_t curtime = time(NULL);
-  int64_t cl, r1, r2;
-  struct vec mime_vec;
-  FILE *fp;
-  int n;
+#if !defined(NO_SSL)
+  if (conn->ssl != NULL) {
+    use_sendfile = ssl_uses_ktls(conn->ssl);
+  }
+#endif
 
-  get_mime_type(conn->ctx, path, &mime_vec);
-  cl = stp->size;
-  conn->request_info.status_code = 200;
-  range[0] = '\0';
+  // Buffered headers go out in the same segments as the start of the file:
+  // MSG_MORE on Linux, TCP_NOPUSH around sendfile() on FreeBSD.
+  if (use_sendfile && len > 0) {
+#if defined(__linux__)
+    (void) flush_output(conn, NULL, 0, MSG_MORE);
+#else
+    nopush = 1;
+    (void) setsockopt(conn->client.sock, IPPROTO_TCP, TCP_NOPUSH,
+                      (void *) &nopush, sizeof(nopush));
+    (void) flush_output(conn, NULL, 0, 0);
+#endif
+  }
 
-  if ((fp = mg_fopen(path, "rb")) == NULL) {
-    send_http_error(conn, 500, http_500_error,
-        "fopen(%s): %s", path, strerror(ERRNO));
+  while (use_sendfile && sent < len) {
+    // Send in 1GB chunks to stay within size_t/ssize_t on 32-bit systems
+    chunk = len - sent > (1 << 30) ? (size_t) 1 << 30 : (size_t) (len - sent);
+#if !defined(NO_SSL)
+    if (conn->ssl != NULL) {
+      n = SSL_sendfile(conn->ssl, fd, off, chunk, 0);
+      off += n > 0 ? n : 0;
+      if (n <= 0) {
+        if (n == 0 || sent > 0) {
+          len = sent;  // Give up on the rest
+        }
+        break;         // Or copy the data through SSL_write()
+      }
+      sent += n;
+      conn->num_bytes_sent += n;
+      continue;
+    }
+#endif
+#if defined(__linux__)
+    n = sendfile(conn->client.sock, fd, &off, chunk);
+    if (n < 0 && ERRNO == EINTR) {
+      continue;
+    }
+#else
+    // sbytes is valid even if the call was interrupted half way
+    n = 0;
+    if (sendfile(fd, conn->client.sock, off, chunk, NULL, &n, 0) != 0 &&
+        n == 0) {
+      if (ERRNO == EINTR || ERRNO == EAGAIN) {
+        continue;
+      }
+      n = -1;
+    }
+    off += n > 0 ? n : 0;
+#endif
+    if (n <= 0) {
+      if (n < 0 && sent == 0 && (ERRNO == EINVAL || ERRNO == ENOSYS)) {
+        break;  // File system does not support sendfile, copy the data
+      }
+      len = sent;  // Give up on the rest
+      break;
+    }
+    sent += n;
+    conn->num_bytes_sent += n;
+  }
+#if !defined(__linux__)
+  // Clearing TCP_NOPUSH pushes out the last partial segment
+  if (nopush) {
+    nopush = 0;
+    (void) setsockopt(conn->client.sock, IPPROTO_TCP, TCP_NOPUSH,
+                      (void *) &nopush, sizeof(nopush));
+  }
+#endif
+  if (sent >= len) {
+    return;
+  }
+  offset += sent;
+  len -= sent;
+#endif // USE_SENDFILE
+
+  (void) fseeko(fp, offset, SEEK_SET);
+  send_file_data(conn, fp, len);
+}
+
+// Must be called with fc_mutex held.
+static void file_cache_unref(struct file_cache_entry *e) {
+  if (--e->refcount == 0) {
+#if defined(USE_FILE_CACHE)
+    (void) munmap(e->data, (size_t) e->st.size);
+#endif
+    free(e->path);
+    free(e);
+  }
+}
+
+static struct file_cache_entry **file_cache_bucket(struct mg_context *ctx,
+                                                   const char *path) {
+  return &ctx->fc_buckets[hash_path(path) % FILE_CACHE_BUCKETS];
+}
+
+// Must be called with fc_mutex held.
+static struct file_cache_entry *file_cache_find(struct mg_context *ctx,
+                                                const char *path) {
+  struct file_cache_entry *e;
+
+  for (e = *file_cache_bucket(ctx, path); e != NULL; e = e->hash_next) {
+    if (strcmp(e->path, path) == 0) {
+      break;
+    }
+  }
+  return e;
+}
+
+static void file_cache_lru_unlink(struct mg_context *ctx,
+                                  struct file_cache_entry *e) {
+  if (e->lru_prev == NULL) {
+    ctx->fc_lru_head = e->lru_next;
+  } else {
+    e->lru_prev->lru_next = e->lru_next;
+  }
+  if (e->lru_next == NULL) {
+    ctx->fc_lru_tail = e->lru_prev;
+  } else {
+    e->lru_next->lru_prev = e->lru_prev;
+  }
+}
+
+static void file_cache_lru_push(struct mg_context *ctx,
+                                struct file_cache_entry *e) {
+  e->lru_prev = NULL;
+  e->lru_next = ctx->fc_lru_head;
+  if (ctx->fc_lru_head == NULL) {
+    ctx->fc_lru_tail = e;
+  } else {
+    ctx->fc_lru_head->lru_prev = e;
+  }
+  ctx->fc_lru_head = e;
+}
+
+// Drop the entry from the cache. Responses that still use it keep the
+// mapping alive until they release it. Must be called with fc_mutex held.
+static void file_cache_remove(struct mg_context *ctx,
+                              struct file_cache_entry *e) {
+  struct file_cache_entry **pp;
+
+  for (pp = file_cache_bucket(ctx, e->path); *pp != e; pp = &(*pp)->hash_next)
+    ;
+  *pp = e->hash_next;
+  file_cache_lru_unlink(ctx, e);
+  ctx->fc_size -= e->st.size;
+  file_cache_unref(e);
+}
+
+// Map the file into memory. Return NULL if the file has changed since
+// the request's stat, or cannot be mapped.
+static struct file_cache_entry *file_cache_map(const char *path,
+                                               const struct mgstat *stp) {
+#if defined(USE_FILE_CACHE)
+  struct file_cache_entry *e;
+  struct mgstat st;
+  struct stat fst;
+  void *data;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    return NULL;
+  } else if (fstat(fd, &fst) != 0) {
+    (void) close(fd);
+    return NULL;
+  }
+  st = *stp;
+  st.size = fst.st_size;
+  st.mtime = fst.st_mtime;
+  st.dev = (int64_t) fst.st_dev;
+  st.ino = (int64_t) fst.st_ino;
+  data = same_file(&st, stp) ?
+    mmap(NULL, (size_t) st.size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  (void) close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  } else if ((e = (struct file_cache_entry *) calloc(1, sizeof(*e))) == NULL ||
+             (e->path = mg_strdup(path)) == NULL) {
+    free(e);
+    (void) munmap(data, (size_t) st.size);
+    return NULL;
+  }
+  e->st = st;
+  e->data = (char *) data;
+  return e;
+#else
+  (void) path;
+  (void) stp;
+  return NULL;
+#endif // USE_FILE_CACHE
+}
+
+// Return cached contents of the file, mapping it on a miss. Files that are
+// empty, changed since the request's stat, or would take more than a
+// quarter of the budget are not cached. Returned entry must be released
+// with file_cache_release().
+static struct file_cache_entry *file_cache_get(struct mg_context *ctx,
+                                               const char *path,
+                                               const struct mgstat *stp) {
+  struct file_cache_entry *e, *old, **bucket;
+
+  if (ctx->fc_buckets == NULL || stp->size <= 0 ||
+      stp->size > ctx->fc_budget / 4) {
+    return NULL;
+  }
+
+  (void) pthread_mutex_lock(&ctx->fc_mutex);
+  if ((e = file_cache_find(ctx, path)) != NULL && same_file(&e->st, stp)) {
+    // Hit. Move the entry to the head of the LRU list
+    e->refcount++;
+    file_cache_lru_unlink(ctx, e);
+    file_cache_lru_push(ctx, e);
+    (void) pthread_mutex_unlock(&ctx->fc_mutex);
+    return e;
+  } else if (e != NULL) {
+    file_cache_remove(ctx, e);
+  }
+  (void) pthread_mutex_unlock(&ctx->fc_mutex);
+
+  // Miss. Map the file without holding the lock
+  if ((e = file_cache_map(path, stp)) == NULL) {
+    return NULL;
+  }
+  e->refcount = 2;
+
+  (void) pthread_mutex_lock(&ctx->fc_mutex);
+  // Another worker may have mapped the same file meanwhile, replace it
+  if ((old = file_cache_find(ctx, path)) != NULL) {
+    file_cache_remove(ctx, old);
+  }
+  bucket = file_cache_bucket(ctx, path);
+  e->hash_next = *bucket;
+  *bucket = e;
+  file_cache_lru_push(ctx, e);
+  ctx->fc_size += e->st.size;
+  while (ctx->fc_size > ctx->fc_budget && ctx->fc_lru_tail != e) {
+    file_cache_remove(ctx, ctx->fc_lru_tail);
+  }
+  (void) pthread_mutex_unlock(&ctx->fc_mutex);
+
+  return e;
+}
+
+static void file_cache_release(struct mg_context *ctx,
+                               struct file_cache_entry *e) {
+  (void) pthread_mutex_lock(&ctx->fc_mutex);
+  file_cache_unref(e);
+  (void) pthread_mutex_unlock(&ctx->fc_mutex);
+}
+
+// Drop all cached files. Called when all workers have exited.
+static void file_cache_clear(struct mg_context *ctx) {
+  while (ctx->fc_lru_head != NULL) {
+    file_cache_remove(ctx, ctx->fc_lru_head);
+  }
+}
+
+static int parse_range_header(const char *header, int64_t *a, int64_t *b) {
+  return sscanf(header, "bytes=%" INT64_FMT "-%" INT64_FMT, a, b);
+}
+
+static void gmt_time_string(char *buf, size_t buf_len, const time_t *t) {
+  strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", gmtime(t));
+}
+
+static void construct_etag(char *buf, size_t buf_len,
+                           const struct mgstat *stp) {
+  snprintf(buf, buf_len, "\"%lx.%" INT64_FMT "\"",
+           (unsigned long) stp->mtime, stp->size);
+}
+
+// Parse Range: request header for a file of given size, as in RFC 7233
+// section 2.1. Ranges are clipped to the file, unsatisfiable ones are
+// dropped, and a range that overlaps or touches the previous one is merged
+// into it. Return the number of ranges stored, 0 if none of them can be
+// satisfied, or -1 if the header is malformed or has too many ranges and
+// must be ignored.
+static int parse_byte_ranges(const char *header, int64_t size,
+                             struct byte_range *ranges, int max_ranges) {
+  const char *p = header;
+  char *end;
+  int64_t a, b;
+  int n = 0, num_specs = 0;
+
+  if (mg_strncasecmp(p, "bytes=", 6) != 0) {
+    return -1;
+  }
+  for (p += 6; ; p++) {
+    p += strspn(p, " \t");
+    if (*p == ',') {
+      continue;  // Empty list elements are allowed
+    } else if (*p == '\0') {
+      break;
+    } else if (*p == '-' && isdigit(* (const unsigned char *) (p + 1))) {
+      // Suffix range: the last b bytes of the file
+      b = strtoll(p + 1, &end, 10);
+      if (b == 0 || size == 0) {
+        a = size;
+      } else {
+        a = b >= size ? 0 : size - b;
+      }
+      b = size - 1;
+    } else if (isdigit(* (const unsigned char *) p)) {
+      a = strtoll(p, &end, 10);
+      if (*end++ != '-') {
+        return -1;
+      } else if (isdigit(* (unsigned char *) end)) {
+        p = end;
+        if ((b = strtoll(p, &end, 10)) < a) {
+          return -1;
+        }
+      } else {
+        b = size - 1;
+      }
+      if (b > size - 1) {
+        b = size - 1;
+      }
+    } else {
+      return -1;
+    }
+    p = end + strspn(end, " \t");
+    if ((*p != ',' && *p != '\0') || ++num_specs > max_ranges) {
+      return -1;
+    }
+
+    if (a >= size) {
+      // Unsatisfiable, skip
+    } else if (n > 0 && a >= ranges[n - 1].start &&
+               a <= ranges[n - 1].start + ranges[n - 1].len) {
+      if (b + 1 - ranges[n - 1].start > ranges[n - 1].len) {
+        ranges[n - 1].len = b + 1 - ranges[n - 1].start;
+      }
+    } else {
+      ranges[n].start = a;
+      ranges[n].len = b - a + 1;
+      n++;
+    }
+    if (*p == '\0') {
+      break;
+    }
+  }
+
+  return num_specs == 0 ? -1 : n;
+}
+
+// Return 1 if Range: header applies, i.e. there is no If-Range: header, or
+// it names the current version of the file by its ETag or modification time.
+static int if_range_matches(const struct mg_connection *conn,
+                            const struct mgstat *stp) {
+  const char *hdr = mg_get_header(conn, "If-Range");
+  char etag[64];
+
+  if (hdr == NULL) {
+    return 1;
+  } else if (hdr[0] == '"') {
+    construct_etag(etag, sizeof(etag), stp);
+    return strcmp(hdr, etag) == 0;
+  } else if (hdr[0] == 'W' && hdr[1] == '/') {
+    return 0;  // Weak validators never match
+  }
+  return parse_date_string(hdr) == stp->mtime;
+}
+
+// Copy the current Date value, rendered at most once per second, and the
+// cached header block of the file into the buffers. Return the length of
+// the block, and the length without Content-Length line in *fixed_len.
+// Content-Type is derived from type_path, which differs from path for
+// precompressed files. Buffer must be MG_BUF_LEN bytes long.
+static int get_file_headers(struct mg_connection *conn, const char *path,
+                            const char *type_path, const struct mgstat *stp,
+                            char *date, char *buf, int *fixed_len) {
+  struct mg_context *ctx = conn->ctx;
+  struct header_cache_slot *slot = NULL;
+  char lm[64], etag[64];
+  time_t curtime = time(NULL);
+  struct vec mime_vec;
+  int len = -1, encoded = strcmp(path, type_path) != 0;
+
+  (void) pthread_mutex_lock(&ctx->hc_mutex);
+  if (ctx->date_time != curtime) {
+    // Must be in UTC, according to
+    // http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.3
+    gmt_time_string(ctx->date, sizeof(ctx->date), &curtime);
+    ctx->date_time = curtime;
+  }
+  strcpy(date, ctx->date);
+  if (ctx->hc_slots != NULL) {
+    slot = &ctx->hc_slots[hash_path(path) % HEADER_CACHE_SLOTS];
+    if (slot->path != NULL && same_file(&slot->st, stp) &&
+        slot->encoded == encoded && strcmp(slot->path, path) == 0) {
+      memcpy(buf, slot->headers, slot->len);
+      *fixed_len = slot->fixed_len;
+      len = slot->len;
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->hc_mutex);
+
+  if (len == -1) {
+    // Miss, prepare Last-Modified, Etag and Content-Type
+    get_mime_type(ctx, type_path, &mime_vec);
+    gmt_time_string(lm, sizeof(lm), &stp->mtime);
+    construct_etag(etag, sizeof(etag), stp);
+    *fixed_len = mg_snprintf(conn, buf, MG_BUF_LEN,
+                             "Last-Modified: %s\r\n"
+                             "Etag: %s\r\n"
+                             "Content-Type: %.*s\r\n",
+                             lm, etag, (int) mime_vec.len, mime_vec.ptr);
+    len = *fixed_len + mg_snprintf(conn, buf + *fixed_len,
+                                   MG_BUF_LEN - *fixed_len,
+                                   "Content-Length: %" INT64_FMT "\r\n",
+                                   stp->size);
+
+    // Blocks with unusually long Content-Type do not fit and are not cached
+    if (slot != NULL && len < (int) sizeof(slot->headers)) {
+      (void) pthread_mutex_lock(&ctx->hc_mutex);
+      free(slot->path);
+      if ((slot->path = mg_strdup(path)) != NULL) {
+        slot->encoded = encoded;
+        slot->st = *stp;
+        slot->fixed_len = *fixed_len;
+        slot->len = len;
+        memcpy(slot->headers, buf, len);
+      }
+      (void) pthread_mutex_unlock(&ctx->hc_mutex);
+    }
+  }
+
+  return len;
+}
+
+static pthread_mutex_t *path_cache_lock(struct mg_context *ctx,
+                                        unsigned long slot) {
+  return &ctx->pc_mutexes[slot % PATH_CACHE_LOCKS];
+}
+
+// Look the request URI up in the path cache. Return 1 and copy out the
+// resolved path if there is a fresh entry.
+static int get_cached_uri(struct mg_connection *conn, char *path,
+                          size_t path_len, char *auth_path,
+                          size_t auth_path_len, struct resolved_uri *ru) {
+  struct mg_context *ctx = conn->ctx;
+  const char *uri = conn->request_info.uri;
+  struct path_cache_slot *slot;
+  time_t now = time(NULL);
+  unsigned long i;
+  int found = 0;
+
+  if (ctx->pc_slots == NULL) {
+    return 0;
+  }
+
+  i = hash_path(uri) % PATH_CACHE_SLOTS;
+  slot = &ctx->pc_slots[i];
+  (void) pthread_mutex_lock(path_cache_lock(ctx, i));
+  if (slot->uri != NULL && slot->expires > now && !strcmp(slot->uri, uri)) {
+    (void) mg_strlcpy(path, slot->path, path_len);
+    if (slot->auth_path != NULL) {
+      (void) mg_strlcpy(auth_path, slot->auth_path, auth_path_len);
+    }
+    *ru = slot->ru;
+    found = 1;
+  }
+  (void) pthread_mutex_unlock(path_cache_lock(ctx, i));
+
+  return found;
+}
+
+static void put_cached_uri(struct mg_connection *conn, const char *path,
+                           const char *auth_path,
+                           const struct resolved_uri *ru) {
+  struct mg_context *ctx = conn->ctx;
+  const char *uri = conn->request_info.uri;
+  size_t uri_len = strlen(uri) + 1, path_len = strlen(path) + 1;
+  struct path_cache_slot *slot;
+  unsigned long i;
+  char *mem;
+
+  if (ctx->pc_slots == NULL ||
+      (mem = (char *) malloc(uri_len + path_len +
+                             (ru->auth_found ? strlen(auth_path) + 1 : 0))) ==
+      NULL) {
+    return;
+  }
+  memcpy(mem, uri, uri_len);
+  memcpy(mem + uri_len, path, path_len);
+  if (ru->auth_found) {
+    strcpy(mem + uri_len + path_len, auth_path);
+  }
+
+  i = hash_path(uri) % PATH_CACHE_SLOTS;
+  slot = &ctx->pc_slots[i];
+  (void) pthread_mutex_lock(path_cache_lock(ctx, i));
+  free(slot->uri);
+  slot->uri = mem;
+  slot->path = mem + uri_len;
+  slot->auth_path = ru->auth_found ? mem + uri_len + path_len : NULL;
+  slot->ru = *ru;
+  slot->expires = time(NULL) + ctx->pc_ttl;
+  (void) pthread_mutex_unlock(path_cache_lock(ctx, i));
+}
+
+// Drop the request URI from the path cache, after PUT or DELETE changed
+// the file it maps to.
+static void remove_cached_uri(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+  const char *uri = conn->request_info.uri;
+  struct path_cache_slot *slot;
+  unsigned long i;
+
+  if (ctx->pc_slots == NULL) {
+    return;
+  }
+
+  i = hash_path(uri) % PATH_CACHE_SLOTS;
+  slot = &ctx->pc_slots[i];
+  (void) pthread_mutex_lock(path_cache_lock(ctx, i));
+  if (slot->uri != NULL && !strcmp(slot->uri, uri)) {
+    free(slot->uri);
+    slot->uri = NULL;
+  }
+  (void) pthread_mutex_unlock(path_cache_lock(ctx, i));
+}
+
+// Send len bytes of the file starting at offset, from the file cache entry
+// if there is one, or from the opened file. The mapping is handed to the
+// kernel only: if the file is truncated meanwhile, sendmsg() fails with
+// EFAULT, where reading it in user space would raise SIGBUS.
+static void send_file_part(struct mg_connection *conn, FILE *fp,
+                           const struct file_cache_entry *cached,
+                           int64_t offset, int64_t len) {
+  int64_t sent;
+
+  if (cached == NULL) {
+    send_file_range(conn, fp, offset, len);
+  } else if (offset >= 0 && len >= 0 && offset <= cached->st.size &&
+             len <= cached->st.size - offset) {
+    sent = flush_output(conn, cached->data + offset, len, 0);
+    conn->num_bytes_sent += sent;
+    if (sent != len) {
+      conn->must_close = 1;  // Body is cut short
+    }
+  }
+}
+
+static void send_range_not_satisfiable(struct mg_connection *conn,
+                                       const struct mgstat *stp) {
+  conn->request_info.status_code = 416;
+  if (call_user(conn, MG_HTTP_ERROR) == NULL) {
+    (void) mg_printf(conn, "HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+                     "Content-Range: bytes */%" INT64_FMT "\r\n"
+                     "Content-Length: 0\r\n"
+                     "Connection: %s\r\n\r\n",
+                     stp->size, suggest_connection_header(conn));
+  }
+}
+
+// Send several ranges of the file as a multipart/byteranges body. The
+// file_headers block is the output of get_file_headers(); its last line,
+// Content-Type, goes into every part instead of the response headers.
+// Extra header lines go into the response headers as they are.
+static void send_byte_ranges(struct mg_connection *conn, FILE *fp,
+                             const struct file_cache_entry *cached,
+                             const struct mgstat *stp, const char *date,
+                             const char *file_headers, int fixed_len,
+                             const char *extra,
+                             const struct byte_range *ranges, int n) {
+  char part[MG_BUF_LEN], boundary[40];
+  const char *type;
+  int64_t cl;
+  int i, len, type_len, prefix_len;
+
+  // Locate the "Content-Type: " line, it ends the fixed header block
+  for (prefix_len = fixed_len - 2;
+       prefix_len > 0 && file_headers[prefix_len - 1] != '\n';
+       prefix_len--) {
+  }
+  type = file_headers + prefix_len + 14;
+  type_len = fixed_len - 2 - (prefix_len + 14);
+  (void) mg_snprintf(conn, boundary, sizeof(boundary), "%08lx%08lx%08lx",
+                     (unsigned long) time(NULL), (unsigned long) (size_t) conn,
+                     (unsigned long) conn->num_bytes_sent ^
+                     (unsigned long) stp->ino);
+
+  // Content-Length covers part headers, data and the closing delimiter
+  cl = (int64_t) strlen(boundary) + 8;
+  for (i = 0; i < n; i++) {
+    cl += mg_snprintf(conn, part, sizeof(part), "\r\n--%s\r\n"
+                      "Content-Type: %.*s\r\n"
+                      "Content-Range: bytes %" INT64_FMT "-%" INT64_FMT
+                      "/%" INT64_FMT "\r\n\r\n",
+                      boundary, type_len, type, ranges[i].start,
+                      ranges[i].start + ranges[i].len - 1, stp->size) +
+      ranges[i].len;
+  }
+
+  conn->request_info.status_code = 206;
+  (void) mg_printf(conn, "HTTP/1.1 206 Partial Content\r\n"
+                   "Date: %s\r\n"
+                   "%.*s%s"
+                   "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                   "Content-Length: %" INT64_FMT "\r\n"
+                   "Connection: %s\r\n"
+                   "Accept-Ranges: bytes\r\n\r\n",
+                   date, prefix_len, file_headers, extra, boundary, cl,
+                   suggest_connection_header(conn));
+  if (strcmp(conn->request_info.request_method, "HEAD") == 0) {
+    return;
+  }
+
+  for (i = 0; i < n; i++) {
+    len = mg_snprintf(conn, part, sizeof(part), "\r\n--%s\r\n"
+                      "Content-Type: %.*s\r\n"
+                      "Content-Range: bytes %" INT64_FMT "-%" INT64_FMT
+                      "/%" INT64_FMT "\r\n\r\n",
+                      boundary, type_len, type, ranges[i].start,
+                      ranges[i].start + ranges[i].len - 1, stp->size);
+    conn->num_bytes_sent += mg_write(conn, part, (size_t) len);
+    send_file_part(conn, fp, cached, ranges[i].start, ranges[i].len);
+  }
+  conn->num_bytes_sent += mg_printf(conn, "\r\n--%s--\r\n", boundary);
+}
+
+// Send the file, or ranges of it. Extra header lines, e.g. Content-Encoding
+// of a precompressed file, are added to the response headers.
+static void send_file_response(struct mg_connection *conn, const char *path,
+                               const char *type_path, struct mgstat *stp,
+                               const char *extra) {
+  char date[64], range[64], cl_line[64], file_headers[MG_BUF_LEN];
+  char headers[MG_BUF_LEN];
+  const char *msg = "OK", *hdr;
+  struct byte_range ranges[MAX_BYTE_RANGES];
+  int64_t cl, r1;
+  struct file_cache_entry *cached;
+  FILE *fp = NULL;
+  int n, headers_len, file_headers_len, fixed_len;
+
+  cl = stp->size;
+  conn->request_info.status_code = 200;
+  range[0] = cl_line[0] = '\0';
+
+  if ((fp = mg_fopen(path, "rb")) == NULL) {
+    if (ERRNO == ENOENT && conn->ctx->pc_slots != NULL) {
+      // Removed since its path was cached
+      remove_cached_uri(conn);
+      send_http_error(conn, 404, "Not Found", "%s", "File not found");
+    } else {
+      send_http_error(conn, 500, http_500_error,
+          "fopen(%s): %s", path, strerror(ERRNO));
+    }
     return;
   }
   set_close_on_exec(fileno(fp));
 
-  // If Range: header specified, act accordingly
-  r1 = r2 = 0;
-  hdr = mg_get_header(conn, "Range");
-  if (hdr != NULL && (n = parse_range_header(hdr, &r1, &r2)) > 0) {
-    conn->request_info.status_code = 206;
-    (void) fseeko(fp, r1, SEEK_SET);
-    cl = n == 2 ? r2 - r1 + 1: cl - r1;
-    (void) mg_snprintf(conn, range, sizeof(range),
-        "Content-Range: bytes "
-        "%" INT64_FMT "-%"
-        INT64_FMT "/%" INT64_FMT "\r\n",
-        r1, r1 + cl - 1, stp->size);
-    msg = "Partial Content";
-  }
-
-  // Prepare Etag, Date, Last-Modified headers. Must be in UTC, according to
-  // http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.3
-  gmt_time_string(date, sizeof(date), &curtime);
-  gmt_time_string(lm, sizeof(lm), &stp->mtime);
-  construct_etag(etag, sizeof(etag), stp);
+  // Stats from the path cache may be up to path_cache_ttl seconds old, and
+  // a cached mapping may hold a file since rewritten in place. Make the
+  // headers and the data describe the file that is actually open.
+  if (conn->ctx->pc_slots != NULL || conn->ctx->fc_buckets != NULL) {
+    (void) mg_fstat(fileno(fp), stp);
+    cl = stp->size;
+  }
+  // SSL_write() would read the mapping in user space, SSL connections
+  // read the open file instead
+  cached = conn->ssl == NULL ? file_cache_get(conn->ctx, path, stp) : NULL;
+
+  file_headers_len = get_file_headers(conn, path, type_path, stp, date,
+                                      file_headers, &fixed_len);
+
+  // If Range: header specified, act accordingly. Stale If-Range: asks
+  // for the whole file.
+  r1 = 0;
+  n = -1;
+  if ((hdr = mg_get_header(conn, "Range")) != NULL &&
+      if_range_matches(conn, stp)) {
+    n = parse_byte_ranges(hdr, stp->size, ranges, MAX_BYTE_RANGES);
+  }
+
+  if (n == 0) {
+    send_range_not_satisfiable(conn, stp);
+  } else if (n > 1) {
+    send_byte_ranges(conn, fp, cached, stp, date, file_headers, fixed_len,
+                     extra, ranges, n);
+  } else {
+    if (n == 1) {
+      conn->request_info.status_code = 206;
+      r1 = ranges[0].start;
+      cl = ranges[0].len;
+      (void) mg_snprintf(conn, range, sizeof(range),
+          "Content-Range: bytes "
+          "%" INT64_FMT "-%"
+          INT64_FMT "/%" INT64_FMT "\r\n",
+          r1, r1 + cl - 1, stp->size);
+      (void) mg_snprintf(conn, cl_line, sizeof(cl_line),
+          "Content-Length: %" INT64_FMT "\r\n", cl);
+      file_headers_len = fixed_len;
+      msg = "Partial Content";
+    }
 
-  (void) mg_printf(conn,
-      "HTTP/1.1 %d %s\r\n"
-      "Date: %s\r\n"
-      "Last-Modified: %s\r\n"
-      "Etag: %s\r\n"
-      "Content-Type: %.*s\r\n"
-      "Content-Length: %" INT64_FMT "\r\n"
-      "Connection: %s\r\n"
-      "Accept-Ranges: bytes\r\n"
-      "%s\r\n",
-      conn->request_info.status_code, msg, date, lm, etag, (int) mime_vec.len,
-      mime_vec.ptr, cl, suggest_connection_header(conn), range);
-
-  if (strcmp(conn->request_info.request_method, "HEAD") != 0) {
-    send_file_data(conn, fp, cl);
+    headers_len = mg_snprintf(conn, headers, sizeof(headers),
+        "HTTP/1.1 %d %s\r\n"
+        "Date: %s\r\n"
+        "%.*s%s%s"
+        "Connection: %s\r\n"
+        "Accept-Ranges: bytes\r\n"
+        "%s\r\n",
+        conn->request_info.status_code, msg, date, file_headers_len,
+        file_headers, cl_line, extra, suggest_connection_header(conn), range);
+
+    if (strcmp(conn->request_info.request_method, "HEAD") == 0) {
+      (void) mg_write(conn, headers, (size_t) headers_len);
+    } else if (mg_write(conn, headers, (size_t) headers_len) == headers_len) {
+      send_file_part(conn, fp, cached, r1, cl);
+    }
+  }
+
+  if (cached != NULL) {
+    file_cache_release(conn->ctx, cached);
   }
   (void) fclose(fp);
 }
 
+static void handle_file_request(struct mg_connection *conn, const char *path,
+                                struct mgstat *stp) {
+  send_file_response(conn, path, path, stp, "");
+}
+
 void mg_send_file(struct mg_connection *conn, const char *path) {
   struct mgstat st;
   if (mg_stat(path, &st) == 0) {
@@ -2694,15 +5502,32 @@ void mg_send_file(struct mg_connection *conn, const char *path) {
 // Parse HTTP headers from the given buffer, advance buffer to the point
 // where parsing stopped.
 static void parse_http_headers(char **buf, struct mg_request_info *ri) {
+  char *p = *buf, *e;
   int i;
 
+  // Same splitting as skip_quoted(buf, ":", " ", 0) followed by
+  // skip(buf, "\r\n"), done with one library scan per delimiter.
   for (i = 0; i < (int) ARRAY_SIZE(ri->http_headers); i++) {
-    ri->http_headers[i].name = skip_quoted(buf, ":", " ", 0);
-    ri->http_headers[i].value = skip(buf, "\r\n");
+    ri->http_headers[i].name = p;
+    if ((e = strchr(p, ':')) == NULL) {
+      p += strlen(p);
+    } else {
+      *e++ = '\0';
+      p = e + strspn(e, " ");
+    }
+
+    ri->http_headers[i].value = p;
+    p += strcspn(p, "\r\n");
+    if (*p != '\0') {
+      *p++ = '\0';
+      p += strspn(p, "\r\n");
+    }
+
     if (ri->http_headers[i].name[0] == '\0')
       break;
     ri->num_headers = i + 1;
   }
+  *buf = p;
 }
 
 static int is_valid_http_method(const char *method) {
@@ -2761,14 +5586,16 @@ static int parse_http_response(char *buf, int len, struct mg_request_info *ri) {
 // Upon every read operation, increase nread by the number of bytes read.
 static int read_request(FILE *fp, struct mg_connection *conn,
                         char *buf, int bufsiz, int *nread) {
-  int request_len, n = 1;
+  int request_len, scanned = 0, n = 1;
 
-  request_len = get_request_len(buf, *nread);
+  // Resume the scan where the previous one stopped, so that a request
+  // trickling in a few bytes at a time is not rescanned from the start.
+  request_len = scan_request(buf, *nread, &scanned);
   while (*nread < bufsiz && request_len == 0 && n > 0) {
     n = pull(fp, conn, buf + *nread, bufsiz - *nread);
     if (n > 0) {
       *nread += n;
-      request_len = get_request_len(buf, *nread);
+      request_len = scan_request(buf, *nread, &scanned);
     }
   }
 
@@ -2779,51 +5606,51 @@ static int read_request(FILE *fp, struct mg_connection *conn,
   return request_len;
 }
 
-// For given directory path, substitute it to valid index file.
-// Return 0 if index file has been found, -1 if not found.
-// If the file is found, it's stats is returned in stp.
-static int substitute_index_file(struct mg_connection *conn, char *path,
-                                 size_t path_len, struct mgstat *stp) {
+// Append entry number idx of index_files to the directory path. Return -1
+// if there is no such entry, 0 if it does not fit in the buffer, 1 if done.
+static int append_index_file(struct mg_connection *conn, char *path,
+                             size_t path_len, int idx) {
   const char *list = conn->ctx->config[INDEX_FILES];
-  struct mgstat st;
   struct vec filename_vec;
   size_t n = strlen(path);
-  int found = 0;
 
-  // The 'path' given to us points to the directory. Remove all trailing
-  // directory separator characters from the end of the path, and
-  // then append single directory separator character.
+  while ((list = next_option(list, &filename_vec, NULL)) != NULL &&
+         idx-- > 0) {
+  }
+  if (list == NULL) {
+    return -1;
+  }
+
+  // The path points to the directory. Remove all trailing directory
+  // separator characters from the end of the path, and then append single
+  // directory separator character and the file name.
   while (n > 0 && IS_DIRSEP_CHAR(path[n - 1])) {
     n--;
   }
+  if (filename_vec.len > path_len - (n + 2)) {
+    return 0;
+  }
   path[n] = DIRSEP;
+  (void) mg_strlcpy(path + n + 1, filename_vec.ptr, filename_vec.len + 1);
 
-  // Traverse index files list. For each entry, append it to the given
-  // path and see if the file exists. If it exists, break the loop
-  while ((list = next_option(list, &filename_vec, NULL)) != NULL) {
-
-    // Ignore too long entries that may overflow path buffer
-    if (filename_vec.len > path_len - (n + 2))
-      continue;
+  return 1;
+}
 
-    // Prepare full path to the index file
-    (void) mg_strlcpy(path + n + 1, filename_vec.ptr, filename_vec.len + 1);
+// For given directory path, find the first index file that exists. Return
+// its position in index_files and its stats, or -1 if none is found.
+static int find_index_file(struct mg_connection *conn, const char *dir,
+                           struct mgstat *stp) {
+  char path[PATH_MAX];
+  int i, res;
 
-    // Does it exist?
-    if (mg_stat(path, &st) == 0) {
-      // Yes it does, break the loop
-      *stp = st;
-      found = 1;
-      break;
+  for (i = 0; ; i++) {
+    (void) mg_strlcpy(path, dir, sizeof(path));
+    if ((res = append_index_file(conn, path, sizeof(path), i)) == -1) {
+      return -1;
+    } else if (res == 1 && mg_stat(path, stp) == 0) {
+      return i;
     }
   }
-
-  // If no index file exists, restore directory path
-  if (!found) {
-    path[n] = '\0';
-  }
-
-  return found;
 }
 
 // Return True if we should reply 304 Not Modified.
@@ -2846,10 +5673,20 @@ static int forward_body_data(struct mg_connection *conn, FILE *fp,
   expect = mg_get_header(conn, "Expect");
   assert(fp != NULL);
 
-  if (conn->content_len == -1) {
+  if (conn->content_len == -1 && conn->chunk_state == CHUNK_NONE) {
     send_http_error(conn, 411, "Length Required", "%s", "");
   } else if (expect != NULL && mg_strcasecmp(expect, "100-continue")) {
     send_http_error(conn, 417, "Expectation Failed", "%s", "");
+  } else if (conn->chunk_state != CHUNK_NONE) {
+    if (expect != NULL) {
+      (void) mg_printf(conn, "%s", "HTTP/1.1 100 Continue\r\n\r\n");
+    }
+    while ((nread = mg_read(conn, buf, sizeof(buf))) > 0 &&
+           push(fp, sock, ssl, buf, nread) == nread) {
+    }
+    if (!(success = nread == 0 && conn->chunk_state == CHUNK_DONE)) {
+      send_http_error(conn, 577, http_500_error, "%s", "");
+    }
   } else {
     if (expect != NULL) {
       (void) mg_printf(conn, "%s", "HTTP/1.1 100 Continue\r\n\r\n");
@@ -3056,40 +5893,96 @@ static void prepare_cgi_environment(struct mg_connection *conn,
   assert(blk->len < (int) sizeof(blk->buf));
 }
 
-static void handle_cgi_request(struct mg_connection *conn, const char *prog) {
-  int headers_len, data_len, i, fd_stdin[2], fd_stdout[2];
-  const char *status, *status_text;
-  char buf[16384], *pbuf, dir[PATH_MAX], *p;
-  struct mg_request_info ri;
-  struct cgi_env_block blk;
-  FILE *in, *out;
-  pid_t pid;
-
-  prepare_cgi_environment(conn, prog, &blk);
+// CGI must be executed in its own directory. Copy the directory containing
+// the executable program to dir, return the program name relative to it.
+static const char *get_cgi_dir(struct mg_connection *conn, const char *prog,
+                               char *dir, size_t dir_len) {
+  char *p;
 
-  // CGI must be executed in its own directory. 'dir' must point to the
-  // directory containing executable program, 'p' must point to the
-  // executable program name relative to 'dir'.
-  (void) mg_snprintf(conn, dir, sizeof(dir), "%s", prog);
+  (void) mg_snprintf(conn, dir, dir_len, "%s", prog);
   if ((p = strrchr(dir, DIRSEP)) != NULL) {
     *p++ = '\0';
-  } else {
-    dir[0] = '.', dir[1] = '\0';
-    p = (char *) prog;
+    return prog + (p - dir);
   }
+  dir[0] = '.', dir[1] = '\0';
+  return prog;
+}
 
-  pid = (pid_t) -1;
-  fd_stdin[0] = fd_stdin[1] = fd_stdout[0] = fd_stdout[1] = -1;
-  in = out = NULL;
+// Parse headers the CGI program sent, headers_len bytes in buf, and send
+// the status line and headers to the client.
+static void send_cgi_headers(struct mg_connection *conn, char *buf,
+                             int headers_len) {
+  const char *status, *status_text;
+  struct mg_request_info ri;
+  int i, chunked;
 
-  if (pipe(fd_stdin) != 0 || pipe(fd_stdout) != 0) {
-    send_http_error(conn, 500, http_500_error,
-        "Cannot create CGI pipe: %s", strerror(ERRNO));
-    goto done;
-  } else if ((pid = spawn_process(conn, p, blk.buf, blk.vars,
-          fd_stdin[0], fd_stdout[1], dir)) == (pid_t) -1) {
-    send_http_error(conn, 500, http_500_error,
-        "Cannot spawn CGI process [%s]: %s", prog, strerror(ERRNO));
+  buf[headers_len - 1] = '\0';
+  parse_http_headers(&buf, &ri);
+
+  // Make up and send the status line
+  status_text = "OK";
+  if ((status = get_header(&ri, "Status")) != NULL) {
+    conn->request_info.status_code = atoi(status);
+    status_text = status;
+    while (isdigit(* (unsigned char *) status_text) || *status_text == ' ') {
+      status_text++;
+    }
+  } else if (get_header(&ri, "Location") != NULL) {
+    conn->request_info.status_code = 302;
+  } else {
+    conn->request_info.status_code = 200;
+  }
+  if (get_header(&ri, "Connection") != NULL &&
+      !mg_strcasecmp(get_header(&ri, "Connection"), "keep-alive")) {
+    conn->must_close = 1;
+  }
+  (void) mg_printf(conn, "HTTP/1.1 %d %s\r\n", conn->request_info.status_code,
+                   status_text);
+
+  // Send headers. Output of unknown length is chunked, unless the program
+  // has chosen a transfer coding itself.
+  for (i = 0; i < ri.num_headers; i++) {
+    mg_printf(conn, "%s: %s\r\n",
+              ri.http_headers[i].name, ri.http_headers[i].value);
+  }
+  chunked = get_header(&ri, "Content-Length") == NULL &&
+    get_header(&ri, "Transfer-Encoding") == NULL &&
+    use_chunked_encoding(conn);
+  (void) mg_printf(conn, "%s\r\n",
+                   chunked ? "Transfer-Encoding: chunked\r\n" : "");
+  conn->chunked = chunked;
+}
+
+static void handle_cgi_request(struct mg_connection *conn, const char *prog) {
+  int headers_len, data_len, fd_stdin[2], fd_stdout[2];
+  char buf[16384], dir[PATH_MAX];
+  struct cgi_env_block blk;
+  const char *p;
+  FILE *in, *out;
+  pid_t pid;
+
+  prepare_cgi_environment(conn, prog, &blk);
+  p = get_cgi_dir(conn, prog, dir, sizeof(dir));
+
+  pid = (pid_t) -1;
+  fd_stdin[0] = fd_stdin[1] = fd_stdout[0] = fd_stdout[1] = -1;
+  in = out = NULL;
+
+  if (pipe(fd_stdin) != 0 || pipe(fd_stdout) != 0) {
+    send_http_error(conn, 500, http_500_error,
+        "Cannot create CGI pipe: %s", strerror(ERRNO));
+    goto done;
+  }
+
+  // Parent's ends of the pipes must not leak into the child, or it would
+  // never see EOF on its stdin
+  set_close_on_exec(fd_stdin[1]);
+  set_close_on_exec(fd_stdout[0]);
+
+  if ((pid = spawn_process(conn, p, blk.buf, blk.vars,
+          fd_stdin[0], fd_stdout[1], dir)) == (pid_t) -1) {
+    send_http_error(conn, 500, http_500_error,
+        "Cannot spawn CGI process [%s]: %s", prog, strerror(ERRNO));
     goto done;
   } else if ((in = fdopen(fd_stdin[1], "wb")) == NULL ||
       (out = fdopen(fd_stdout[0], "rb")) == NULL) {
@@ -3129,43 +6022,17 @@ static void handle_cgi_request(struct mg_connection *conn, const char *prog) {
                     (unsigned) sizeof(buf), data_len, buf);
     goto done;
   }
-  pbuf = buf;
-  buf[headers_len - 1] = '\0';
-  parse_http_headers(&pbuf, &ri);
-
-  // Make up and send the status line
-  status_text = "OK";
-  if ((status = get_header(&ri, "Status")) != NULL) {
-    conn->request_info.status_code = atoi(status);
-    status_text = status;
-    while (isdigit(* (unsigned char *) status_text) || *status_text == ' ') {
-      status_text++;
-    }
-  } else if (get_header(&ri, "Location") != NULL) {
-    conn->request_info.status_code = 302;
-  } else {
-    conn->request_info.status_code = 200;
-  }
-  if (get_header(&ri, "Connection") != NULL &&
-      !mg_strcasecmp(get_header(&ri, "Connection"), "keep-alive")) {
-    conn->must_close = 1;
-  }
-  (void) mg_printf(conn, "HTTP/1.1 %d %s\r\n", conn->request_info.status_code,
-                   status_text);
+  send_cgi_headers(conn, buf, headers_len);
 
-  // Send headers
-  for (i = 0; i < ri.num_headers; i++) {
-    mg_printf(conn, "%s: %s\r\n",
-              ri.http_headers[i].name, ri.http_headers[i].value);
-  }
-  (void) mg_write(conn, "\r\n", 2);
-
-  // Send chunk of data that may have been read after the headers
+  // Send chunk of data that may have been read after the headers, together
+  // with the headers, before blocking on the CGI output
   conn->num_bytes_sent += mg_write(conn, buf + headers_len,
-                                   (size_t)(data_len - headers_len));
+                                   (size_t) (data_len - headers_len));
+  (void) flush_output(conn, NULL, 0, 0);
 
   // Read the rest of CGI output and send to the client
   send_file_data(conn, out, INT64_MAX);
+  finish_chunked_body(conn);
 
 done:
   if (pid != (pid_t) -1) {
@@ -3190,6 +6057,528 @@ done:
     (void) close(fd_stdout[0]);
   }
 }
+
+#if defined(USE_FASTCGI)
+// FastCGI record types, see the FastCGI specification
+enum {
+  FCGI_BEGIN_REQUEST = 1, FCGI_ABORT_REQUEST, FCGI_END_REQUEST, FCGI_PARAMS,
+  FCGI_STDIN, FCGI_STDOUT, FCGI_STDERR
+};
+
+#define FCGI_VERSION_1 1
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_REQUEST_ID 1  // Requests on a connection do not overlap
+#define FCGI_HEADER_LEN 8
+
+// Processes running one FastCGI program. They all accept() connections on
+// one listening Unix socket, which is their standard input. Connections to
+// them are kept open between requests, there is at most one per process.
+struct fcgi_pool {
+  struct fcgi_pool *next;
+  char *prog;                   // Path of the program
+  struct sockaddr_un sun;       // Address of the listening socket
+  SOCKET sock;                  // Listening socket, for starting processes
+  pthread_cond_t cond;          // Signalled when a connection is released
+  pid_t pids[FCGI_MAX_PROCESSES];
+  SOCKET idle[FCGI_MAX_PROCESSES];  // Open connections not in use
+  int num_idle;
+  int num_conns;                // Open connections, idle or in use
+};
+
+static int is_running(pid_t pid) {
+  // waitpid() fails when SIGCHLD is ignored, then zombies do not exist
+  return pid != (pid_t) -1 && waitpid(pid, NULL, WNOHANG) <= 0 &&
+    kill(pid, 0) == 0;
+}
+
+// FastCGI programs get the server's environment only, request variables
+// are sent to them in FCGI_PARAMS records.
+static void prepare_fcgi_environment(struct mg_connection *conn,
+                                     struct cgi_env_block *blk) {
+  static const char *names[] = {"PATH", "LD_LIBRARY_PATH", "PERLLIB", "TMPDIR"};
+  struct vec var_vec;
+  const char *s;
+  size_t i;
+
+  blk->len = blk->nvars = 0;
+  blk->conn = conn;
+  for (i = 0; i < ARRAY_SIZE(names); i++) {
+    if ((s = getenv(names[i])) != NULL) {
+      addenv(blk, "%s=%s", names[i], s);
+    }
+  }
+  s = conn->ctx->config[CGI_ENVIRONMENT];
+  while ((s = next_option(s, &var_vec, NULL)) != NULL) {
+    addenv(blk, "%.*s", (int) var_vec.len, var_vec.ptr);
+  }
+  blk->vars[blk->nvars++] = NULL;
+  blk->buf[blk->len++] = '\0';
+}
+
+// Start the processes of the pool that are not running, the first time or
+// after they have exited. Called with fcgi_mutex held.
+static void start_fcgi_processes(struct mg_connection *conn,
+                                 struct fcgi_pool *pool) {
+  struct cgi_env_block blk;
+  char dir[PATH_MAX];
+  const char *p;
+  int i, fd_stdin, fd_stdout;
+
+  prepare_fcgi_environment(conn, &blk);
+  p = get_cgi_dir(conn, pool->prog, dir, sizeof(dir));
+
+  for (i = 0; i < conn->ctx->fcgi_processes; i++) {
+    if (is_running(pool->pids[i])) {
+      continue;
+    }
+    fd_stdin = dup(pool->sock);
+    fd_stdout = open("/dev/null", O_WRONLY);
+    if (fd_stdin == -1 || fd_stdout == -1) {
+      cry(conn, "%s: %s: %s", __func__, pool->prog, strerror(ERRNO));
+      if (fd_stdin != -1) {
+        (void) close(fd_stdin);
+      }
+      if (fd_stdout != -1) {
+        (void) close(fd_stdout);
+      }
+      break;
+    }
+    pool->pids[i] = spawn_process(conn, p, blk.buf, blk.vars,
+                                  fd_stdin, fd_stdout, dir);
+  }
+}
+
+// Create the pool of a program, with the listening socket in fcgi_dir.
+// Called with fcgi_mutex held.
+static struct fcgi_pool *new_fcgi_pool(struct mg_connection *conn,
+                                       const char *prog) {
+  struct mg_context *ctx = conn->ctx;
+  struct fcgi_pool *pool, *p;
+  int i, n = 0;
+
+  for (p = ctx->fcgi_pools; p != NULL; p = p->next) {
+    n++;
+  }
+  if (ctx->fcgi_dir[0] == '\0') {
+    mg_strlcpy(ctx->fcgi_dir, "/tmp/mongoose-fcgi.XXXXXX",
+               sizeof(ctx->fcgi_dir));
+    if (mkdtemp(ctx->fcgi_dir) == NULL) {
+      cry(conn, "%s: mkdtemp(%s): %s", __func__, ctx->fcgi_dir,
+          strerror(ERRNO));
+      ctx->fcgi_dir[0] = '\0';
+      return NULL;
+    }
+  }
+  if ((pool = (struct fcgi_pool *) calloc(1, sizeof(*pool))) == NULL ||
+      (pool->prog = mg_strdup(prog)) == NULL) {
+    cry(conn, "%s: cannot allocate pool", __func__);
+    free(pool);
+    return NULL;
+  }
+
+  pool->sun.sun_family = AF_UNIX;
+  (void) mg_snprintf(conn, pool->sun.sun_path, sizeof(pool->sun.sun_path),
+                     "%s/%d.sock", ctx->fcgi_dir, n);
+  if ((pool->sock = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET ||
+      bind(pool->sock, (struct sockaddr *) &pool->sun,
+           sizeof(pool->sun)) != 0 ||
+      listen(pool->sock, FCGI_MAX_PROCESSES) != 0) {
+    cry(conn, "%s: %s: %s", __func__, pool->sun.sun_path, strerror(ERRNO));
+    if (pool->sock != INVALID_SOCKET) {
+      (void) closesocket(pool->sock);
+    }
+    (void) unlink(pool->sun.sun_path);
+    free(pool->prog);
+    free(pool);
+    return NULL;
+  }
+  set_close_on_exec(pool->sock);
+  (void) pthread_cond_init(&pool->cond, NULL);
+  for (i = 0; i < FCGI_MAX_PROCESSES; i++) {
+    pool->pids[i] = (pid_t) -1;
+  }
+  pool->next = ctx->fcgi_pools;
+  ctx->fcgi_pools = pool;
+
+  return pool;
+}
+
+// Take a connection to a process running prog, waiting while all processes
+// are busy. Set *reused if the connection has served requests before.
+static SOCKET get_fcgi_conn(struct mg_connection *conn, const char *prog,
+                            struct fcgi_pool **poolp, int *reused) {
+  struct mg_context *ctx = conn->ctx;
+  struct fcgi_pool *pool;
+  SOCKET sock = INVALID_SOCKET;
+  struct timeval tv;
+  char ch;
+
+  tv.tv_sec = 1;  // See check_fcgi_pool()
+  tv.tv_usec = 0;
+
+  (void) pthread_mutex_lock(&ctx->fcgi_mutex);
+  for (pool = ctx->fcgi_pools; pool != NULL && strcmp(pool->prog, prog);
+       pool = pool->next) {
+  }
+  if (pool == NULL) {
+    pool = new_fcgi_pool(conn, prog);
+  }
+  while (pool != NULL && sock == INVALID_SOCKET) {
+    if (pool->num_idle > 0) {
+      // The process may have exited or closed the connection while it
+      // was idle. Then the connection reads EOF instead of EAGAIN.
+      sock = pool->idle[--pool->num_idle];
+      *reused = 1;
+      if (recv(sock, &ch, 1, MSG_PEEK | MSG_DONTWAIT) != -1 ||
+          (ERRNO != EAGAIN && ERRNO != EWOULDBLOCK)) {
+        (void) closesocket(sock);
+        sock = INVALID_SOCKET;
+        pool->num_conns--;
+      }
+    } else if (pool->num_conns < ctx->fcgi_processes) {
+      start_fcgi_processes(conn, pool);
+      *reused = 0;
+      if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET ||
+          connect(sock, (struct sockaddr *) &pool->sun,
+                  sizeof(pool->sun)) != 0) {
+        cry(conn, "%s: %s: %s", __func__, pool->sun.sun_path,
+            strerror(ERRNO));
+        if (sock != INVALID_SOCKET) {
+          (void) closesocket(sock);
+        }
+        break;
+      }
+      set_close_on_exec(sock);
+      (void) setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *) &tv,
+                        sizeof(tv));
+      (void) setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (void *) &tv,
+                        sizeof(tv));
+      pool->num_conns++;
+    } else {
+      (void) pthread_cond_wait(&pool->cond, &ctx->fcgi_mutex);
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->fcgi_mutex);
+
+  *poolp = pool;
+  return sock;
+}
+
+// Keep the connection for the next request if reuse is set, or close it
+static void put_fcgi_conn(struct mg_context *ctx, struct fcgi_pool *pool,
+                          SOCKET sock, int reuse) {
+  (void) pthread_mutex_lock(&ctx->fcgi_mutex);
+  if (reuse) {
+    pool->idle[pool->num_idle++] = sock;
+  } else {
+    (void) closesocket(sock);
+    pool->num_conns--;
+  }
+  (void) pthread_cond_signal(&pool->cond);
+  (void) pthread_mutex_unlock(&ctx->fcgi_mutex);
+}
+
+// Called when a FastCGI program has not read or written for a second.
+// A connection made while all processes were busy waits in the listen
+// queue for a process, restart processes that have exited meanwhile.
+// Return 0 if none is running: the program is broken, or the server is
+// stopping.
+static int check_fcgi_pool(struct mg_connection *conn,
+                           struct fcgi_pool *pool) {
+  int i, running = 0;
+
+  (void) pthread_mutex_lock(&conn->ctx->fcgi_mutex);
+  for (i = 0; i < conn->ctx->fcgi_processes; i++) {
+    running += is_running(pool->pids[i]);
+  }
+  if (running > 0 && running < conn->ctx->fcgi_processes) {
+    start_fcgi_processes(conn, pool);
+  }
+  (void) pthread_mutex_unlock(&conn->ctx->fcgi_mutex);
+
+  return running > 0 && !conn->ctx->stop_flag;
+}
+
+// Send or receive len bytes on a FastCGI connection. Return 1 on success.
+static int fcgi_io(struct mg_connection *conn, struct fcgi_pool *pool,
+                   SOCKET sock, char *buf, int len, int is_send) {
+  int n;
+
+  while (len > 0) {
+    n = is_send ? send(sock, buf, (size_t) len, MSG_NOSIGNAL) :
+      recv(sock, buf, (size_t) len, 0);
+    if (n > 0) {
+      buf += n;
+      len -= n;
+    } else if (n == 0 || (ERRNO != EAGAIN && ERRNO != EWOULDBLOCK &&
+                          ERRNO != EINTR) ||
+               (ERRNO != EINTR && !check_fcgi_pool(conn, pool))) {
+      break;
+    }
+  }
+  return len == 0;
+}
+
+static void free_fcgi_pools(struct mg_context *ctx) {
+  struct fcgi_pool *pool;
+  int i;
+
+  while ((pool = ctx->fcgi_pools) != NULL) {
+    ctx->fcgi_pools = pool->next;
+    for (i = 0; i < FCGI_MAX_PROCESSES; i++) {
+      if (is_running(pool->pids[i])) {
+        (void) kill(pool->pids[i], SIGTERM);
+      }
+    }
+    for (i = 0; i < pool->num_idle; i++) {
+      (void) closesocket(pool->idle[i]);
+    }
+    (void) closesocket(pool->sock);
+    (void) unlink(pool->sun.sun_path);
+    (void) pthread_cond_destroy(&pool->cond);
+    free(pool->prog);
+    free(pool);
+  }
+  if (ctx->fcgi_dir[0] != '\0') {
+    (void) rmdir(ctx->fcgi_dir);
+  }
+}
+
+static void put_fcgi_header(unsigned char *buf, int type, int len) {
+  buf[0] = FCGI_VERSION_1;
+  buf[1] = (unsigned char) type;
+  buf[2] = 0;
+  buf[3] = FCGI_REQUEST_ID;
+  buf[4] = (unsigned char) (len >> 8);
+  buf[5] = (unsigned char) len;
+  buf[6] = buf[7] = 0;  // No padding
+}
+
+// Append FastCGI name-value pair length to buf, return its size
+static int put_fcgi_length(unsigned char *buf, int len) {
+  if (len < 128) {
+    buf[0] = (unsigned char) len;
+    return 1;
+  }
+  buf[0] = (unsigned char) ((len >> 24) | 0x80);
+  buf[1] = (unsigned char) (len >> 16);
+  buf[2] = (unsigned char) (len >> 8);
+  buf[3] = (unsigned char) len;
+  return 4;
+}
+
+// Send FCGI_BEGIN_REQUEST and the CGI environment in FCGI_PARAMS records
+// with one write. A request without body gets its empty FCGI_STDIN
+// record in the same write. Return 1 on success.
+static int send_fcgi_params(struct mg_connection *conn,
+                            struct fcgi_pool *pool, SOCKET sock,
+                            const struct cgi_env_block *blk, int has_body) {
+  // Name-value pairs take at most 7 more bytes than NAME=VALUE\0 strings
+  unsigned char buf[CGI_ENVIRONMENT_SIZE + MAX_CGI_ENVIR_VARS * 7 +
+                    5 * FCGI_HEADER_LEN];
+  const char *name, *value;
+  int i, n, name_len, value_len;
+
+  put_fcgi_header(buf, FCGI_BEGIN_REQUEST, 8);
+  memset(buf + FCGI_HEADER_LEN, 0, 8);
+  buf[FCGI_HEADER_LEN + 1] = FCGI_RESPONDER;
+  buf[FCGI_HEADER_LEN + 2] = FCGI_KEEP_CONN;
+
+  n = 3 * FCGI_HEADER_LEN;
+  for (i = 0; blk->vars[i] != NULL; i++) {
+    name = blk->vars[i];
+    if ((value = strchr(name, '=')) == NULL) {
+      continue;
+    }
+    name_len = (int) (value++ - name);
+    value_len = (int) strlen(value);
+    n += put_fcgi_length(buf + n, name_len);
+    n += put_fcgi_length(buf + n, value_len);
+    memcpy(buf + n, name, (size_t) name_len);
+    memcpy(buf + n + name_len, value, (size_t) value_len);
+    n += name_len + value_len;
+  }
+  put_fcgi_header(buf + 2 * FCGI_HEADER_LEN, FCGI_PARAMS,
+                  n - 3 * FCGI_HEADER_LEN);
+  put_fcgi_header(buf + n, FCGI_PARAMS, 0);
+  n += FCGI_HEADER_LEN;
+  if (!has_body) {
+    put_fcgi_header(buf + n, FCGI_STDIN, 0);
+    n += FCGI_HEADER_LEN;
+  }
+
+  return fcgi_io(conn, pool, sock, (char *) buf, n, 1);
+}
+
+// Forward request body in FCGI_STDIN records, ending with the empty one.
+// Return 1 on success, 0 if reading from the client failed, -1 if sending
+// to the FastCGI program failed.
+static int send_fcgi_stdin(struct mg_connection *conn, struct fcgi_pool *pool,
+                           SOCKET sock) {
+  unsigned char buf[FCGI_HEADER_LEN + MG_BUF_LEN];
+  int n;
+
+  while ((n = mg_read(conn, buf + FCGI_HEADER_LEN, MG_BUF_LEN)) > 0) {
+    put_fcgi_header(buf, FCGI_STDIN, n);
+    if (!fcgi_io(conn, pool, sock, (char *) buf, n + FCGI_HEADER_LEN, 1)) {
+      return -1;
+    }
+  }
+  if (n < 0 || (conn->chunk_state != CHUNK_NONE &&
+                conn->chunk_state != CHUNK_DONE) ||
+      (conn->chunk_state == CHUNK_NONE &&
+       conn->consumed_content < conn->content_len)) {
+    return 0;
+  }
+  put_fcgi_header(buf, FCGI_STDIN, 0);
+  return fcgi_io(conn, pool, sock, (char *) buf, FCGI_HEADER_LEN, 1) ? 1 : -1;
+}
+
+
+// Read FastCGI records of the reply and send FCGI_STDOUT to the client,
+// like handle_cgi_request() does with CGI output. Return 1 if the reply
+// ended with FCGI_END_REQUEST and the connection can serve another request.
+// Set *replied when the program has sent a record.
+static int send_fcgi_reply(struct mg_connection *conn, struct fcgi_pool *pool,
+                           SOCKET sock, int *replied) {
+  char buf[16384], data[MG_BUF_LEN], header[FCGI_HEADER_LEN], *p;
+  int type, len, n, headers_len = 0, data_len = 0;
+
+  while (fcgi_io(conn, pool, sock, header, sizeof(header), 0)) {
+    *replied = 1;
+    type = (unsigned char) header[1];
+    len = ((unsigned char) header[4] << 8) | (unsigned char) header[5];
+
+    if (type == FCGI_STDOUT && headers_len == 0) {
+      // Buffer in all HTTP headers before sending anything to the client.
+      // A record of up to 64 KB may hold the body too. It is read in pieces
+      // that fit until the headers end, the rest is streamed below.
+      while (len > 0 && headers_len == 0) {
+        n = len < (int) sizeof(buf) - data_len ?
+          len : (int) sizeof(buf) - data_len;
+        if (n == 0 || !fcgi_io(conn, pool, sock, buf + data_len, n, 0) ||
+            (headers_len = get_request_len(buf, data_len + n)) < 0) {
+          headers_len = -1;
+          break;
+        }
+        data_len += n;
+        len -= n;
+      }
+      if (headers_len < 0) {
+        break;
+      } else if (headers_len > 0) {
+        send_cgi_headers(conn, buf, headers_len);
+        n = data_len - headers_len;
+        if (mg_write(conn, buf + headers_len, (size_t) n) != n) {
+          return 0;
+        }
+        conn->num_bytes_sent += n;
+      }
+    }
+
+    while (len > 0) {
+      n = len < (int) sizeof(data) - 1 ? len : (int) sizeof(data) - 1;
+      if (!fcgi_io(conn, pool, sock, data, n, 0)) {
+        break;
+      }
+      len -= n;
+      if (type == FCGI_STDOUT) {
+        if (mg_write(conn, data, (size_t) n) != n) {
+          return 0;
+        }
+        conn->num_bytes_sent += n;
+      } else if (type == FCGI_STDERR) {
+        data[n] = '\0';
+        if ((p = strrchr(data, '\n')) != NULL && p[1] == '\0') {
+          *p = '\0';
+        }
+        cry(conn, "%s: %s: %s", __func__, pool->prog, data);
+      }
+    }
+
+    // Skip padding
+    n = (unsigned char) header[6];
+    if (len > 0 || (n > 0 && !fcgi_io(conn, pool, sock, data, n, 0))) {
+      break;
+    } else if (type == FCGI_END_REQUEST && headers_len > 0) {
+      finish_chunked_body(conn);
+      return 1;
+    } else if (type == FCGI_END_REQUEST) {
+      break;
+    }
+  }
+
+  if (headers_len > 0) {
+    // Reply is cut short, closing the connection tells the client so
+    conn->must_close = 1;
+  } else if (*replied) {
+    send_http_error(conn, 500, http_500_error,
+                    "FastCGI program sent malformed or too big (>%u bytes) "
+                    "HTTP headers: [%.*s]",
+                    (unsigned) sizeof(buf), data_len, buf);
+  }
+  return 0;
+}
+
+static void handle_fcgi_request(struct mg_connection *conn, const char *prog) {
+  struct cgi_env_block blk;
+  struct fcgi_pool *pool;
+  const char *expect;
+  SOCKET sock;
+  int has_body, reused, replied, ok, retry;
+
+  expect = mg_get_header(conn, "Expect");
+  has_body = conn->chunk_state != CHUNK_NONE || conn->content_len > 0;
+  if (!strcmp(conn->request_info.request_method, "POST") &&
+      conn->content_len == -1 && conn->chunk_state == CHUNK_NONE) {
+    send_http_error(conn, 411, "Length Required", "%s", "");
+    return;
+  } else if (expect != NULL && mg_strcasecmp(expect, "100-continue")) {
+    send_http_error(conn, 417, "Expectation Failed", "%s", "");
+    return;
+  }
+
+  prepare_cgi_environment(conn, prog, &blk);
+
+  // The program may close a kept connection at any time. A request that
+  // fails on such a connection before a reply is retried once, unless its
+  // body would have to be sent again.
+  retry = !has_body;
+  do {
+    sock = get_fcgi_conn(conn, prog, &pool, &reused);
+    if (sock == INVALID_SOCKET) {
+      send_http_error(conn, 500, http_500_error,
+                      "Cannot connect to FastCGI program [%s]", prog);
+      return;
+    }
+    replied = 0;
+    if (!send_fcgi_params(conn, pool, sock, &blk, has_body)) {
+      ok = 0;
+    } else if (has_body) {
+      if (expect != NULL) {
+        (void) mg_printf(conn, "%s", "HTTP/1.1 100 Continue\r\n\r\n");
+      }
+      if ((ok = send_fcgi_stdin(conn, pool, sock)) == 0) {
+        send_http_error(conn, 577, http_500_error, "%s", "");
+        replied = 1;
+      } else if (ok > 0) {
+        ok = send_fcgi_reply(conn, pool, sock, &replied);
+      } else {
+        ok = 0;
+      }
+    } else {
+      ok = send_fcgi_reply(conn, pool, sock, &replied);
+    }
+    put_fcgi_conn(conn->ctx, pool, sock, ok);
+  } while (!ok && !replied && reused && retry--);
+
+  if (!ok && !replied) {
+    send_http_error(conn, 500, http_500_error,
+                    "FastCGI program [%s] closed connection", prog);
+  }
+}
+#endif // USE_FASTCGI
 #endif // !NO_CGI
 
 // For a given PUT path, create all intermediate subdirectories
@@ -3226,6 +6615,184 @@ static int put_dir(const char *path) {
   return res;
 }
 
+#if !defined(_WIN32)
+// Make written data of fd durable. With put_fsync "batch" on Linux, one
+// syncfs() makes the data of all uploads that wait meanwhile durable, and
+// the file system commits its journal once for all of them.
+static int sync_upload(struct mg_context *ctx, int fd) {
+#if defined(SYS_syncfs)
+  struct mgstat st;
+  int64_t ticket, last;
+  int rc = 0;
+
+  if (ctx->put_fsync == PUT_FSYNC_BATCH && mg_fstat(fd, &st) == 0) {
+    (void) pthread_mutex_lock(&ctx->put_mutex);
+    ticket = ++ctx->put_tickets;
+    while (rc == 0 &&
+           (ctx->put_synced < ticket || ctx->put_synced_dev != st.dev)) {
+      if (ctx->put_syncing) {
+        (void) pthread_cond_wait(&ctx->put_cond, &ctx->put_mutex);
+        continue;
+      } else if (ctx->put_synced >= ticket) {
+        // Sync that covered the ticket was on another file system
+        ticket = ++ctx->put_tickets;
+      }
+      ctx->put_syncing = 1;
+      last = ctx->put_tickets;
+      (void) pthread_mutex_unlock(&ctx->put_mutex);
+      rc = (int) syscall(SYS_syncfs, fd);
+      (void) pthread_mutex_lock(&ctx->put_mutex);
+      ctx->put_syncing = 0;
+      if (rc == 0) {
+        ctx->put_synced = last;
+        ctx->put_synced_dev = st.dev;
+      }
+      (void) pthread_cond_broadcast(&ctx->put_cond);
+    }
+    (void) pthread_mutex_unlock(&ctx->put_mutex);
+    return rc;
+  }
+#endif // SYS_syncfs
+  return fsync(fd);
+}
+
+static int write_all(int fd, const char *buf, int len) {
+  int n;
+
+  while (len > 0) {
+    if ((n = (int) write(fd, buf, (size_t) len)) > 0) {
+      buf += n;
+      len -= n;
+    } else if (n < 0 && ERRNO != EINTR) {
+      break;
+    }
+  }
+  return len == 0;
+}
+
+// Return 1 if the Digest request header has no SHA-256 value, or the value
+// is digest. See RFC 3230.
+static int digest_matches(const struct mg_connection *conn,
+                          const char *digest) {
+  const char *list = mg_get_header(conn, "Digest");
+  struct vec name, value;
+
+  while ((list = next_option(list, &name, &value)) != NULL) {
+    while (name.len > 0 && isspace(* (unsigned char *) name.ptr)) {
+      name.ptr++, name.len--;
+    }
+    if (name.len == 7 && !mg_strncasecmp(name.ptr, "SHA-256", 7)) {
+      return value.len == strlen(digest) &&
+        !memcmp(value.ptr, digest, value.len);
+    }
+  }
+  return 1;
+}
+
+// Receive the body of a PUT request into a temporary file next to path
+// and rename it over path, so readers see either the old or the whole new
+// file. Data goes to the file in large writes, hashed with SHA-256 on the
+// way. The hash is checked against the Digest request header, if any, and
+// is sent back in the Digest response header.
+static void put_file_atomic(struct mg_connection *conn, const char *path) {
+  char tmp[PATH_MAX], dir[PATH_MAX], digest[45], *buf = NULL;
+  const char *expect, *name;
+  unsigned char hash[32];
+  struct upload_hash hash_ctx;
+  struct stat old;
+  int n, fd = -1, dir_fd, done = 0;
+
+  expect = mg_get_header(conn, "Expect");
+  name = strrchr(path, '/') + 1;
+  if (conn->content_len == -1 && conn->chunk_state == CHUNK_NONE) {
+    send_http_error(conn, 411, "Length Required", "%s", "");
+    return;
+  } else if (expect != NULL && mg_strcasecmp(expect, "100-continue")) {
+    send_http_error(conn, 417, "Expectation Failed", "%s", "");
+    return;
+  } else if (mg_snprintf(conn, tmp, sizeof(tmp), "%.*s.%s.XXXXXX",
+                         (int) (name - path), path, name) >=
+             (int) sizeof(tmp) - 1) {
+    send_http_error(conn, 500, http_500_error, "%s: path too long", path);
+    return;
+  } else if ((buf = (char *) malloc(PUT_BUF_SIZE)) == NULL ||
+             (fd = mkstemp(tmp)) == -1) {
+    send_http_error(conn, 500, http_500_error, "%s: %s", path,
+                    buf == NULL ? "cannot allocate buffer" : strerror(ERRNO));
+    free(buf);
+    return;
+  }
+  set_close_on_exec(fd);
+  // mkstemp() makes the file 0600. Replaced file keeps its mode, a new one
+  // gets what open() would have given it.
+  (void) fchmod(fd, stat(path, &old) == 0 ? old.st_mode & 07777 :
+                0666 & ~conn->ctx->put_umask);
+
+  if (expect != NULL) {
+    (void) mg_printf(conn, "%s", "HTTP/1.1 100 Continue\r\n\r\n");
+  }
+  upload_hash_init(&hash_ctx);
+  while ((n = mg_read(conn, buf, PUT_BUF_SIZE)) > 0) {
+    upload_hash_update(&hash_ctx, buf, (size_t) n);
+    if (!write_all(fd, buf, n)) {
+      break;
+    }
+  }
+  upload_hash_final(hash, &hash_ctx);
+  base64_encode(hash, sizeof(hash), digest);
+
+  if (n > 0) {
+    conn->must_close = 1;  // Rest of the body is not read
+    send_http_error(conn, 500, http_500_error, "write(%s): %s", tmp,
+                    strerror(ERRNO));
+  } else if (n < 0 || (conn->chunk_state != CHUNK_NONE &&
+                       conn->chunk_state != CHUNK_DONE) ||
+             (conn->chunk_state == CHUNK_NONE &&
+              conn->consumed_content < conn->content_len)) {
+    send_http_error(conn, 577, http_500_error, "%s", "");
+  } else if (!digest_matches(conn, digest)) {
+    send_http_error(conn, 400, "Bad Request", "Digest mismatch, got %s",
+                    digest);
+  } else if ((conn->ctx->put_fsync != PUT_FSYNC_NO &&
+              sync_upload(conn->ctx, fd) != 0) ||
+             close(fd) != 0) {
+    send_http_error(conn, 500, http_500_error, "%s: %s", tmp,
+                    strerror(ERRNO));
+  } else if ((fd = -1, rename(tmp, path)) != 0) {
+    send_http_error(conn, 500, http_500_error, "rename(%s): %s", path,
+                    strerror(ERRNO));
+  } else {
+    done = 1;
+  }
+
+  if (done && conn->ctx->put_fsync != PUT_FSYNC_NO) {
+    // Make the rename durable too
+    (void) mg_snprintf(conn, dir, sizeof(dir), "%.*s", (int) (name - path),
+                       path);
+    if ((dir_fd = open(dir, O_RDONLY)) != -1) {
+      (void) sync_upload(conn->ctx, dir_fd);
+      (void) close(dir_fd);
+    }
+  }
+  if (done) {
+    (void) mg_printf(conn, "HTTP/1.1 %d %s\r\nDigest: SHA-256=%s\r\n"
+                     "Content-Length: 0\r\nConnection: %s\r\n\r\n",
+                     conn->request_info.status_code,
+                     conn->request_info.status_code == 201 ? "Created" : "OK",
+                     digest, suggest_connection_header(conn));
+  } else {
+    if (fd != -1) {
+      (void) close(fd);
+    }
+    (void) unlink(tmp);
+  }
+  free(buf);
+}
+#endif // !_WIN32
+
+// Uploads without Content-Range are received by put_file_atomic(). Ranges
+// update the file in place. A range that does not parse is refused rather
+// than written over the start of the file.
 static void put_file(struct mg_connection *conn, const char *path) {
   struct mgstat st;
   const char *range;
@@ -3234,20 +6801,29 @@ static void put_file(struct mg_connection *conn, const char *path) {
   int rc;
 
   conn->request_info.status_code = mg_stat(path, &st) == 0 ? 200 : 201;
+  range = mg_get_header(conn, "Content-Range");
+  r1 = r2 = 0;
 
-  if ((rc = put_dir(path)) == 0) {
+  if (range != NULL && (parse_range_header(range, &r1, &r2) < 1 || r1 < 0)) {
+    conn->must_close = 1;  // Body is not read
+    send_http_error(conn, 400, "Bad Request", "Invalid Content-Range: %s",
+                    range);
+  } else if ((rc = put_dir(path)) == 0) {
     mg_printf(conn, "HTTP/1.1 %d OK\r\n\r\n", conn->request_info.status_code);
   } else if (rc == -1) {
     send_http_error(conn, 500, http_500_error,
         "put_dir(%s): %s", path, strerror(ERRNO));
-  } else if ((fp = mg_fopen(path, "wb+")) == NULL) {
+#if !defined(_WIN32)
+  } else if (range == NULL) {
+    put_file_atomic(conn, path);
+#endif
+  } else if ((fp = mg_fopen(path, range == NULL ? "wb+" : "rb+")) == NULL &&
+             (fp = mg_fopen(path, "wb+")) == NULL) {
     send_http_error(conn, 500, http_500_error,
         "fopen(%s): %s", path, strerror(ERRNO));
   } else {
     set_close_on_exec(fileno(fp));
-    range = mg_get_header(conn, "Content-Range");
-    r1 = r2 = 0;
-    if (range != NULL && parse_range_header(range, &r1, &r2) > 0) {
+    if (range != NULL) {
       conn->request_info.status_code = 206;
       // TODO(lsm): handle seek error
       (void) fseeko(fp, r1, SEEK_SET);
@@ -3259,59 +6835,196 @@ static void put_file(struct mg_connection *conn, const char *path) {
   }
 }
 
-static void send_ssi_file(struct mg_connection *, const char *, FILE *, int);
+// SSI pages are parsed once into templates, which live in the listing
+// cache under the file path and the "s" query. Template data is a list
+// of nodes, each followed by its len bytes: literal text, or the nul-
+// terminated path of an #include or command of an #exec.
+enum { SSI_TEXT, SSI_INCLUDE, SSI_EXEC };
 
-static void do_ssi_include(struct mg_connection *conn, const char *ssi,
-                           char *tag, int include_level) {
-  char file_name[MG_BUF_LEN], path[PATH_MAX], *p;
-  FILE *fp;
+struct ssi_node {
+  int type;
+  int len;
+};
+
+static void add_ssi_node(struct dir_listing *dl, int type,
+                         const char *data, size_t len) {
+  struct ssi_node node;
 
-  // sscanf() is safe here, since send_ssi_file() also uses buffer
-  // of size MG_BUF_LEN to get the tag. So strlen(tag) is always < MG_BUF_LEN.
+  if (len == 0 || len > INT_MAX ||
+      !grow_listing(dl, sizeof(node) + len + 1)) {
+    return;
+  }
+  node.type = type;
+  node.len = (int) (type == SSI_TEXT ? len : len + 1);
+  memcpy(dl->data + dl->len, &node, sizeof(node));
+  memcpy(dl->data + dl->len + sizeof(node), data, len);
+  dl->data[dl->len + sizeof(node) + len] = '\0';
+  dl->len += sizeof(node) + node.len;
+}
+
+// Turn the #include tag into the path of the file to include
+static int get_ssi_include_path(struct mg_connection *conn, const char *ssi,
+                                const char *tag, char *path,
+                                size_t path_len) {
+  char file_name[MG_BUF_LEN], *p;
+
+  // sscanf() is safe here, since parse_ssi_file() only passes tags
+  // shorter than MG_BUF_LEN.
   if (sscanf(tag, " virtual=\"%[^\"]\"", file_name) == 1) {
     // File name is relative to the webserver root
-    (void) mg_snprintf(conn, path, sizeof(path), "%s%c%s",
+    (void) mg_snprintf(conn, path, path_len, "%s%c%s",
         conn->ctx->config[DOCUMENT_ROOT], DIRSEP, file_name);
   } else if (sscanf(tag, " file=\"%[^\"]\"", file_name) == 1) {
     // File name is relative to the webserver working directory
     // or it is absolute system path
-    (void) mg_snprintf(conn, path, sizeof(path), "%s", file_name);
+    (void) mg_snprintf(conn, path, path_len, "%s", file_name);
   } else if (sscanf(tag, " \"%[^\"]\"", file_name) == 1) {
     // File name is relative to the currect document
-    (void) mg_snprintf(conn, path, sizeof(path), "%s", ssi);
+    (void) mg_snprintf(conn, path, path_len, "%s", ssi);
     if ((p = strrchr(path, DIRSEP)) != NULL) {
       p[1] = '\0';
     }
     (void) mg_snprintf(conn, path + strlen(path),
-        sizeof(path) - strlen(path), "%s", file_name);
+        path_len - strlen(path), "%s", file_name);
   } else {
     cry(conn, "Bad SSI #include: [%s]", tag);
-    return;
+    return 0;
+  }
+  return 1;
+}
+
+// Add the node for the SSI tag, which is "<!--#" up to and including '>'
+static void add_ssi_tag(struct mg_connection *conn, struct dir_listing *dl,
+                        const char *ssi, const char *tag) {
+  char path[PATH_MAX];
+#if !defined(NO_POPEN)
+  char cmd[MG_BUF_LEN];
+#endif
+
+  if (!memcmp(tag + 5, "include", 7)) {
+    if (get_ssi_include_path(conn, ssi, tag + 12, path, sizeof(path))) {
+      add_ssi_node(dl, SSI_INCLUDE, path, strlen(path));
+    }
+#if !defined(NO_POPEN)
+  } else if (!memcmp(tag + 5, "exec", 4)) {
+    if (sscanf(tag + 9, " \"%[^\"]\"", cmd) != 1) {
+      cry(conn, "Bad SSI #exec: [%s]", tag + 9);
+    } else {
+      add_ssi_node(dl, SSI_EXEC, cmd, strlen(cmd));
+    }
+#endif // !NO_POPEN
+  } else {
+    cry(conn, "%s: unknown SSI " "command: \"%s\"", ssi, tag);
+  }
+}
+
+// Read the SSI file and parse it into a new template holding one
+// reference. Return NULL on error.
+static struct dir_listing *parse_ssi_file(struct mg_connection *conn,
+                                          const char *path,
+                                          const struct mgstat *stp) {
+  char tag[MG_BUF_LEN], *buf, *p, *q, *text, *end;
+  struct dir_listing *dl;
+  size_t n = 0;
+  FILE *fp;
+
+  if ((fp = mg_fopen(path, "rb")) == NULL) {
+    return NULL;
+  } else if ((uint64_t) stp->size >= (size_t) -1 ||
+             (buf = (char *) malloc((size_t) stp->size + 1)) == NULL) {
+    (void) fclose(fp);
+    return NULL;
+  }
+  n = fread(buf, 1, (size_t) stp->size, fp);
+  (void) fclose(fp);
+
+  if ((dl = (struct dir_listing *) calloc(1, sizeof(*dl) +
+                                          strlen(path) + 1)) == NULL) {
+    free(buf);
+    return NULL;
+  }
+  dl->uri = (char *) (dl + 1);
+  strcpy(dl->uri, path);
+  strcpy(dl->query, "s");
+  dl->st = *stp;
+  dl->refs = 1;
+
+  // Directive is "<!--#" up to the next '>', all the rest is text
+  text = p = buf;
+  end = buf + n;
+  while ((p = (char *) memchr(p, '<', end - p)) != NULL) {
+    if (end - p < 5 || memcmp(p, "<!--#", 5) != 0) {
+      p++;
+    } else if ((q = (char *) memchr(p, '>', end - p)) == NULL) {
+      break;
+    } else if (q - p >= (int) sizeof(tag) - 1) {
+      cry(conn, "%s: SSI tag is too large", path);
+      p = q + 1;
+    } else {
+      add_ssi_node(dl, SSI_TEXT, text, p - text);
+      memcpy(tag, p, q - p + 1);
+      tag[q - p + 1] = '\0';
+      add_ssi_tag(conn, dl, path, tag);
+      text = p = q + 1;
+    }
+  }
+  add_ssi_node(dl, SSI_TEXT, text, end - text);
+  free(buf);
+
+  if (dl->failed) {
+    free_dir_listing(dl);
+    dl = NULL;
+  }
+  return dl;
+}
+
+// Get the template of the SSI file from the cache, or parse and cache it.
+// Like listings, templates are valid until the file changes.
+static struct dir_listing *get_ssi_template(struct mg_connection *conn,
+                                            const char *path,
+                                            const struct mgstat *stp) {
+  struct dir_listing *dl;
+
+  if ((dl = get_cached_listing(conn->ctx, path, stp, "s")) == NULL &&
+      (dl = parse_ssi_file(conn, path, stp)) != NULL &&
+      dl->len <= LISTING_CACHE_MAX_SIZE && stp->mtime < time(NULL)) {
+    put_cached_listing(conn->ctx, dl);
   }
+  return dl;
+}
 
-  if ((fp = mg_fopen(path, "rb")) == NULL) {
+static void send_ssi_file(struct mg_connection *, const char *,
+                          struct dir_listing *, int);
+
+static void do_ssi_include(struct mg_connection *conn, const char *path,
+                           int include_level) {
+  struct dir_listing *dl;
+  struct mgstat st;
+  FILE *fp;
+
+  if (match_glob(conn->ctx->ssi_glob, path, (int) strlen(path)) > 0) {
+    if (mg_stat(path, &st) != 0 ||
+        (dl = get_ssi_template(conn, path, &st)) == NULL) {
+      cry(conn, "Cannot open SSI #include: [%s]: %s", path, strerror(ERRNO));
+    } else {
+      send_ssi_file(conn, path, dl, include_level + 1);
+      release_listing(conn->ctx, dl);
+    }
+  } else if ((fp = mg_fopen(path, "rb")) == NULL) {
     cry(conn, "Cannot open SSI #include: [%s]: fopen(%s): %s",
-        tag, path, strerror(ERRNO));
+        path, path, strerror(ERRNO));
   } else {
     set_close_on_exec(fileno(fp));
-    if (match_prefix(conn->ctx->config[SSI_EXTENSIONS],
-                     strlen(conn->ctx->config[SSI_EXTENSIONS]), path) > 0) {
-      send_ssi_file(conn, path, fp, include_level + 1);
-    } else {
-      send_file_data(conn, fp, INT64_MAX);
-    }
+    send_file_data(conn, fp, INT64_MAX);
     (void) fclose(fp);
   }
 }
 
 #if !defined(NO_POPEN)
-static void do_ssi_exec(struct mg_connection *conn, char *tag) {
-  char cmd[MG_BUF_LEN];
+static void do_ssi_exec(struct mg_connection *conn, const char *cmd) {
   FILE *fp;
 
-  if (sscanf(tag, " \"%[^\"]\"", cmd) != 1) {
-    cry(conn, "Bad SSI #exec: [%s]", tag);
-  } else if ((fp = popen(cmd, "r")) == NULL) {
+  if ((fp = popen(cmd, "r")) == NULL) {
     cry(conn, "Cannot SSI #exec: [%s]: %s", cmd, strerror(ERRNO));
   } else {
     send_file_data(conn, fp, INT64_MAX);
@@ -3320,86 +7033,50 @@ static void do_ssi_exec(struct mg_connection *conn, char *tag) {
 }
 #endif // !NO_POPEN
 
+// Literal text goes out in spans as long as the text between directives
 static void send_ssi_file(struct mg_connection *conn, const char *path,
-                          FILE *fp, int include_level) {
-  char buf[MG_BUF_LEN];
-  int ch, len, in_ssi_tag;
+                          struct dir_listing *dl, int include_level) {
+  struct ssi_node node;
+  const char *p;
 
   if (include_level > 10) {
     cry(conn, "SSI #include level is too deep (%s)", path);
     return;
   }
 
-  in_ssi_tag = 0;
-  len = 0;
-
-  while ((ch = fgetc(fp)) != EOF) {
-    if (in_ssi_tag && ch == '>') {
-      in_ssi_tag = 0;
-      buf[len++] = (char) ch;
-      buf[len] = '\0';
-      assert(len <= (int) sizeof(buf));
-      if (len < 6 || memcmp(buf, "<!--#", 5) != 0) {
-        // Not an SSI tag, pass it
-        (void) mg_write(conn, buf, (size_t)len);
-      } else {
-        if (!memcmp(buf + 5, "include", 7)) {
-          do_ssi_include(conn, path, buf + 12, include_level);
+  for (p = dl->data; p < dl->data + dl->len; p += sizeof(node) + node.len) {
+    memcpy(&node, p, sizeof(node));
+    if (node.type == SSI_TEXT) {
+      conn->num_bytes_sent += mg_write(conn, p + sizeof(node), node.len);
+    } else if (node.type == SSI_INCLUDE) {
+      do_ssi_include(conn, p + sizeof(node), include_level);
 #if !defined(NO_POPEN)
-        } else if (!memcmp(buf + 5, "exec", 4)) {
-          do_ssi_exec(conn, buf + 9);
+    } else if (node.type == SSI_EXEC) {
+      do_ssi_exec(conn, p + sizeof(node));
 #endif // !NO_POPEN
-        } else {
-          cry(conn, "%s: unknown SSI " "command: \"%s\"", path, buf);
-        }
-      }
-      len = 0;
-    } else if (in_ssi_tag) {
-      if (len == 5 && memcmp(buf, "<!--#", 5) != 0) {
-        // Not an SSI tag
-        in_ssi_tag = 0;
-      } else if (len == (int) sizeof(buf) - 2) {
-        cry(conn, "%s: SSI tag is too large", path);
-        len = 0;
-      }
-      buf[len++] = ch & 0xff;
-    } else if (ch == '<') {
-      in_ssi_tag = 1;
-      if (len > 0) {
-        (void) mg_write(conn, buf, (size_t)len);
-      }
-      len = 0;
-      buf[len++] = ch & 0xff;
-    } else {
-      buf[len++] = ch & 0xff;
-      if (len == (int) sizeof(buf)) {
-        (void) mg_write(conn, buf, (size_t)len);
-        len = 0;
-      }
     }
   }
-
-  // Send the rest of buffered data
-  if (len > 0) {
-    (void) mg_write(conn, buf, (size_t)len);
-  }
 }
 
 static void handle_ssi_file_request(struct mg_connection *conn,
-                                    const char *path) {
-  FILE *fp;
+                                    const char *path,
+                                    const struct mgstat *stp) {
+  struct dir_listing *dl;
+  int chunked;
 
-  if ((fp = mg_fopen(path, "rb")) == NULL) {
+  if ((dl = get_ssi_template(conn, path, stp)) == NULL) {
     send_http_error(conn, 500, http_500_error, "fopen(%s): %s", path,
                     strerror(ERRNO));
   } else {
-    conn->must_close = 1;
-    set_close_on_exec(fileno(fp));
+    chunked = use_chunked_encoding(conn);
     mg_printf(conn, "HTTP/1.1 200 OK\r\n"
-              "Content-Type: text/html\r\nConnection: %s\r\n\r\n",
+              "Content-Type: text/html\r\n%sConnection: %s\r\n\r\n",
+              chunked ? "Transfer-Encoding: chunked\r\n" : "",
               suggest_connection_header(conn));
-    send_ssi_file(conn, path, fp, 0);
-    (void) fclose(fp);
+    conn->chunked = chunked;
+    send_ssi_file(conn, path, dl, 0);
+    finish_chunked_body(conn);
+    release_listing(conn->ctx, dl);
   }
 }
 
@@ -3412,14 +7089,53 @@ static void send_options(struct mg_connection *conn) {
       "DAV: 1\r\n\r\n");
 }
 
-// Writes PROPFIND properties for a collection element
-static void print_props(struct mg_connection *conn, const char* uri,
-                        struct mgstat* st) {
+// Directories nested deeper below the PROPFIND target are not descended
+// into with Depth: infinity. Their own properties are still reported.
+#define PROPFIND_MAX_DEPTH 32
+
+// Directory on the PROPFIND traversal stack
+struct dav_dir {
+  struct dir_listing *props;  // Properties of the entries, subdirectories
+  size_t next;                // Offset of the next subdirectory name
+  size_t path_len;            // Length of the directory's path and href
+  size_t href_len;            //   in the buffers shared by the stack
+  int64_t dev, ino;           // To detect loops made by symlinks
+};
+
+// State of scanning a directory for its PROPFIND properties
+struct dav_scan_data {
+  struct dir_listing *props;
+  struct dir_listing names;   // Names of the subdirectories, nul-separated
+};
+
+// URL-encode the path, leaving the slashes as they are
+static void url_encode_path(const char *src, char *dst, size_t dst_len) {
+  char segment[PATH_MAX];
+  size_t n, len = 0;
+
+  dst[0] = '\0';
+  while (*src != '\0' && len + 1 < dst_len) {
+    n = strcspn(src, "/");
+    mg_strlcpy(segment, src, n + 1 < sizeof(segment) ? n + 1 : sizeof(segment));
+    url_encode(segment, dst + len, dst_len - len);
+    len += strlen(dst + len);
+    if (src[n] == '/' && len + 1 < dst_len) {
+      dst[len++] = '/';
+      dst[len] = '\0';
+    }
+    src += n + (src[n] == '/');
+  }
+}
+
+// Writes PROPFIND properties for a collection element. Href is the
+// URL-encoded prefix followed by the encoded name.
+static void print_props(struct dir_listing *dl, const char *prefix,
+                        const char *name, const struct mgstat *st) {
   char mtime[64];
   gmt_time_string(mtime, sizeof(mtime), &st->mtime);
-  conn->num_bytes_sent += mg_printf(conn,
+  listing_printf(dl,
       "<d:response>"
-       "<d:href>%s</d:href>"
+       "<d:href>%s%s%s</d:href>"
        "<d:propstat>"
         "<d:prop>"
          "<d:resourcetype>%s</d:resourcetype>"
@@ -3429,45 +7145,334 @@ static void print_props(struct mg_connection *conn, const char* uri,
         "<d:status>HTTP/1.1 200 OK</d:status>"
        "</d:propstat>"
       "</d:response>\n",
-      uri,
+      prefix, name, st->is_directory && name[0] != '\0' ? "/" : "",
       st->is_directory ? "<d:collection/>" : "",
       st->size,
       mtime);
 }
 
-static void print_dav_dir_entry(struct de *de, void *data) {
-  char href[PATH_MAX];
-  struct mg_connection *conn = (struct mg_connection *) data;
-  mg_snprintf(conn, href, sizeof(href), "%s%s",
-              conn->request_info.uri, de->file_name);
-  print_props(conn, href, &de->st);
+static void dav_scan_callback(struct de *de, void *data) {
+  struct dav_scan_data *dsd = (struct dav_scan_data *) data;
+  char name[PATH_MAX];
+  size_t len;
+
+  url_encode(de->file_name, name, sizeof(name));
+  print_props(dsd->props, dsd->props->uri, name, &de->st);
+  if (de->st.is_directory) {
+    len = strlen(de->file_name) + 1;
+    if (grow_listing(&dsd->names, len)) {
+      memcpy(dsd->names.data + dsd->names.len, de->file_name, len);
+      dsd->names.len += len;
+    }
+  }
+}
+
+// Render properties of the directory entries, followed by the names of
+// its subdirectories, into a new listing holding one reference. Return
+// NULL on error.
+static struct dir_listing *render_dav_props(struct mg_connection *conn,
+                                            const char *dir,
+                                            const char *href,
+                                            const struct mgstat *stp) {
+  struct dav_scan_data dsd;
+  struct dir_listing *dl;
+
+  if ((dl = (struct dir_listing *) calloc(1, sizeof(*dl) +
+                                          strlen(href) + 1)) == NULL) {
+    return NULL;
+  }
+  dl->uri = (char *) (dl + 1);
+  strcpy(dl->uri, href);
+  strcpy(dl->query, "p");
+  dl->st = *stp;
+  dl->refs = 1;
+
+  memset(&dsd, 0, sizeof(dsd));
+  dsd.props = dl;
+  if (!scan_directory(conn, dir, &dsd, dav_scan_callback)) {
+    dl->failed = 1;
+  }
+  dl->dirs = dl->len;
+  if (dsd.names.len > 0 && grow_listing(dl, dsd.names.len)) {
+    memcpy(dl->data + dl->len, dsd.names.data, dsd.names.len);
+    dl->len += dsd.names.len;
+  }
+  free(dsd.names.data);
+
+  if (dl->failed || dsd.names.failed) {
+    free_dir_listing(dl);
+    dl = NULL;
+  }
+  return dl;
+}
+
+// Get properties of the directory entries from the listing cache, or
+// render and cache them. Like listings, they are valid until the
+// directory changes.
+static struct dir_listing *get_dav_props(struct mg_connection *conn,
+                                         const char *dir, const char *href,
+                                         const struct mgstat *stp) {
+  struct dir_listing *dl;
+
+  if ((dl = get_cached_listing(conn->ctx, href, stp, "p")) == NULL &&
+      (dl = render_dav_props(conn, dir, href, stp)) != NULL &&
+      dl->len <= LISTING_CACHE_MAX_SIZE && stp->mtime < time(NULL)) {
+    put_cached_listing(conn->ctx, dl);
+  }
+  return dl;
+}
+
+// Return 1 if the client may see inside a directory met below the PROPFIND
+// target. A directory guarded by its own passwords file or by protect_uri
+// needs credentials for it. Passwords file that let the client in last is
+// remembered in *ok_st, directories it guards too are not checked again.
+static int may_enter_dav_dir(struct mg_connection *conn, const char *path,
+                             const char *href, struct mgstat *ok_st) {
+  char uri[PATH_MAX], fname[PATH_MAX];
+  struct mgstat st;
+
+  (void) url_decode(href, strlen(href), uri, sizeof(uri), 0);
+  if (!find_auth_file(conn, uri, path, fname, sizeof(fname), &st) ||
+      same_file(&st, ok_st)) {
+    return 1;
+  } else if (authorize(conn, fname, &st)) {
+    *ok_st = st;
+    return 1;
+  }
+  return 0;
+}
+
+// Send properties of everything under the directory, max_depth levels
+// deep. Directories are walked depth first with a bounded stack, every
+// directory costs a few stat() calls and, when cached, no other syscalls.
+// Subdirectories the client is not authorized for are reported, but not
+// walked.
+static void send_dav_tree(struct mg_connection *conn, const char *dir,
+                          const struct mgstat *stp, int max_depth) {
+  struct dav_dir stack[PROPFIND_MAX_DEPTH], *top;
+  char path[PATH_MAX], href[PATH_MAX];
+  struct dir_listing *dl;
+  struct mgstat st, ok_st;
+  const char *name;
+  size_t path_len, href_len;
+  int i, n = 0;
+
+  memset(&ok_st, 0, sizeof(ok_st));
+  mg_strlcpy(path, dir, sizeof(path));
+  url_encode_path(conn->request_info.uri, href, sizeof(href));
+  path_len = strlen(path);
+  href_len = strlen(href);
+  st = *stp;
+
+  for (;;) {
+    // Send the directory's properties, and descend into it
+    if ((dl = get_dav_props(conn, path, href, &st)) != NULL) {
+      conn->num_bytes_sent += mg_write(conn, dl->data, dl->dirs);
+      top = &stack[n++];
+      top->props = dl;
+      top->next = dl->dirs;
+      top->path_len = path_len;
+      top->href_len = href_len;
+      top->dev = st.dev;
+      top->ino = st.ino;
+    }
+
+    // Find the next subdirectory, going back up when one is done
+    name = NULL;
+    while (n > 0 && name == NULL) {
+      top = &stack[n - 1];
+      if (n >= max_depth || top->next >= top->props->len) {
+        release_listing(conn->ctx, top->props);
+        n--;
+        continue;
+      }
+      name = top->props->data + top->next;
+      top->next += strlen(name) + 1;
+
+      path_len = top->path_len;
+      href_len = top->href_len;
+      (void) mg_snprintf(conn, path + path_len, sizeof(path) - path_len,
+                         "%c%s", DIRSEP, name);
+      url_encode(name, href + href_len, sizeof(href) - href_len);
+      path_len += strlen(path + path_len);
+      href_len += strlen(href + href_len);
+      if (href_len + 2 > sizeof(href) || path_len + 2 > sizeof(path) ||
+          mg_stat(path, &st) != 0 || !st.is_directory) {
+        name = NULL;
+        continue;
+      }
+      href[href_len++] = '/';
+      href[href_len] = '\0';
+
+      // Symlink back to a directory being walked would never end
+      for (i = 0; i < n && name != NULL; i++) {
+        if (st.ino != 0 && stack[i].dev == st.dev && stack[i].ino == st.ino) {
+          name = NULL;
+        }
+      }
+      if (name != NULL && !may_enter_dav_dir(conn, path, href, &ok_st)) {
+        name = NULL;
+      }
+    }
+
+    if (name == NULL) {
+      break;
+    }
+  }
 }
 
+// Multi-status body is streamed as it is generated, in chunked encoding
+// so that the connection stays open, and gzip encoded when the client
+// accepts it and compression_cpu_budget allows. Depth defaults to
+// infinity, as RFC 4918 says. With dav_depth_infinity off, it is refused
+// for directories the way section 9.1 allows.
 static void handle_propfind(struct mg_connection *conn, const char* path,
                             struct mgstat* st) {
+  static const char *finite_depth =
+    "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+    "<d:error xmlns:d='DAV:'><d:propfind-finite-depth/></d:error>\n";
   const char *depth = mg_get_header(conn, "Depth");
+  struct compressor *z;
+  int chunked, max_depth;
+  char href[PATH_MAX];
+  struct dir_listing self;
+
+  // Levels of directory entries to print besides the resource itself
+  if (!st->is_directory ||
+      mg_strcasecmp(conn->ctx->config[ENABLE_DIRECTORY_LISTING], "yes") ||
+      (depth != NULL && !strcmp(depth, "0"))) {
+    max_depth = 0;
+  } else if (depth != NULL && !strcmp(depth, "1")) {
+    max_depth = 1;
+  } else {
+    max_depth = PROPFIND_MAX_DEPTH;
+  }
+  if (max_depth == PROPFIND_MAX_DEPTH &&
+      mg_strcasecmp(conn->ctx->config[DAV_DEPTH_INFINITY], "yes")) {
+    conn->request_info.status_code = 403;
+    mg_printf(conn, "HTTP/1.1 403 Forbidden\r\n"
+              "Content-Type: text/xml; charset=utf-8\r\n"
+              "Content-Length: %d\r\n"
+              "Connection: %s\r\n\r\n", (int) strlen(finite_depth),
+              suggest_connection_header(conn));
+    conn->num_bytes_sent += mg_printf(conn, "%s", finite_depth);
+    return;
+  }
 
-  conn->must_close = 1;
+  z = new_compressor(conn);
+  chunked = use_chunked_encoding(conn);
   conn->request_info.status_code = 207;
   mg_printf(conn, "HTTP/1.1 207 Multi-Status\r\n"
-            "Connection: close\r\n"
-            "Content-Type: text/xml; charset=utf-8\r\n\r\n");
-
-  conn->num_bytes_sent += mg_printf(conn,
-      "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
-      "<d:multistatus xmlns:d='DAV:'>\n");
+            "Connection: %s\r\n"
+            "%s%s%s"
+            "Content-Type: text/xml; charset=utf-8\r\n\r\n",
+            suggest_connection_header(conn),
+            chunked ? "Transfer-Encoding: chunked\r\n" : "",
+            z != NULL ? "Content-Encoding: gzip\r\n" : "",
+            conn->ctx->z_budget > 0 ? "Vary: Accept-Encoding\r\n" : "");
+  conn->chunked = chunked;
+  start_compression(conn, z);
 
   // Print properties for the requested resource itself
-  print_props(conn, conn->request_info.uri, st);
+  memset(&self, 0, sizeof(self));
+  url_encode_path(conn->request_info.uri, href, sizeof(href));
+  listing_printf(&self, "%s",
+                 "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+                 "<d:multistatus xmlns:d='DAV:'>\n");
+  print_props(&self, href, "", st);
+  if (!self.failed) {
+    conn->num_bytes_sent += mg_write(conn, self.data, self.len);
+  }
+  free(self.data);
 
-  // If it is a directory, print directory entries too if Depth is not 0
-  if (st->is_directory &&
-      !mg_strcasecmp(conn->ctx->config[ENABLE_DIRECTORY_LISTING], "yes") &&
-      (depth == NULL || strcmp(depth, "0") != 0)) {
-    scan_directory(conn, path, conn, &print_dav_dir_entry);
+  if (max_depth > 0) {
+    send_dav_tree(conn, path, st, max_depth);
   }
 
   conn->num_bytes_sent += mg_printf(conn, "%s\n", "</d:multistatus>");
+  finish_compression(conn);
+  finish_chunked_body(conn);
+}
+
+// Look for "path.gz" and the like next to the file. Siblings older than the
+// file are left out, they are likely stale copies of a previous version.
+static void find_precompressed_files(struct mg_connection *conn,
+                                     const char *path,
+                                     struct resolved_uri *ru) {
+  char sibling[PATH_MAX];
+  struct mgstat *stp;
+  int i;
+
+  for (i = 0; i < NUM_CODINGS; i++) {
+    stp = &ru->coding_st[i];
+    if (mg_snprintf(conn, sibling, sizeof(sibling), "%s%s", path,
+                    content_codings[i].extension) < (int) sizeof(sibling) - 1 &&
+        mg_stat(sibling, stp) == 0 && !stp->is_directory &&
+        stp->mtime >= ru->st.mtime) {
+      ru->codings |= 1 << i;
+    }
+  }
+}
+
+// Serve a regular file, or its precompressed sibling in the most preferred
+// coding the client accepts. Responses for files that have siblings vary
+// on Accept-Encoding.
+static void handle_static_file(struct mg_connection *conn, const char *path,
+                               struct resolved_uri *ru) {
+  char sibling[PATH_MAX], extra[100];
+  struct mgstat *stp = &ru->st;
+  int i;
+
+  for (i = 0; i < NUM_CODINGS; i++) {
+    if ((ru->codings & (1 << i)) &&
+        accepts_coding(conn, content_codings[i].name)) {
+      stp = &ru->coding_st[i];
+      break;
+    }
+  }
+
+  if (is_not_modified(conn, stp)) {
+    send_http_error(conn, 304, "Not Modified", "%s", "");
+  } else if (ru->codings == 0) {
+    handle_file_request(conn, path, stp);
+  } else if (i == NUM_CODINGS) {
+    send_file_response(conn, path, path, stp, "Vary: Accept-Encoding\r\n");
+  } else {
+    (void) mg_snprintf(conn, sibling, sizeof(sibling), "%s%s", path,
+                       content_codings[i].extension);
+    (void) mg_snprintf(conn, extra, sizeof(extra), "Content-Encoding: %s\r\n"
+                       "Vary: Accept-Encoding\r\n", content_codings[i].name);
+    send_file_response(conn, sibling, path, stp, extra);
+  }
+}
+
+// Map the request URI to a file and find out everything handle_request()
+// needs to know about it. May set conn->path_info.
+static void resolve_uri(struct mg_connection *conn, char *path,
+                        size_t path_len, char *auth_path,
+                        size_t auth_path_len, struct resolved_uri *ru) {
+  ru->stat_result = convert_uri_to_file_name(conn, path, path_len, &ru->st);
+  ru->hidden = ru->stat_result == 0 && must_hide_file(conn, path);
+  ru->index = ru->stat_result == 0 && ru->st.is_directory ?
+    find_index_file(conn, path, &ru->index_st) : -1;
+  ru->auth_found = find_auth_file(conn, conn->request_info.uri, path,
+                                  auth_path, auth_path_len, &ru->auth_st);
+  ru->codings = 0;
+  if (conn->ctx->precompressed && ru->stat_result == 0 &&
+      !ru->st.is_directory) {
+    find_precompressed_files(conn, path, ru);
+  }
+}
+
+// Switch the path from the directory to its index file
+static int use_index_file(struct mg_connection *conn, char *path,
+                          size_t path_len, struct resolved_uri *ru) {
+  if (ru->index < 0 ||
+      append_index_file(conn, path, path_len, ru->index) != 1) {
+    return 0;
+  }
+  ru->st = ru->index_st;
+  return 1;
 }
 
 // This is the heart of the Mongoose's logic.
@@ -3476,9 +7481,9 @@ static void handle_propfind(struct mg_connection *conn, const char* path,
 // a directory, or call embedded function, etcetera.
 static void handle_request(struct mg_connection *conn) {
   struct mg_request_info *ri = &conn->request_info;
-  char path[PATH_MAX];
-  int stat_result, uri_len;
-  struct mgstat st;
+  char path[PATH_MAX], auth_path[PATH_MAX];
+  struct resolved_uri ru;
+  int uri_len, is_put_or_delete;
 
   if ((conn->request_info.query_string = strchr(ri->uri, '?')) != NULL) {
     *conn->request_info.query_string++ = '\0';
@@ -3486,10 +7491,24 @@ static void handle_request(struct mg_connection *conn) {
   uri_len = (int) strlen(ri->uri);
   url_decode(ri->uri, (size_t)uri_len, ri->uri, (size_t)(uri_len + 1), 0);
   remove_double_dots_and_double_slashes(ri->uri);
-  stat_result = convert_uri_to_file_name(conn, path, sizeof(path), &st);
+
+  // PUT and DELETE change the file, so they always look at the file system
+  is_put_or_delete = !strcmp(ri->request_method, "PUT") ||
+    !strcmp(ri->request_method, "DELETE");
+  if (is_put_or_delete) {
+    remove_cached_uri(conn);
+    resolve_uri(conn, path, sizeof(path), auth_path, sizeof(auth_path), &ru);
+  } else if (!get_cached_uri(conn, path, sizeof(path), auth_path,
+                             sizeof(auth_path), &ru)) {
+    resolve_uri(conn, path, sizeof(path), auth_path, sizeof(auth_path), &ru);
+    // PATH_INFO points into path, such results are not cached
+    if (conn->path_info == NULL) {
+      put_cached_uri(conn, path, auth_path, &ru);
+    }
+  }
 
   DEBUG_TRACE(("%s", ri->uri));
-  if (!check_authorization(conn, path)) {
+  if (ru.auth_found && !authorize(conn, auth_path, &ru.auth_st)) {
     send_authorization_request(conn);
   } else if (call_user(conn, MG_NEW_REQUEST) != NULL) {
     // Do nothing, callback has served the request
@@ -3497,8 +7516,7 @@ static void handle_request(struct mg_connection *conn) {
     send_options(conn);
   } else if (conn->ctx->config[DOCUMENT_ROOT] == NULL) {
     send_http_error(conn, 404, "Not Found", "Not Found");
-  } else if ((!strcmp(ri->request_method, "PUT") ||
-        !strcmp(ri->request_method, "DELETE")) &&
+  } else if (is_put_or_delete &&
       (conn->ctx->config[PUT_DELETE_PASSWORDS_FILE] == NULL ||
        is_authorized_for_put(conn) != 1)) {
     send_authorization_request(conn);
@@ -3511,41 +7529,41 @@ static void handle_request(struct mg_connection *conn) {
       send_http_error(conn, 500, http_500_error, "remove(%s): %s", path,
                       strerror(ERRNO));
     }
-  } else if (stat_result != 0 || must_hide_file(conn, path)) {
+  } else if (ru.stat_result != 0 || ru.hidden) {
     send_http_error(conn, 404, "Not Found", "%s", "File not found");
-  } else if (st.is_directory && ri->uri[uri_len - 1] != '/') {
+  } else if (ru.st.is_directory && ri->uri[uri_len - 1] != '/') {
     (void) mg_printf(conn, "HTTP/1.1 301 Moved Permanently\r\n"
                      "Location: %s/\r\n\r\n", ri->uri);
   } else if (!strcmp(ri->request_method, "PROPFIND")) {
-    handle_propfind(conn, path, &st);
-  } else if (st.is_directory &&
-             !substitute_index_file(conn, path, sizeof(path), &st)) {
+    handle_propfind(conn, path, &ru.st);
+  } else if (ru.st.is_directory &&
+             !use_index_file(conn, path, sizeof(path), &ru)) {
     if (!mg_strcasecmp(conn->ctx->config[ENABLE_DIRECTORY_LISTING], "yes")) {
-      handle_directory_request(conn, path);
+      handle_directory_request(conn, path, &ru.st);
     } else {
       send_http_error(conn, 403, "Directory Listing Denied",
           "Directory listing denied");
     }
 #if !defined(NO_CGI)
-  } else if (match_prefix(conn->ctx->config[CGI_EXTENSIONS],
-                          strlen(conn->ctx->config[CGI_EXTENSIONS]),
-                          path) > 0) {
+  } else if (match_glob(conn->ctx->fcgi_glob, path, (int) strlen(path)) > 0 ||
+             match_glob(conn->ctx->cgi_glob, path, (int) strlen(path)) > 0) {
     if (strcmp(ri->request_method, "POST") &&
         strcmp(ri->request_method, "GET")) {
       send_http_error(conn, 501, "Not Implemented",
                       "Method %s is not implemented", ri->request_method);
+#if defined(USE_FASTCGI)
+    } else if (match_glob(conn->ctx->fcgi_glob, path,
+                          (int) strlen(path)) > 0) {
+      handle_fcgi_request(conn, path);
+#endif
     } else {
       handle_cgi_request(conn, path);
     }
 #endif // !NO_CGI
-  } else if (match_prefix(conn->ctx->config[SSI_EXTENSIONS],
-                          strlen(conn->ctx->config[SSI_EXTENSIONS]),
-                          path) > 0) {
-    handle_ssi_file_request(conn, path);
-  } else if (is_not_modified(conn, &st)) {
-    send_http_error(conn, 304, "Not Modified", "%s", "");
+  } else if (match_glob(conn->ctx->ssi_glob, path, (int) strlen(path)) > 0) {
+    handle_ssi_file_request(conn, path, &ru.st);
   } else {
-    handle_file_request(conn, path, &st);
+    handle_static_file(conn, path, &ru);
   }
 }
 
@@ -3641,6 +7659,7 @@ static int set_ports_option(struct mg_context *ctx) {
       *listener = so;
       listener->sock = sock;
       set_close_on_exec(listener->sock);
+      set_non_blocking_mode(listener->sock);
       listener->next = ctx->listening_sockets;
       ctx->listening_sockets = listener;
     }
@@ -3654,106 +7673,265 @@ static int set_ports_option(struct mg_context *ctx) {
 }
 
 static void log_header(const struct mg_connection *conn, const char *header,
-                       FILE *fp) {
+                       char *line, int *len, size_t size) {
   const char *header_value;
 
   if ((header_value = mg_get_header(conn, header)) == NULL) {
-    (void) fprintf(fp, "%s", " -");
+    append_to_line(line, len, size, "%s", " -");
   } else {
-    (void) fprintf(fp, " \"%s\"", header_value);
+    append_to_line(line, len, size, " \"%s\"", header_value);
   }
 }
 
-static void log_access(const struct mg_connection *conn) {
+static void log_access(struct mg_connection *conn) {
   const struct mg_request_info *ri;
-  FILE *fp;
-  char date[64], src_addr[20];
-
-  fp = conn->ctx->config[ACCESS_LOG_FILE] == NULL ?  NULL :
-    mg_fopen(conn->ctx->config[ACCESS_LOG_FILE], "a+");
+  char date[64], src_addr[20], line[MG_BUF_LEN];
+  int len = 0;
 
-  if (fp == NULL)
+  if (conn->ctx->config[ACCESS_LOG_FILE] == NULL)
     return;
 
   strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z",
            localtime(&conn->birth_time));
 
   ri = &conn->request_info;
-  flockfile(fp);
 
   sockaddr_to_string(src_addr, sizeof(src_addr), &conn->client.rsa);
-  fprintf(fp, "%s - %s [%s] \"%s %s HTTP/%s\" %d %" INT64_FMT,
-          src_addr, ri->remote_user == NULL ? "-" : ri->remote_user, date,
-          ri->request_method ? ri->request_method : "-",
-          ri->uri ? ri->uri : "-", ri->http_version,
-          conn->request_info.status_code, conn->num_bytes_sent);
-  log_header(conn, "Referer", fp);
-  log_header(conn, "User-Agent", fp);
-  fputc('\n', fp);
-  fflush(fp);
+  append_to_line(line, &len, sizeof(line),
+                 "%s - %s [%s] \"%s %s HTTP/%s\" %d %" INT64_FMT,
+                 src_addr, ri->remote_user == NULL ? "-" : ri->remote_user,
+                 date, ri->request_method ? ri->request_method : "-",
+                 ri->uri ? ri->uri : "-", ri->http_version,
+                 conn->request_info.status_code, conn->num_bytes_sent);
+  log_header(conn, "Referer", line, &len, sizeof(line));
+  log_header(conn, "User-Agent", line, &len, sizeof(line));
+  append_to_line(line, &len, sizeof(line), "\n");
+  line[len - 1] = '\n';
 
-  funlockfile(fp);
-  fclose(fp);
+  write_log(conn, ACCESS_LOG, line, len);
 }
 
 static int isbyte(int n) {
   return n >= 0 && n <= 255;
 }
 
-// Verify given socket address against the ACL.
-// Return -1 if ACL is malformed, 0 if address is disallowed, 1 if allowed.
-static int check_acl(struct mg_context *ctx, const union usa *usa) {
-  int a, b, c, d, n, mask, allowed;
-  char flag;
-  uint32_t acl_subnet, acl_mask, remote_ip;
-  struct vec vec;
-  const char *list = ctx->config[ACCESS_CONTROL_LIST];
+static int get_bit(const unsigned char *addr, int bit) {
+  return (addr[bit / 8] >> (7 - bit % 8)) & 1;
+}
 
-  if (list == NULL) {
-    return 1;
+// Return number of leading bits, up to max_bits, the addresses share.
+// First n bits are known to be equal.
+static int common_prefix_len(const unsigned char *a, const unsigned char *b,
+                             int n, int max_bits) {
+  while (n % 8 != 0 && n < max_bits && get_bit(a, n) == get_bit(b, n)) {
+    n++;
+  }
+  while (n + 8 <= max_bits && a[n / 8] == b[n / 8]) {
+    n += 8;
+  }
+  while (n < max_bits && get_bit(a, n) == get_bit(b, n)) {
+    n++;
+  }
+  return n;
+}
+
+static struct acl_node *new_acl_node(const unsigned char *prefix, int len,
+                                     int rule, int allow) {
+  struct acl_node *node;
+
+  if ((node = (struct acl_node *) calloc(1, sizeof(*node))) != NULL) {
+    memcpy(node->prefix, prefix, (len + 7) / 8);
+    if (len % 8 != 0) {
+      node->prefix[len / 8] &= (unsigned char) (0xff << (8 - len % 8));
+    }
+    node->len = len;
+    node->rule = rule;
+    node->allow = allow;
+  }
+  return node;
+}
+
+// Add the subnet to the trie. A later rule for the same subnet replaces
+// the earlier one. Return 0 if out of memory.
+static int insert_acl_node(struct acl_node **pp, const unsigned char *prefix,
+                           int len, int rule, int allow) {
+  struct acl_node *node, *split;
+  int common;
+
+  while ((node = *pp) != NULL) {
+    common = common_prefix_len(node->prefix, prefix, 0,
+                               node->len < len ? node->len : len);
+    if (common == node->len && common == len) {
+      node->rule = rule;
+      node->allow = allow;
+      return 1;
+    } else if (common == node->len) {
+      pp = &node->child[get_bit(prefix, common)];
+    } else if (common == len) {
+      // New subnet contains the node's subnet
+      if ((split = new_acl_node(prefix, len, rule, allow)) == NULL) {
+        return 0;
+      }
+      split->child[get_bit(node->prefix, common)] = node;
+      *pp = split;
+      return 1;
+    } else {
+      // Subnets diverge, join them under their common prefix
+      if ((split = new_acl_node(prefix, common, -1, 0)) == NULL ||
+          (split->child[get_bit(prefix, common)] =
+           new_acl_node(prefix, len, rule, allow)) == NULL) {
+        free(split);
+        return 0;
+      }
+      split->child[get_bit(node->prefix, common)] = node;
+      *pp = split;
+      return 1;
+    }
+  }
+
+  return (*pp = new_acl_node(prefix, len, rule, allow)) != NULL;
+}
+
+static void free_acl_nodes(struct acl_node *node) {
+  if (node != NULL) {
+    free_acl_nodes(node->child[0]);
+    free_acl_nodes(node->child[1]);
+    free(node);
+  }
+}
+
+static void free_acl(struct acl *acl) {
+  if (acl != NULL) {
+    free_acl_nodes(acl->ipv4);
+    free_acl_nodes(acl->ipv6);
+    free(acl);
   }
+}
 
-  (void) memcpy(&remote_ip, &usa->sin.sin_addr, sizeof(remote_ip));
+// Walk the trie down to the address. All subnets on the way contain the
+// address; like with the textual list, the rule that comes last wins.
+// Return 1 if allowed, 0 if no rule matches or the last matching is '-'.
+static int lookup_acl(const struct acl_node *node, const unsigned char *addr,
+                      int bits) {
+  int rule = -1, allow = 0, matched = 0;
 
-  // If any ACL is set, deny by default
-  allowed = '-';
+  while (node != NULL && common_prefix_len(node->prefix, addr, matched,
+                                           node->len) == node->len) {
+    if (node->rule > rule) {
+      rule = node->rule;
+      allow = node->allow;
+    }
+    matched = node->len;
+    node = matched < bits ? node->child[get_bit(addr, matched)] : NULL;
+  }
 
-  while ((list = next_option(list, &vec, NULL)) != NULL) {
-    mask = 32;
+  return allow;
+}
+
+// Compile access_control_list into a trie. Return NULL if ACL is malformed.
+static struct acl *compile_acl(struct mg_context *ctx, const char *list) {
+  int a, b, c, d, n, mask, bits, rule;
+  unsigned char addr[16];
+  char flag, buf[64];
+  struct acl *acl;
+#if defined(USE_IPV6)
+  char *slash;
+#endif
+  struct vec vec;
+
+  if ((acl = (struct acl *) calloc(1, sizeof(*acl))) == NULL) {
+    cry(fc(ctx), "%s: cannot allocate ACL", __func__);
+    return NULL;
+  }
 
-    if (sscanf(vec.ptr, "%c%d.%d.%d.%d%n", &flag, &a, &b, &c, &d, &n) != 5) {
+  for (rule = 0; (list = next_option(list, &vec, NULL)) != NULL; rule++) {
+    mg_strlcpy(buf, vec.ptr, vec.len + 1 < sizeof(buf) ?
+               vec.len + 1 : sizeof(buf));
+    memset(addr, 0, sizeof(addr));
+    n = 0;
+
+#if defined(USE_IPV6)
+    if (strchr(buf, ':') != NULL) {
+      bits = mask = 128;
+      if ((slash = strchr(buf, '/')) != NULL) {
+        *slash = '\0';
+      }
+      if (inet_pton(AF_INET6, buf + 1, addr) != 1) {
+        cry(fc(ctx), "%s: bad ipv6 address: [%s]", __func__, buf);
+        break;
+      } else if (slash != NULL) {
+        *slash = '/';
+        n = slash - buf;
+      } else {
+        n = strlen(buf);
+      }
+      flag = buf[0];
+    } else
+#endif // USE_IPV6
+    if (sscanf(buf, "%c%d.%d.%d.%d%n", &flag, &a, &b, &c, &d, &n) != 5) {
       cry(fc(ctx), "%s: subnet must be [+|-]x.x.x.x[/x]", __func__);
-      return -1;
-    } else if (flag != '+' && flag != '-') {
-      cry(fc(ctx), "%s: flag must be + or -: [%s]", __func__, vec.ptr);
-      return -1;
+      break;
     } else if (!isbyte(a)||!isbyte(b)||!isbyte(c)||!isbyte(d)) {
-      cry(fc(ctx), "%s: bad ip address: [%s]", __func__, vec.ptr);
-      return -1;
-    } else if (sscanf(vec.ptr + n, "/%d", &mask) == 0) {
-      // Do nothing, no mask specified
-    } else if (mask < 0 || mask > 32) {
-      cry(fc(ctx), "%s: bad subnet mask: %d [%s]", __func__, n, vec.ptr);
-      return -1;
+      cry(fc(ctx), "%s: bad ip address: [%s]", __func__, buf);
+      break;
+    } else {
+      bits = mask = 32;
+      addr[0] = (unsigned char) a;
+      addr[1] = (unsigned char) b;
+      addr[2] = (unsigned char) c;
+      addr[3] = (unsigned char) d;
     }
 
-    acl_subnet = (a << 24) | (b << 16) | (c << 8) | d;
-    acl_mask = mask ? 0xffffffffU << (32 - mask) : 0;
-
-    if (acl_subnet == (ntohl(remote_ip) & acl_mask)) {
-      allowed = flag;
+    if (flag != '+' && flag != '-') {
+      cry(fc(ctx), "%s: flag must be + or -: [%s]", __func__, buf);
+      break;
+    } else if (sscanf(buf + n, "/%d", &mask) == 1 &&
+               (mask < 0 || mask > bits)) {
+      cry(fc(ctx), "%s: bad subnet mask: %d [%s]", __func__, mask, buf);
+      break;
+    } else if (!insert_acl_node(bits == 32 ? &acl->ipv4 : &acl->ipv6, addr,
+                                mask, rule, flag == '+')) {
+      cry(fc(ctx), "%s: cannot allocate ACL", __func__);
+      break;
     }
   }
 
-  return allowed == '+';
+  if (list != NULL) {
+    free_acl(acl);
+    acl = NULL;
+  }
+  return acl;
+}
+
+// Verify given socket address against the ACL.
+// Return 0 if address is disallowed, 1 if allowed.
+static int check_acl(struct mg_context *ctx, const union usa *usa) {
+  const struct acl *acl = ctx->acl;
+
+  if (acl == NULL) {
+    return 1;
+  }
+
+#if defined(USE_IPV6)
+  if (usa->sa.sa_family == AF_INET6) {
+    // Dual-stack listeners see IPv4 clients as ::ffff:a.b.c.d
+    return IN6_IS_ADDR_V4MAPPED(&usa->sin6.sin6_addr) ?
+      lookup_acl(acl->ipv4, usa->sin6.sin6_addr.s6_addr + 12, 32) :
+      lookup_acl(acl->ipv6, usa->sin6.sin6_addr.s6_addr, 128);
+  }
+#endif // USE_IPV6
+
+  return lookup_acl(acl->ipv4, (const unsigned char *) &usa->sin.sin_addr, 32);
 }
 
+#if !defined(USE_EPOLL) && !defined(USE_KQUEUE)
 static void add_to_set(SOCKET fd, fd_set *set, int *max_fd) {
   FD_SET(fd, set);
   if (fd > (SOCKET) *max_fd) {
     *max_fd = (int) fd;
   }
 }
+#endif // !USE_EPOLL && !USE_KQUEUE
 
 #if !defined(_WIN32)
 static int set_uid_option(struct mg_context *ctx) {
@@ -3806,9 +7984,22 @@ static unsigned long ssl_id_callback(void) {
 }
 
 #if !defined(NO_SSL_DL)
-static int load_dll(struct mg_context *ctx, const char *dll_name,
-                    struct ssl_func *sw) {
+static void (*get_dll_func(void *dll_handle, const char *name))(void) {
   union {void *p; void (*fp)(void);} u;
+#ifdef _WIN32
+  // GetProcAddress() returns pointer to function
+  u.fp = (void (*)(void)) dlsym(dll_handle, name);
+#else
+  // dlsym() on UNIX returns void *. ISO C forbids casts of data pointers to
+  // function pointers. We need to use a union to make a cast.
+  u.p = dlsym(dll_handle, name);
+#endif // _WIN32
+  return u.fp;
+}
+
+// Resolve all functions in sw, and those in opt_sw that the library has
+static int load_dll(struct mg_context *ctx, const char *dll_name,
+                    struct ssl_func *sw, struct ssl_func *opt_sw) {
   void  *dll_handle;
   struct ssl_func *fp;
 
@@ -3818,50 +8009,166 @@ static int load_dll(struct mg_context *ctx, const char *dll_name,
   }
 
   for (fp = sw; fp->name != NULL; fp++) {
-#ifdef _WIN32
-    // GetProcAddress() returns pointer to function
-    u.fp = (void (*)(void)) dlsym(dll_handle, fp->name);
-#else
-    // dlsym() on UNIX returns void *. ISO C forbids casts of data pointers to
-    // function pointers. We need to use a union to make a cast.
-    u.p = dlsym(dll_handle, fp->name);
-#endif // _WIN32
-    if (u.fp == NULL) {
+    if ((fp->ptr = get_dll_func(dll_handle, fp->name)) == NULL) {
       cry(fc(ctx), "%s: %s: cannot find %s", __func__, dll_name, fp->name);
       return 0;
-    } else {
-      fp->ptr = u.fp;
     }
   }
+  for (fp = opt_sw; fp->name != NULL; fp++) {
+    fp->ptr = get_dll_func(dll_handle, fp->name);
+  }
 
   return 1;
 }
 #endif // NO_SSL_DL
 
+// Pick HTTP/1.1, the protocol spoken here, from the client's ALPN list.
+// Clients offering only something else, like h2, go on without ALPN.
+static int alpn_select_callback(SSL *ssl, const unsigned char **out,
+                                unsigned char *outlen,
+                                const unsigned char *in, unsigned int inlen,
+                                void *arg) {
+  unsigned int i;
+
+  (void) ssl;
+  (void) arg;
+  for (i = 0; i < inlen && i + in[i] < inlen; i += in[i] + 1) {
+    if (in[i] == 8 && !memcmp(in + i + 1, "http/1.1", 8)) {
+      *out = in + i + 1;
+      *outlen = in[i];
+      return SSL_TLSEXT_ERR_OK;
+    }
+  }
+
+  return SSL_TLSEXT_ERR_NOACK;
+}
+
+static void set_ssl_ctx_options(SSL_CTX *s, unsigned long options) {
+#if !defined(NO_SSL_DL)
+  if (HAVE_SSL_SET_OPTIONS && !HAVE_SSL_SENDFILE) {
+    // Before OpenSSL 3.0, options are unsigned long
+    (void) (* (unsigned long (*)(SSL_CTX *, unsigned long))
+            ssl_opt_sw[3].ptr)(s, options);
+    return;
+  }
+#endif // !NO_SSL_DL
+  if (HAVE_SSL_SET_OPTIONS) {
+    (void) SSL_CTX_set_options(s, (uint64_t) options);
+  } else {
+    (void) SSL_CTX_ctrl(s, SSL_CTRL_OPTIONS, (long) options, NULL);
+  }
+}
+
+// Session tickets are encrypted with the ticket keys. Keys from a file
+// outlive restarts and can be shared by servers behind one name, random
+// keys made by the library are good until mongoose is restarted.
+static int set_ticket_keys(struct mg_context *ctx, const char *path) {
+  unsigned char keys[81];
+  size_t n = 0;
+  FILE *fp;
+
+  if ((fp = mg_fopen(path, "rb")) == NULL) {
+    cry(fc(ctx), "%s: cannot open %s: %s", __func__, path, strerror(ERRNO));
+    return 0;
+  }
+  n = fread(keys, 1, sizeof(keys), fp);
+  (void) fclose(fp);
+
+  // 80 bytes for OpenSSL 1.1 and later, 48 for older versions
+  if ((n != 80 && n != 48) ||
+      SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_SET_TLSEXT_TICKET_KEYS,
+                   (long) n, keys) != 1) {
+    cry(fc(ctx), "%s: %s: %d bytes of ticket keys do not fit this SSL "
+        "library", __func__, path, (int) n);
+    n = 0;
+  }
+  memset(keys, 0, sizeof(keys));
+
+  return n > 0;
+}
+
+// Resumed sessions skip the key exchange and certificate checks. Session
+// IDs are looked up in the server's cache, tickets carry the session
+// with them. Where the kernel can do TLS, OpenSSL hands the connection
+// keys over to it after the handshake.
+static int init_server_ssl_ctx(struct mg_context *ctx, unsigned long options) {
+  static const unsigned char sid_ctx[] = "mongoose";
+  const char *keys = ctx->config[SSL_TICKET_KEY_FILE];
+  long cache_size = atol(ctx->config[SSL_SESSION_CACHE_SIZE]);
+  long timeout = atol(ctx->config[SSL_SESSION_TIMEOUT]);
+
+  if (cache_size < 0 || timeout <= 0) {
+    cry(fc(ctx), "%s: invalid ssl_session_cache_size [%s] or "
+        "ssl_session_timeout [%s]", __func__,
+        ctx->config[SSL_SESSION_CACHE_SIZE], ctx->config[SSL_SESSION_TIMEOUT]);
+    return 0;
+  }
+
+  (void) SSL_CTX_set_session_id_context(ctx->ssl_ctx, sid_ctx,
+                                        sizeof(sid_ctx) - 1);
+  (void) SSL_CTX_set_timeout(ctx->ssl_ctx, timeout);
+  (void) SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_SET_SESS_CACHE_MODE,
+                      cache_size > 0 ? SSL_SESS_CACHE_SERVER :
+                      SSL_SESS_CACHE_OFF, NULL);
+  if (cache_size > 0) {
+    (void) SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_SET_SESS_CACHE_SIZE,
+                        cache_size, NULL);
+  }
+  if (HAVE_SSL_SENDFILE) {
+    options |= SSL_OP_ENABLE_KTLS;
+  }
+  set_ssl_ctx_options(ctx->ssl_ctx, options);
+  if (HAVE_SSL_ALPN) {
+    SSL_CTX_set_alpn_select_cb(ctx->ssl_ctx, alpn_select_callback, NULL);
+  }
+
+  return keys == NULL || set_ticket_keys(ctx, keys);
+}
+
 // Dynamically load SSL library. Set up ctx->ssl_ctx pointer.
 static int set_ssl_option(struct mg_context *ctx) {
   struct mg_request_info request_info;
+  const SSL_METHOD *server_method, *client_method;
+  unsigned long options = SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION;
   int i, size;
   const char *pem = ctx->config[SSL_CERTIFICATE];
   const char *chain = ctx->config[SSL_CHAIN_FILE];
 
 #if !defined(NO_SSL_DL)
-  if (!load_dll(ctx, SSL_LIB, ssl_sw) ||
-      !load_dll(ctx, CRYPTO_LIB, crypto_sw)) {
+  if (!load_dll(ctx, SSL_LIB, ssl_sw, ssl_opt_sw) ||
+      !load_dll(ctx, CRYPTO_LIB, crypto_sw, crypto_opt_sw)) {
+    return 0;
+  }
+  if (HAVE_OPENSSL_INIT ?
+      ssl_opt_sw[1].ptr == NULL || ssl_opt_sw[2].ptr == NULL :
+      ssl_opt_sw[9].ptr == NULL || ssl_opt_sw[10].ptr == NULL ||
+      ssl_opt_sw[11].ptr == NULL || ssl_opt_sw[12].ptr == NULL) {
+    cry(fc(ctx), "%s: %s: unknown SSL library version", __func__, SSL_LIB);
     return 0;
   }
 #endif // NO_SSL_DL
 
-  // Initialize SSL crap
-  SSL_library_init();
-  SSL_load_error_strings();
+  // OpenSSL 1.1 and later initialize themselves, this loads error strings
+  if (HAVE_OPENSSL_INIT) {
+    (void) OPENSSL_init_ssl(0, NULL);
+    server_method = TLS_server_method();
+    client_method = TLS_client_method();
+  } else {
+    SSL_library_init();
+    SSL_load_error_strings();
+    server_method = SSLv23_server_method();
+    client_method = SSLv23_client_method();
+    options |= SSL_OP_NO_SSLv2;
+  }
 
-  if ((ctx->client_ssl_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) {
+  if ((ctx->client_ssl_ctx = SSL_CTX_new(client_method)) == NULL) {
     cry(fc(ctx), "SSL_CTX_new error: %s", ssl_error());
   }
 
-  if ((ctx->ssl_ctx = SSL_CTX_new(SSLv23_server_method())) == NULL) {
+  if ((ctx->ssl_ctx = SSL_CTX_new(server_method)) == NULL) {
     cry(fc(ctx), "SSL_CTX_new error: %s", ssl_error());
+  } else if (!init_server_ssl_ctx(ctx, options)) {
+    return 0;
   } else if (ctx->user_callback != NULL) {
     memset(&request_info, 0, sizeof(request_info));
     request_info.user_data = ctx->user_data;
@@ -3884,8 +8191,11 @@ static int set_ssl_option(struct mg_context *ctx) {
     return 0;
   }
 
-  // Initialize locking callbacks, needed for thread safety.
-  // http://www.openssl.org/support/faq.html#PROG1
+  // OpenSSL 1.1 made itself thread safe. Older versions need locking
+  // callbacks, see http://www.openssl.org/support/faq.html#PROG1
+  if (!HAVE_CRYPTO_LOCKS) {
+    return 1;
+  }
   size = sizeof(pthread_mutex_t) * CRYPTO_num_locks();
   if ((ssl_mutexes = (pthread_mutex_t *) malloc((size_t)size)) == NULL) {
     cry(fc(ctx), "%s: cannot allocate mutexes: %s", __func__, ssl_error());
@@ -3904,7 +8214,7 @@ static int set_ssl_option(struct mg_context *ctx) {
 
 static void uninitialize_ssl(struct mg_context *ctx) {
   int i;
-  if (ctx->ssl_ctx != NULL) {
+  if (ctx->ssl_ctx != NULL && HAVE_CRYPTO_LOCKS && ssl_mutexes != NULL) {
     CRYPTO_set_locking_callback(NULL);
     for (i = 0; i < CRYPTO_num_locks(); i++) {
       pthread_mutex_destroy(&ssl_mutexes[i]);
@@ -3921,17 +8231,29 @@ static int set_gpass_option(struct mg_context *ctx) {
   return path == NULL || mg_stat(path, &mgstat) == 0;
 }
 
+// Compile the ACL and swap it in. The master thread is the only reader, so
+// reloading from the master thread is just a pointer swap.
 static int set_acl_option(struct mg_context *ctx) {
-  union usa fake;
-  return check_acl(ctx, &fake) != -1;
+  struct acl *acl = NULL, *old;
+
+  if (ctx->config[ACCESS_CONTROL_LIST] != NULL &&
+      (acl = compile_acl(ctx, ctx->config[ACCESS_CONTROL_LIST])) == NULL) {
+    return 0;
+  }
+  old = ctx->acl;
+  ctx->acl = acl;
+  free_acl(old);
+  return 1;
 }
 
 static void reset_per_request_attributes(struct mg_connection *conn) {
   conn->path_info = conn->body = conn->next_request = NULL;
   conn->num_bytes_sent = conn->consumed_content = 0;
   conn->content_len = -1;
-  conn->request_len = conn->data_len = 0;
+  conn->request_len = 0;
   conn->must_close = 0;
+  conn->chunked = 0;
+  conn->chunk_state = CHUNK_NONE;
 }
 
 static void close_socket_gracefully(struct mg_connection *conn) {
@@ -3963,7 +8285,20 @@ static void close_socket_gracefully(struct mg_connection *conn) {
 }
 
 static void close_connection(struct mg_connection *conn) {
+#if defined(USE_ZLIB)
+  if (conn->zs != NULL) {
+    free_compressor(conn->zs);
+    conn->zs = NULL;
+  }
+#endif
+  if (conn->out_len > 0 && conn->client.sock != INVALID_SOCKET) {
+    (void) flush_output(conn, NULL, 0, 0);
+  }
+  conn->out_len = 0;
+
+  // Without close_notify, the session would be dropped from the cache
   if (conn->ssl) {
+    (void) SSL_shutdown(conn->ssl);
     SSL_free(conn->ssl);
     conn->ssl = NULL;
   }
@@ -3978,38 +8313,118 @@ void mg_close_connection(struct mg_connection *conn) {
   free(conn);
 }
 
+// Resolve host into usa, without the port. getaddrinfo() may take a round
+// trip to the name server, so addresses are cached for DNS_CACHE_TTL
+// seconds.
+static int resolve_host(struct mg_context *ctx, const char *host,
+                        union usa *usa, socklen_t *len) {
+  struct addrinfo hints, *res;
+  struct dns_entry *e;
+  time_t now = time(NULL);
+  int i, rc, found = 0;
+
+  (void) pthread_mutex_lock(&ctx->client_mutex);
+  for (i = 0; i < DNS_CACHE_SIZE && !found; i++) {
+    e = &ctx->dns_cache[i];
+    if (e->expires > now && !strcmp(e->host, host)) {
+      *usa = e->usa;
+      *len = e->len;
+      found = 1;
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->client_mutex);
+  if (found) {
+    return 1;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+#if defined(USE_IPV6)
+  hints.ai_family = AF_UNSPEC;
+#else
+  hints.ai_family = AF_INET;
+#endif
+  hints.ai_socktype = SOCK_STREAM;
+  if ((rc = getaddrinfo(host, NULL, &hints, &res)) != 0) {
+    cry(fc(ctx), "%s: getaddrinfo(%s): %s", __func__, host, gai_strerror(rc));
+    return 0;
+  }
+  memset(usa, 0, sizeof(*usa));
+  *len = res->ai_addrlen < sizeof(*usa) ? res->ai_addrlen : sizeof(*usa);
+  memcpy(usa, res->ai_addr, *len);
+  freeaddrinfo(res);
+
+  // Replace the entry that expires first, empty ones included
+  if (strlen(host) < sizeof(e->host)) {
+    (void) pthread_mutex_lock(&ctx->client_mutex);
+    e = &ctx->dns_cache[0];
+    for (i = 1; i < DNS_CACHE_SIZE; i++) {
+      if (ctx->dns_cache[i].expires < e->expires) {
+        e = &ctx->dns_cache[i];
+      }
+    }
+    mg_strlcpy(e->host, host, sizeof(e->host));
+    e->usa = *usa;
+    e->len = *len;
+    e->expires = now + DNS_CACHE_TTL;
+    (void) pthread_mutex_unlock(&ctx->client_mutex);
+  }
+
+  return 1;
+}
+
 struct mg_connection *mg_connect(struct mg_context *ctx,
                                  const char *host, int port, int use_ssl) {
   struct mg_connection *newconn = NULL;
-  struct sockaddr_in sin;
-  struct hostent *he;
-  int sock;
+  size_t peer_len = strlen(host) + 8;  // Colon, port number and NUL
+  union usa usa;
+  socklen_t len;
+  SOCKET sock;
+  int on = 1;
 
   if (ctx->client_ssl_ctx == NULL && use_ssl) {
     cry(fc(ctx), "%s: SSL is not initialized", __func__);
-  } else if ((he = gethostbyname(host)) == NULL) {
-    cry(fc(ctx), "%s: gethostbyname(%s): %s", __func__, host, strerror(ERRNO));
-  } else if ((sock = socket(PF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+  } else if (!resolve_host(ctx, host, &usa, &len)) {
+    // Error is logged by resolve_host()
+  } else if ((sock = socket(usa.sa.sa_family, SOCK_STREAM, 0)) ==
+             INVALID_SOCKET) {
     cry(fc(ctx), "%s: socket: %s", __func__, strerror(ERRNO));
   } else {
-    sin.sin_family = AF_INET;
-    sin.sin_port = htons((uint16_t) port);
-    sin.sin_addr = * (struct in_addr *) he->h_addr_list[0];
-    if (connect(sock, (struct sockaddr *) &sin, sizeof(sin)) != 0) {
+#if defined(USE_IPV6)
+    if (usa.sa.sa_family == AF_INET6) {
+      usa.sin6.sin6_port = htons((uint16_t) port);
+    } else
+#endif
+    usa.sin.sin_port = htons((uint16_t) port);
+    if (connect(sock, &usa.sa, len) != 0) {
       cry(fc(ctx), "%s: connect(%s:%d): %s", __func__, host, port,
           strerror(ERRNO));
       closesocket(sock);
     } else if ((newconn = (struct mg_connection *)
-                calloc(1, sizeof(*newconn))) == NULL) {
+                calloc(1, sizeof(*newconn) + CLIENT_BUF_SIZE + MG_BUF_LEN +
+                       peer_len)) == NULL) {
       cry(fc(ctx), "%s: calloc: %s", __func__, strerror(ERRNO));
       closesocket(sock);
     } else {
+      // Pipelined requests are small, do not let them wait for each other
+      (void) setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *) &on,
+                        sizeof(on));
+      set_close_on_exec(sock);
       newconn->ctx = ctx;
       newconn->client.sock = sock;
-      newconn->client.rsa.sin = sin;
+      newconn->client.rsa = usa;
       newconn->client.is_ssl = use_ssl;
-      if (use_ssl) {
-        sslize(newconn, ctx->client_ssl_ctx, SSL_connect);
+      newconn->buf_size = CLIENT_BUF_SIZE;
+      newconn->buf = (char *) (newconn + 1);
+      newconn->out_buf = newconn->buf + CLIENT_BUF_SIZE;
+      newconn->out_size = MG_BUF_LEN;  // Pipelined requests leave together
+      newconn->peer = newconn->out_buf + MG_BUF_LEN;
+      (void) mg_snprintf(newconn, newconn->peer, peer_len, "%s:%d",
+                         host, port);
+      newconn->content_len = -1;
+      if (use_ssl && !sslize(newconn, ctx->client_ssl_ctx, SSL_connect)) {
+        cry(fc(ctx), "%s: SSL_connect(%s:%d) failed", __func__, host, port);
+        mg_close_connection(newconn);
+        newconn = NULL;
       }
     }
   }
@@ -4017,10 +8432,238 @@ struct mg_connection *mg_connect(struct mg_context *ctx,
   return newconn;
 }
 
+// Return 1 if the body of the last response on a client connection has
+// been read to its end
+static int is_response_read(const struct mg_connection *conn) {
+  return conn->chunk_state == CHUNK_NONE ?
+    conn->consumed_content >= conn->content_len :
+    conn->chunk_state == CHUNK_DONE;
+}
+
+// Read and throw away the rest of the last response body on a client
+// connection, and move whatever follows it to the start of the buffer.
+// Return 0 if the body cannot be read to its end.
+static int finish_response(struct mg_connection *conn) {
+  char buf[MG_BUF_LEN];
+  int n;
+
+  if (conn->next_request != NULL) {
+    while ((n = mg_read(conn, buf, sizeof(buf))) > 0) {
+    }
+    if (n < 0 || !is_response_read(conn)) {
+      conn->must_close = 1;
+      return 0;
+    }
+    if (conn->chunk_state == CHUNK_DONE) {
+      conn->next_request = conn->body;
+    }
+    conn->data_len -= (int) (conn->next_request - conn->buf);
+    memmove(conn->buf, conn->next_request, (size_t) conn->data_len);
+    conn->body = conn->next_request = conn->buf;
+  }
+  return 1;
+}
+
+int mg_read_response(struct mg_connection *conn) {
+  struct mg_request_info *ri = &conn->request_info;
+  const char *cl, *te, *connection;
+  int status, buffered_len;
+
+  // Interim 1xx responses are skipped
+  do {
+    if (conn->must_close || !finish_response(conn)) {
+      return -1;
+    }
+    reset_per_request_attributes(conn);
+    conn->request_len = read_request(NULL, conn, conn->buf, conn->buf_size,
+                                     &conn->data_len);
+    if (conn->request_len <= 0 ||
+        parse_http_response(conn->buf, conn->request_len, ri) <= 0) {
+      conn->must_close = 1;
+      return -1;
+    }
+    conn->body = conn->next_request = conn->buf + conn->request_len;
+    status = ri->status_code = atoi(ri->uri);
+  } while (status >= 100 && status < 200);
+  conn->client.num_requests++;
+
+  connection = get_header(ri, "Connection");
+  if (strcmp(ri->request_method, "HTTP/1.1") ?
+      connection == NULL || mg_strcasecmp(connection, "keep-alive") :
+      connection != NULL && !mg_strcasecmp(connection, "close")) {
+    conn->must_close = 1;
+  }
+
+  // Set the body boundaries like process_new_connection() does for
+  // requests. Without length or chunking, the body ends with the
+  // connection.
+  cl = get_header(ri, "Content-Length");
+  te = get_header(ri, "Transfer-Encoding");
+  buffered_len = conn->data_len - conn->request_len;
+  if (status == 204 || status == 304) {
+    conn->content_len = 0;
+  } else if (te != NULL && !mg_strcasecmp(te, "chunked")) {
+    conn->chunk_state = CHUNK_SIZE;
+    conn->next_request += buffered_len;
+  } else if (te == NULL && cl != NULL) {
+    if ((conn->content_len = strtoll(cl, NULL, 10)) < 0) {
+      conn->must_close = 1;
+      return -1;
+    }
+    conn->next_request += conn->content_len < (int64_t) buffered_len ?
+      (int) conn->content_len : buffered_len;
+  } else {
+    conn->content_len = INT64_MAX;
+    conn->must_close = 1;
+    conn->next_request += buffered_len;
+  }
+
+  return status;
+}
+
+// Take an idle connection to host:port out of the pool. Connections idle
+// for too long are closed on the way.
+static struct mg_connection *take_idle_connection(struct mg_context *ctx,
+                                                  const char *host,
+                                                  int port, int use_ssl) {
+  struct mg_connection *conn, **p, *expired = NULL, *next;
+  size_t host_len = strlen(host);
+  time_t now = time(NULL);
+
+  (void) pthread_mutex_lock(&ctx->client_mutex);
+  for (p = &ctx->client_pool; (conn = *p) != NULL; ) {
+    if (conn->client.idle_expires <= now) {
+      *p = conn->next_idle;
+      conn->next_idle = expired;
+      expired = conn;
+    } else if (conn->client.is_ssl == use_ssl &&
+               !strncmp(conn->peer, host, host_len) &&
+               conn->peer[host_len] == ':' &&
+               atoi(conn->peer + host_len + 1) == port) {
+      *p = conn->next_idle;
+      break;
+    } else {
+      p = &conn->next_idle;
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->client_mutex);
+
+  for (; expired != NULL; expired = next) {
+    next = expired->next_idle;
+    mg_close_connection(expired);
+  }
+
+  return conn;
+}
+
+// Return 1 if the server has closed an idle connection, or sent something
+// nobody asked for
+static int is_connection_stale(struct mg_connection *conn) {
+  if (conn->ssl != NULL && SSL_pending(conn->ssl) > 0) {
+    return 1;
+  }
+  return poll_socket(conn->client.sock, 0) != 0;
+}
+
+struct mg_connection *mg_pool_connect(struct mg_context *ctx,
+                                      const char *host, int port,
+                                      int use_ssl) {
+  struct mg_connection *conn;
+
+  while ((conn = take_idle_connection(ctx, host, port, use_ssl)) != NULL &&
+         is_connection_stale(conn)) {
+    mg_close_connection(conn);
+  }
+
+  return conn != NULL ? conn : mg_connect(ctx, host, port, use_ssl);
+}
+
+void mg_pool_release(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+  struct mg_connection *c;
+  int n = 0;
+
+  // The body must have been read, a partly read one may be long
+  if (!conn->must_close && conn->next_request != NULL &&
+      is_response_read(conn) && finish_response(conn) &&
+      conn->data_len == 0) {
+    (void) pthread_mutex_lock(&ctx->client_mutex);
+    for (c = ctx->client_pool; c != NULL; c = c->next_idle) {
+      if (c->client.is_ssl == conn->client.is_ssl &&
+          !strcmp(c->peer, conn->peer)) {
+        n++;
+      }
+    }
+    if (n < CLIENT_POOL_SIZE) {
+      conn->client.idle_expires = time(NULL) + CLIENT_IDLE_TIMEOUT;
+      conn->next_idle = ctx->client_pool;
+      ctx->client_pool = conn;
+      conn = NULL;
+    }
+    (void) pthread_mutex_unlock(&ctx->client_mutex);
+  }
+
+  if (conn != NULL) {
+    mg_close_connection(conn);
+  }
+}
+
+// Send a GET request on a pooled connection and read the response headers.
+// The server may have closed a kept-alive connection just as the request
+// went out, the request is sent again on another connection then.
+static struct mg_connection *fetch_response(struct mg_context *ctx,
+                                            const char *host, int port,
+                                            int use_ssl, const char *uri) {
+  struct mg_connection *conn;
+  int reused;
+
+  do {
+    if ((conn = mg_pool_connect(ctx, host, port, use_ssl)) == NULL) {
+      return NULL;
+    }
+    reused = conn->client.num_requests > 0;
+    if (port == (use_ssl ? 443 : 80)) {
+      (void) mg_printf(conn, "GET /%s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                       uri, host);
+    } else {
+      (void) mg_printf(conn, "GET /%s HTTP/1.1\r\nHost: %s:%d\r\n\r\n",
+                       uri, host, port);
+    }
+    if (mg_read_response(conn) > 0) {
+      return conn;
+    }
+    reused = reused && conn->data_len == 0;
+    mg_close_connection(conn);
+  } while (reused);
+
+  return NULL;
+}
+
+// Copy the response headers of a client connection to buf, ri pointing
+// into the copy. Return 0 if they do not fit.
+static int copy_response_info(const struct mg_connection *conn, char *buf,
+                              size_t buf_len, struct mg_request_info *ri) {
+  int i;
+
+  if (conn->request_len > (int) buf_len) {
+    return 0;
+  }
+  memcpy(buf, conn->buf, (size_t) conn->request_len);
+  *ri = conn->request_info;
+  ri->request_method = buf + (ri->request_method - conn->buf);
+  ri->uri = buf + (ri->uri - conn->buf);
+  ri->http_version = buf + (ri->http_version - conn->buf);
+  for (i = 0; i < ri->num_headers; i++) {
+    ri->http_headers[i].name = buf + (ri->http_headers[i].name - conn->buf);
+    ri->http_headers[i].value = buf + (ri->http_headers[i].value - conn->buf);
+  }
+  return 1;
+}
+
 FILE *mg_fetch(struct mg_context *ctx, const char *url, const char *path,
                char *buf, size_t buf_len, struct mg_request_info *ri) {
   struct mg_connection *newconn;
-  int n, req_length, data_length, port;
+  int n, port;
   char host[1025], proto[10], buf2[MG_BUF_LEN];
   FILE *fp = NULL;
 
@@ -4032,41 +8675,32 @@ FILE *mg_fetch(struct mg_context *ctx, const char *url, const char *path,
     return NULL;
   }
 
-  if ((newconn = mg_connect(ctx, host, port,
-                            !strcmp(proto, "https"))) == NULL) {
-    cry(fc(ctx), "%s: mg_connect(%s): %s", __func__, url, strerror(ERRNO));
+  if ((newconn = fetch_response(ctx, host, port, !strcmp(proto, "https"),
+                                url + n)) == NULL) {
+    cry(fc(ctx), "%s(%s): no valid HTTP reply", __func__, url);
+    return NULL;
+  } else if (!copy_response_info(newconn, buf, buf_len, ri)) {
+    cry(fc(ctx), "%s(%s): reply headers do not fit in the buffer", __func__,
+        url);
+  } else if ((fp = fopen(path, "w+b")) == NULL) {
+    cry(fc(ctx), "%s: fopen(%s): %s", __func__, path, strerror(ERRNO));
   } else {
-    mg_printf(newconn, "GET /%s HTTP/1.0\r\nHost: %s\r\n\r\n", url + n, host);
-    data_length = 0;
-    req_length = read_request(NULL, newconn, buf, buf_len, &data_length);
-    if (req_length <= 0) {
-      cry(fc(ctx), "%s(%s): invalid HTTP reply", __func__, url);
-    } else if (parse_http_response(buf, req_length, ri) <= 0) {
-      cry(fc(ctx), "%s(%s): cannot parse HTTP headers", __func__, url);
-    } else if ((fp = fopen(path, "w+b")) == NULL) {
-      cry(fc(ctx), "%s: fopen(%s): %s", __func__, path, strerror(ERRNO));
-    } else {
-      // Write chunk of data that may be in the user's buffer
-      data_length -= req_length;
-      if (data_length > 0 &&
-        fwrite(buf + req_length, 1, data_length, fp) != (size_t) data_length) {
-        cry(fc(ctx), "%s: fwrite(%s): %s", __func__, path, strerror(ERRNO));
-        fclose(fp);
-        fp = NULL;
-      }
-      // Read the rest of the response and write it to the file. Do not use
-      // mg_read() cause we didn't set newconn->content_len properly.
-      while (fp && (data_length = pull(0, newconn, buf2, sizeof(buf2))) > 0) {
-        if (fwrite(buf2, 1, data_length, fp) != (size_t) data_length) {
-          cry(fc(ctx), "%s: fwrite(%s): %s", __func__, path, strerror(ERRNO));
-          fclose(fp);
-          fp = NULL;
-          break;
-        }
-      }
+    // Body ends where Content-Length or the last chunk says, not when the
+    // server closes the connection
+    while ((n = mg_read(newconn, buf2, sizeof(buf2))) > 0 &&
+           fwrite(buf2, 1, n, fp) == (size_t) n) {
+    }
+    if (n > 0) {
+      cry(fc(ctx), "%s: fwrite(%s): %s", __func__, path, strerror(ERRNO));
+    } else if (n < 0 || !is_response_read(newconn)) {
+      cry(fc(ctx), "%s(%s): incomplete reply body", __func__, url);
+    }
+    if (n != 0 || !is_response_read(newconn)) {
+      fclose(fp);
+      fp = NULL;
     }
-    mg_close_connection(newconn);
   }
+  mg_pool_release(newconn);
 
   return fp;
 }
@@ -4077,13 +8711,32 @@ static int is_valid_uri(const char *uri) {
   return uri[0] == '/' || (uri[0] == '*' && uri[1] == '\0');
 }
 
+static int park_connection(struct mg_connection *conn);
+
+// Find where the chunked request body ends, so that the next pipelined
+// request can be parsed. Body data the handler has not read is not
+// skipped, the connection is closed instead.
+static void finish_chunked_request(struct mg_connection *conn) {
+  if (conn->chunk_state == CHUNK_DATA && conn->chunk_left == 0) {
+    conn->chunk_state = CHUNK_CRLF;
+  }
+  if (conn->chunk_state == CHUNK_DATA || read_chunk_header(conn) != 0) {
+    conn->must_close = 1;
+  }
+  conn->next_request = conn->body;
+}
+
 static void process_new_connection(struct mg_connection *conn) {
   struct mg_request_info *ri = &conn->request_info;
-  int keep_alive_enabled, buffered_len;
-  const char *cl;
+  int keep_alive_enabled, keep_alive, buffered_len;
+  const char *cl, *te;
 
   keep_alive_enabled = !strcmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes");
 
+  // Data left in the buffer after a request is the start of the next
+  // pipelined one, it is kept across iterations
+  conn->data_len = 0;
+
   do {
     reset_per_request_attributes(conn);
     conn->request_len = read_request(NULL, conn, conn->buf, conn->buf_size,
@@ -4096,6 +8749,7 @@ static void process_new_connection(struct mg_connection *conn) {
       return;  // Remote end closed the connection
     }
     conn->body = conn->next_request = conn->buf + conn->request_len;
+    conn->client.num_requests++;
 
     if (parse_http_request(conn->buf, conn->buf_size, ri) <= 0 ||
         !is_valid_uri(ri->uri)) {
@@ -4112,11 +8766,17 @@ static void process_new_connection(struct mg_connection *conn) {
       // Request is valid, handle it
       cl = get_header(ri, "Content-Length");
       conn->content_len = cl == NULL ? -1 : strtoll(cl, NULL, 10);
+      te = get_header(ri, "Transfer-Encoding");
 
-      // Set pointer to the next buffered request
+      // Set pointer to the next buffered request. Where a chunked body
+      // ends is not known yet, all buffered data is taken for the body.
       buffered_len = conn->data_len - conn->request_len;
       assert(buffered_len >= 0);
-      if (conn->content_len <= 0) {
+      if (te != NULL && !mg_strcasecmp(te, "chunked")) {
+        conn->chunk_state = CHUNK_SIZE;
+        conn->content_len = -1;
+        conn->next_request += buffered_len;
+      } else if (conn->content_len <= 0) {
       } else if (conn->content_len < (int64_t) buffered_len) {
         conn->next_request += conn->content_len;
       } else {
@@ -4124,67 +8784,433 @@ static void process_new_connection(struct mg_connection *conn) {
       }
 
       conn->birth_time = time(NULL);
-      handle_request(conn);
-      call_user(conn, MG_REQUEST_COMPLETE);
+      if (te != NULL && conn->chunk_state == CHUNK_NONE &&
+          mg_strcasecmp(te, "identity")) {
+        send_http_error(conn, 501, "Not Implemented",
+                        "Transfer-Encoding %s is not implemented", te);
+        conn->must_close = 1;
+      } else {
+        handle_request(conn);
+        call_user(conn, MG_REQUEST_COMPLETE);
+      }
       log_access(conn);
+      if (conn->chunk_state != CHUNK_NONE) {
+        finish_chunked_request(conn);
+      }
     }
     if (ri->remote_user != NULL) {
       free((void *) ri->remote_user);
     }
 
+    // Response is complete, do not let it sit in the output buffer. When
+    // the next pipelined request is buffered already, its response goes
+    // out together with this one.
+    if (conn->data_len == conn->next_request - conn->buf) {
+      (void) flush_output(conn, NULL, 0, 0);
+    }
+
+    // Decide before the request is discarded, request_info points into it
+    keep_alive = keep_alive_enabled && should_keep_alive(conn);
+
     // Discard all buffered data for this request
     assert(conn->next_request >= conn->buf);
     assert(conn->data_len >= conn->next_request - conn->buf);
     conn->data_len -= conn->next_request - conn->buf;
     memmove(conn->buf, conn->next_request, (size_t) conn->data_len);
   } while (conn->ctx->stop_flag == 0 &&
-           keep_alive_enabled &&
-           should_keep_alive(conn));
+           keep_alive &&
+           !park_connection(conn));
 }
 
-// Worker threads take accepted socket from the queue
-static int consume_socket(struct mg_context *ctx, struct socket *sp) {
-  (void) pthread_mutex_lock(&ctx->mutex);
-  DEBUG_TRACE(("going idle"));
+// Atomic operations for the lock-free socket queue.
+#if defined(_WIN32) && !defined(__GNUC__)
+static long mg_atomic_load(volatile long *p) {
+  return InterlockedCompareExchange(p, 0, 0);
+}
 
-  // If the queue is empty, wait. We're idle at this point.
-  while (ctx->sq_head == ctx->sq_tail && ctx->stop_flag == 0) {
-    pthread_cond_wait(&ctx->sq_full, &ctx->mutex);
+static void mg_atomic_store(volatile long *p, long v) {
+  (void) InterlockedExchange(p, v);
+}
+
+static int mg_atomic_cas(volatile long *p, long old_val, long new_val) {
+  return InterlockedCompareExchange(p, new_val, old_val) == old_val;
+}
+
+static long mg_atomic_add(volatile long *p, long v) {
+  return InterlockedExchangeAdd(p, v) + v;
+}
+
+#define mg_memory_barrier() MemoryBarrier()
+#else
+static long mg_atomic_load(volatile long *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void mg_atomic_store(volatile long *p, long v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static int mg_atomic_cas(volatile long *p, long old_val, long new_val) {
+  return __atomic_compare_exchange_n(p, &old_val, new_val, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static long mg_atomic_add(volatile long *p, long v) {
+  return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST);
+}
+
+#define mg_memory_barrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif // _WIN32
+
+static void ec_init(struct eventcount *ec) {
+  ec->epoch = 0;
+  ec->waiters = 0;
+#if !defined(USE_FUTEX)
+  (void) pthread_mutex_init(&ec->mutex, NULL);
+  (void) pthread_cond_init(&ec->cond, NULL);
+#endif // !USE_FUTEX
+}
+
+static void ec_destroy(struct eventcount *ec) {
+#if defined(USE_FUTEX)
+  (void) ec;
+#else
+  (void) pthread_mutex_destroy(&ec->mutex);
+  (void) pthread_cond_destroy(&ec->cond);
+#endif // USE_FUTEX
+}
+
+// Announce intention to wait. Caller must re-check its condition after
+// this call, and either ec_cancel_wait() or ec_wait() with returned key.
+static int ec_prepare_wait(struct eventcount *ec) {
+  int key;
+#if defined(USE_FUTEX)
+  key = __atomic_load_n(&ec->epoch, __ATOMIC_ACQUIRE);
+  (void) mg_atomic_add(&ec->waiters, 1);
+#else
+  (void) pthread_mutex_lock(&ec->mutex);
+  key = ec->epoch;
+  (void) mg_atomic_add(&ec->waiters, 1);
+  (void) pthread_mutex_unlock(&ec->mutex);
+#endif // USE_FUTEX
+  return key;
+}
+
+static void ec_cancel_wait(struct eventcount *ec) {
+  (void) mg_atomic_add(&ec->waiters, -1);
+}
+
+// Block until ec_notify() is called after ec_prepare_wait() returned key.
+// May return spuriously.
+static void ec_wait(struct eventcount *ec, int key) {
+#if defined(__linux__) && defined(USE_FUTEX)
+  (void) syscall(SYS_futex, &ec->epoch, FUTEX_WAIT_PRIVATE, key,
+                 NULL, NULL, 0);
+#elif defined(USE_FUTEX)
+  (void) _umtx_op((void *) &ec->epoch, UMTX_OP_WAIT_UINT_PRIVATE,
+                  (u_long) (unsigned) key, NULL, NULL);
+#else
+  (void) pthread_mutex_lock(&ec->mutex);
+  while (ec->epoch == key) {
+    (void) pthread_cond_wait(&ec->cond, &ec->mutex);
+  }
+  (void) pthread_mutex_unlock(&ec->mutex);
+#endif
+  (void) mg_atomic_add(&ec->waiters, -1);
+}
+
+// Wake up one (or all) parked threads. Cheap if nobody is waiting.
+static void ec_notify(struct eventcount *ec, int wake_all) {
+  mg_memory_barrier();
+  if (mg_atomic_load(&ec->waiters) == 0) {
+    return;
+  }
+#if defined(__linux__) && defined(USE_FUTEX)
+  (void) __atomic_add_fetch(&ec->epoch, 1, __ATOMIC_SEQ_CST);
+  (void) syscall(SYS_futex, &ec->epoch, FUTEX_WAKE_PRIVATE,
+                 wake_all ? INT_MAX : 1, NULL, NULL, 0);
+#elif defined(USE_FUTEX)
+  (void) __atomic_add_fetch(&ec->epoch, 1, __ATOMIC_SEQ_CST);
+  (void) _umtx_op((void *) &ec->epoch, UMTX_OP_WAKE_PRIVATE,
+                  wake_all ? INT_MAX : 1, NULL, NULL);
+#else
+  (void) pthread_mutex_lock(&ec->mutex);
+  ec->epoch++;
+  if (wake_all) {
+    (void) pthread_cond_broadcast(&ec->cond);
+  } else {
+    (void) pthread_cond_signal(&ec->cond);
+  }
+  (void) pthread_mutex_unlock(&ec->mutex);
+#endif
+}
+
+// Write out everything the worker has logged so far. Must be called with
+// log_mutex held, which makes the caller the only consumer of the ring.
+static void drain_log_ring(struct mg_context *ctx, int log,
+                           struct log_ring *ring) {
+  unsigned long head, tail, offset, n;
+
+  head = (unsigned long) mg_atomic_load(&ring->head);
+  for (tail = (unsigned long) ring->tail; tail != head; tail += n) {
+    offset = tail & (sizeof(ring->buf) - 1);
+    n = head - tail;
+    if (n > sizeof(ring->buf) - offset) {
+      n = sizeof(ring->buf) - offset;
+    }
+    if (ctx->log_files[log] != NULL) {
+      (void) fwrite(ring->buf + offset, 1, n, ctx->log_files[log]);
+    }
+  }
+  mg_atomic_store(&ring->tail, (long) tail);
+}
+
+// Must be called with log_mutex held.
+static void flush_logs(struct mg_context *ctx) {
+  struct log_ring *ring;
+  int i;
+
+  for (i = 0; i < NUM_LOGS; i++) {
+    for (ring = ctx->log_rings[i]; ring != NULL; ring = ring->next) {
+      drain_log_ring(ctx, i, ring);
+    }
+    if (ctx->log_files[i] != NULL) {
+      (void) fflush(ctx->log_files[i]);
+    }
+  }
+}
+
+// Must be called with log_mutex held.
+static void reopen_logs(struct mg_context *ctx) {
+  const char *path;
+  int i;
+
+  for (i = 0; i < NUM_LOGS; i++) {
+    if ((path = ctx->config[log_file_options[i]]) != NULL) {
+      if (ctx->log_files[i] != NULL) {
+        (void) fclose(ctx->log_files[i]);
+      }
+      // If the file cannot be opened, lines buffered by workers are lost
+      // and the others are appended with an fopen() each, until a later
+      // reopen succeeds
+      ctx->log_files[i] = mg_fopen(path, "a+");
+    }
+  }
+}
+
+// Append the line to the log. Worker threads buffer it in their ring,
+// which the logger thread writes out at least once per second. Other
+// threads, and workers whose ring is full, write the line directly.
+static void write_log(struct mg_connection *conn, int log,
+                      const char *line, int len) {
+  struct mg_context *ctx = conn->ctx;
+  struct log_ring *ring = conn->log_rings[log];
+  unsigned long head, used, offset, n;
+  FILE *fp;
+
+  if (ring != NULL) {
+    head = (unsigned long) ring->head;
+    used = head - (unsigned long) mg_atomic_load(&ring->tail);
+    if (used + len <= sizeof(ring->buf)) {
+      offset = head & (sizeof(ring->buf) - 1);
+      n = sizeof(ring->buf) - offset;
+      if (n > (unsigned long) len) {
+        n = (unsigned long) len;
+      }
+      memcpy(ring->buf + offset, line, n);
+      memcpy(ring->buf, line + n, len - n);
+      mg_atomic_store(&ring->head, (long) (head + len));
+      if (used + len > sizeof(ring->buf) / 2) {
+        ctx->log_flush = 1;
+      }
+      return;
+    }
+  }
+
+  (void) pthread_mutex_lock(&ctx->log_mutex);
+  if (ring != NULL) {
+    drain_log_ring(ctx, log, ring);
+  }
+  if (ctx->log_files[log] != NULL) {
+    (void) fwrite(line, 1, (size_t) len, ctx->log_files[log]);
+    if (ring == NULL) {
+      (void) fflush(ctx->log_files[log]);
+    }
+  } else if ((fp = mg_fopen(ctx->config[log_file_options[log]], "a+")) !=
+             NULL) {
+    // Logging before mg_start() has opened the log files
+    (void) fwrite(line, 1, (size_t) len, fp);
+    (void) fclose(fp);
+  }
+  (void) pthread_mutex_unlock(&ctx->log_mutex);
+}
+
+void mg_reopen_logs(struct mg_context *ctx) {
+  // Only sets a flag, so it is safe to call from a signal handler
+  ctx->log_reopen = 1;
+}
+
+static void logger_thread(struct mg_context *ctx) {
+  time_t last_flush = time(NULL);
+
+  while (ctx->log_stop == 0) {
+    mg_sleep(100);
+    if (ctx->log_flush || ctx->log_reopen || time(NULL) != last_flush) {
+      (void) pthread_mutex_lock(&ctx->log_mutex);
+      ctx->log_flush = 0;
+      flush_logs(ctx);
+      if (ctx->log_reopen) {
+        ctx->log_reopen = 0;
+        reopen_logs(ctx);
+      }
+      (void) pthread_mutex_unlock(&ctx->log_mutex);
+      last_flush = time(NULL);
+    }
+  }
+
+  // Signal the master thread that logger has exited
+  ctx->log_stop = 2;
+}
+
+// Give the worker thread its own log buffers.
+static void add_log_rings(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+  int i;
+
+  (void) pthread_mutex_lock(&ctx->log_mutex);
+  for (i = 0; i < NUM_LOGS; i++) {
+    if (ctx->log_files[i] != NULL &&
+        (conn->log_rings[i] = (struct log_ring *)
+         calloc(1, sizeof(*conn->log_rings[i]))) != NULL) {
+      conn->log_rings[i]->next = ctx->log_rings[i];
+      ctx->log_rings[i] = conn->log_rings[i];
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->log_mutex);
+}
+
+// Write out the exiting worker's buffered lines and free the buffers.
+static void remove_log_rings(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+  struct log_ring **pp;
+  int i;
+
+  (void) pthread_mutex_lock(&ctx->log_mutex);
+  for (i = 0; i < NUM_LOGS; i++) {
+    if (conn->log_rings[i] != NULL) {
+      drain_log_ring(ctx, i, conn->log_rings[i]);
+      for (pp = &ctx->log_rings[i]; *pp != conn->log_rings[i];
+           pp = &(*pp)->next)
+        ;
+      *pp = conn->log_rings[i]->next;
+      free(conn->log_rings[i]);
+      conn->log_rings[i] = NULL;
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->log_mutex);
+}
+
+// Bounded lock-free multi-producer/multi-consumer queue of accepted
+// sockets, after Dmitry Vyukov's algorithm. Return 0 if the queue is full.
+static int sq_push(struct mg_context *ctx, const struct socket *sp) {
+  struct sq_cell *cell;
+  long pos, diff;
+
+  pos = mg_atomic_load(&ctx->sq_head);
+  for (;;) {
+    cell = &ctx->queue[(unsigned long) pos & ctx->sq_mask];
+    diff = (long) ((unsigned long) mg_atomic_load(&cell->seq) -
+                   (unsigned long) pos);
+    if (diff == 0) {
+      if (mg_atomic_cas(&ctx->sq_head, pos, (long) ((unsigned long) pos + 1))) {
+        break;
+      }
+      pos = mg_atomic_load(&ctx->sq_head);
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = mg_atomic_load(&ctx->sq_head);
+    }
+  }
+
+  cell->socket = *sp;
+  mg_atomic_store(&cell->seq, (long) ((unsigned long) pos + 1));
+  return 1;
+}
+
+// Return 0 if the queue is empty.
+static int sq_pop(struct mg_context *ctx, struct socket *sp) {
+  struct sq_cell *cell;
+  long pos, diff;
+
+  pos = mg_atomic_load(&ctx->sq_tail);
+  for (;;) {
+    cell = &ctx->queue[(unsigned long) pos & ctx->sq_mask];
+    diff = (long) ((unsigned long) mg_atomic_load(&cell->seq) -
+                   ((unsigned long) pos + 1));
+    if (diff == 0) {
+      if (mg_atomic_cas(&ctx->sq_tail, pos, (long) ((unsigned long) pos + 1))) {
+        break;
+      }
+      pos = mg_atomic_load(&ctx->sq_tail);
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = mg_atomic_load(&ctx->sq_tail);
+    }
   }
 
-  // If we're stopping, sq_head may be equal to sq_tail.
-  if (ctx->sq_head > ctx->sq_tail) {
-    // Copy socket from the queue and increment tail
-    *sp = ctx->queue[ctx->sq_tail % ARRAY_SIZE(ctx->queue)];
-    ctx->sq_tail++;
-    DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
+  *sp = cell->socket;
+  mg_atomic_store(&cell->seq,
+                  (long) ((unsigned long) pos + ctx->sq_mask + 1));
+  return 1;
+}
+
+// Worker threads take accepted socket from the queue
+static int consume_socket(struct mg_context *ctx, struct socket *sp) {
+  int key;
+
+  DEBUG_TRACE(("going idle"));
 
-    // Wrap pointers if needed
-    while (ctx->sq_tail > (int) ARRAY_SIZE(ctx->queue)) {
-      ctx->sq_tail -= ARRAY_SIZE(ctx->queue);
-      ctx->sq_head -= ARRAY_SIZE(ctx->queue);
+  // If the queue is empty, wait. We're idle at this point.
+  while (!sq_pop(ctx, sp)) {
+    key = ec_prepare_wait(&ctx->sq_full);
+    if (sq_pop(ctx, sp)) {
+      ec_cancel_wait(&ctx->sq_full);
+      break;
+    } else if (ctx->stop_flag) {
+      // Wake up the master that may be waiting in produce_socket()
+      ec_cancel_wait(&ctx->sq_full);
+      ec_notify(&ctx->sq_empty, 1);
+      return 0;
     }
+    ec_wait(&ctx->sq_full, key);
   }
+  DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
 
-  (void) pthread_cond_signal(&ctx->sq_empty);
-  (void) pthread_mutex_unlock(&ctx->mutex);
+  ec_notify(&ctx->sq_empty, 0);
 
-  return !ctx->stop_flag;
+  return 1;
 }
 
 static void worker_thread(struct mg_context *ctx) {
   struct mg_connection *conn;
   int buf_size = atoi(ctx->config[MAX_REQUEST_SIZE]);
 
-  conn = (struct mg_connection *) calloc(1, sizeof(*conn) + buf_size);
+  conn = (struct mg_connection *) calloc(1, sizeof(*conn) + buf_size +
+                                         MG_BUF_LEN);
   if (conn == NULL) {
     cry(fc(ctx), "%s", "Cannot create new connection struct, OOM");
   } else {
     conn->buf_size = buf_size;
     conn->buf = (char *) (conn + 1);
+    conn->out_buf = conn->buf + buf_size;
+    conn->out_size = MG_BUF_LEN;
+    conn->ctx = ctx;
+    add_log_rings(conn);
 
-    // Call consume_socket() even when ctx->stop_flag > 0, to let it signal
-    // sq_empty condvar to wake up the master waiting in produce_socket()
+    // Call consume_socket() even when ctx->stop_flag > 0, to let it notify
+    // sq_empty to wake up the master waiting in produce_socket()
     while (consume_socket(ctx, &conn->client)) {
       conn->birth_time = time(NULL);
       conn->ctx = ctx;
@@ -4199,14 +9225,16 @@ static void worker_thread(struct mg_context *ctx) {
       conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
       conn->request_info.is_ssl = conn->client.is_ssl;
 
-      if (!conn->client.is_ssl ||
-          (conn->client.is_ssl &&
-           sslize(conn, conn->ctx->ssl_ctx, SSL_accept))) {
+      // Parked connection comes back with SSL session already established
+      conn->ssl = conn->client.ssl;
+      if (!conn->client.is_ssl || conn->ssl != NULL ||
+          sslize(conn, conn->ctx->ssl_ctx, SSL_accept)) {
         process_new_connection(conn);
       }
 
       close_connection(conn);
     }
+    remove_log_rings(conn);
     free(conn);
   }
 
@@ -4222,55 +9250,577 @@ static void worker_thread(struct mg_context *ctx) {
 
 // Master thread adds accepted socket to a queue
 static void produce_socket(struct mg_context *ctx, const struct socket *sp) {
-  (void) pthread_mutex_lock(&ctx->mutex);
+  int key;
 
   // If the queue is full, wait
-  while (ctx->stop_flag == 0 &&
-         ctx->sq_head - ctx->sq_tail >= (int) ARRAY_SIZE(ctx->queue)) {
-    (void) pthread_cond_wait(&ctx->sq_empty, &ctx->mutex);
+  while (!sq_push(ctx, sp)) {
+    key = ec_prepare_wait(&ctx->sq_empty);
+    if (sq_push(ctx, sp)) {
+      ec_cancel_wait(&ctx->sq_empty);
+      break;
+    } else if (ctx->stop_flag) {
+      ec_cancel_wait(&ctx->sq_empty);
+      if (sp->ssl != NULL) {
+        SSL_free(sp->ssl);
+      }
+      (void) closesocket(sp->sock);
+      return;
+    }
+    ec_wait(&ctx->sq_empty, key);
   }
+  DEBUG_TRACE(("queued socket %d", sp->sock));
+
+  ec_notify(&ctx->sq_full, 0);
+}
+
+// Open the log files once, they stay open until mg_stop().
+static int set_log_option(struct mg_context *ctx) {
+  const char *path;
+  int i;
 
-  if (ctx->sq_head - ctx->sq_tail < (int) ARRAY_SIZE(ctx->queue)) {
-    // Copy socket to the queue and increment head
-    ctx->queue[ctx->sq_head % ARRAY_SIZE(ctx->queue)] = *sp;
-    ctx->sq_head++;
-    DEBUG_TRACE(("queued socket %d", sp->sock));
+  for (i = 0; i < NUM_LOGS; i++) {
+    path = ctx->config[log_file_options[i]];
+    if (path != NULL && (ctx->log_files[i] = mg_fopen(path, "a+")) == NULL) {
+      cry(fc(ctx), "%s: cannot open %s: %s", __func__, path, strerror(ERRNO));
+      return 0;
+    }
   }
+  return 1;
+}
 
-  (void) pthread_cond_signal(&ctx->sq_full);
-  (void) pthread_mutex_unlock(&ctx->mutex);
+static int set_file_cache_option(struct mg_context *ctx) {
+  int64_t budget = 0;
+
+  if (ctx->config[FILE_CACHE_SIZE] != NULL &&
+      (sscanf(ctx->config[FILE_CACHE_SIZE], "%" INT64_FMT, &budget) != 1 ||
+       budget < 0)) {
+    cry(fc(ctx), "%s: invalid file_cache_size [%s]", __func__,
+        ctx->config[FILE_CACHE_SIZE]);
+    return 0;
+  }
+  ctx->fc_budget = budget;
+
+  // Header cache is small and always on. Without it, file responses
+  // are still served, just with all headers rendered per request.
+  ctx->hc_slots = (struct header_cache_slot *)
+    calloc(HEADER_CACHE_SLOTS, sizeof(*ctx->hc_slots));
+#if defined(USE_FILE_CACHE)
+  if (budget > 0 && (ctx->fc_buckets = (struct file_cache_entry **)
+                     calloc(FILE_CACHE_BUCKETS, sizeof(*ctx->fc_buckets))) ==
+      NULL) {
+    cry(fc(ctx), "%s: cannot allocate file cache", __func__);
+    return 0;
+  }
+#endif // USE_FILE_CACHE
+  return 1;
 }
 
-static void accept_new_connection(const struct socket *listener,
-                                  struct mg_context *ctx) {
+static int set_path_cache_option(struct mg_context *ctx) {
+  int ttl = atoi(ctx->config[PATH_CACHE_TTL]);
+
+  if (ttl < 0) {
+    cry(fc(ctx), "%s: invalid path_cache_ttl [%s]", __func__,
+        ctx->config[PATH_CACHE_TTL]);
+    return 0;
+  }
+  ctx->pc_ttl = ttl;
+  if (ttl > 0 && (ctx->pc_slots = (struct path_cache_slot *)
+                  calloc(PATH_CACHE_SLOTS, sizeof(*ctx->pc_slots))) == NULL) {
+    cry(fc(ctx), "%s: cannot allocate path cache", __func__);
+    return 0;
+  }
+  return 1;
+}
+
+static int set_keep_alive_option(struct mg_context *ctx) {
+  ctx->max_requests = atoi(ctx->config[KEEP_ALIVE_MAX_REQUESTS]);
+  ctx->idle_timeout = atoi(ctx->config[IDLE_TIMEOUT]);
+  ctx->deadline = atoi(ctx->config[CONNECTION_DEADLINE]);
+
+  if (ctx->max_requests < 0 || ctx->idle_timeout < 0 || ctx->deadline < 0) {
+    cry(fc(ctx), "%s: invalid keep_alive_max_requests [%s], idle_timeout [%s]"
+        " or connection_deadline [%s]", __func__,
+        ctx->config[KEEP_ALIVE_MAX_REQUESTS], ctx->config[IDLE_TIMEOUT],
+        ctx->config[CONNECTION_DEADLINE]);
+    return 0;
+  }
+  return 1;
+}
+
+static int set_put_option(struct mg_context *ctx) {
+  static const char *values[] = {"no", "yes", "batch"};
+  int i;
+
+#if !defined(_WIN32)
+  // Read once here, workers must not change the umask to learn it
+  ctx->put_umask = umask(0);
+  (void) umask(ctx->put_umask);
+#endif
+  for (i = 0; i < (int) ARRAY_SIZE(values); i++) {
+    if (!mg_strcasecmp(ctx->config[PUT_FSYNC], values[i])) {
+      ctx->put_fsync = i;  // PUT_FSYNC_* are in the order of values
+      return 1;
+    }
+  }
+  cry(fc(ctx), "%s: invalid put_fsync [%s], must be no, yes or batch",
+      __func__, ctx->config[PUT_FSYNC]);
+  return 0;
+}
+
+static int set_fastcgi_option(struct mg_context *ctx) {
+  ctx->fcgi_processes = atoi(ctx->config[FASTCGI_PROCESSES]);
+
+  if (ctx->fcgi_processes <= 0 || ctx->fcgi_processes > FCGI_MAX_PROCESSES) {
+    cry(fc(ctx), "%s: invalid fastcgi_processes [%s], must be 1..%d",
+        __func__, ctx->config[FASTCGI_PROCESSES], FCGI_MAX_PROCESSES);
+    return 0;
+  }
+  return 1;
+}
+
+static int set_compression_option(struct mg_context *ctx) {
+  int budget = atoi(ctx->config[COMPRESSION_CPU_BUDGET]);
+
+  if (budget < 0 || budget > 1000000) {
+    cry(fc(ctx), "%s: invalid compression_cpu_budget [%s]", __func__,
+        ctx->config[COMPRESSION_CPU_BUDGET]);
+    return 0;
+  }
+#if defined(USE_ZLIB)
+  ctx->z_budget = budget * 1000L;
+#endif
+  ctx->precompressed =
+    !mg_strcasecmp(ctx->config[SERVE_PRECOMPRESSED_FILES], "yes");
+  return 1;
+}
+
+static int set_queue_option(struct mg_context *ctx) {
+  unsigned long i, size = 1;
+  int n = atoi(ctx->config[SOCKET_QUEUE_SIZE]);
+
+  if (n <= 0 || n > (1 << 20)) {
+    cry(fc(ctx), "%s: invalid socket queue size: [%s]", __func__,
+        ctx->config[SOCKET_QUEUE_SIZE]);
+    return 0;
+  }
+
+  // Ring size must be a power of two
+  while (size < (unsigned long) n) {
+    size <<= 1;
+  }
+  if ((ctx->queue = (struct sq_cell *)
+       calloc(size, sizeof(ctx->queue[0]))) == NULL) {
+    cry(fc(ctx), "%s: %s", __func__, strerror(ERRNO));
+    return 0;
+  }
+  for (i = 0; i < size; i++) {
+    ctx->queue[i].seq = (long) i;
+  }
+  ctx->sq_mask = size - 1;
+  ctx->sq_head = ctx->sq_tail = 0;
+
+  return 1;
+}
+
+// Readiness notification for the master thread. With epoll or kqueue,
+// descriptors are registered once and reported edge-triggered, so the
+// caller must drain each ready descriptor until it would block. Otherwise,
+// select() over the listening sockets is used, which is level-triggered and
+// therefore also fine with draining. Every descriptor carries an opaque
+// pointer which is handed back when it becomes readable.
+static int poller_init(struct mg_context *ctx) {
+#if defined(USE_EPOLL)
+  ctx->poll_fd = epoll_create(64);
+#elif defined(USE_KQUEUE)
+  ctx->poll_fd = kqueue();
+#else
+  ctx->poll_fd = INVALID_SOCKET;
+  return 1;
+#endif
+  if (ctx->poll_fd == INVALID_SOCKET) {
+    cry(fc(ctx), "%s: %s", __func__, strerror(ERRNO));
+    return 0;
+  }
+  set_close_on_exec(ctx->poll_fd);
+  return 1;
+}
+
+// If oneshot is set, the descriptor is reported once and then disarmed
+// until it is added again. This is used for parked connections, which
+// are handed over to a worker as soon as they become readable.
+static int poller_add(struct mg_context *ctx, SOCKET fd, void *data,
+                      int oneshot) {
+#if defined(USE_EPOLL)
+  struct epoll_event ev;
+  ev.events = oneshot ? EPOLLIN | EPOLLONESHOT : EPOLLIN | EPOLLET;
+  ev.data.ptr = data;
+  // Disarmed oneshot descriptor stays registered until it is closed
+  return epoll_ctl(ctx->poll_fd, EPOLL_CTL_ADD, fd, &ev) == 0 ||
+    (ERRNO == EEXIST && epoll_ctl(ctx->poll_fd, EPOLL_CTL_MOD, fd, &ev) == 0);
+#elif defined(USE_KQUEUE)
+  struct kevent ev;
+  EV_SET(&ev, fd, EVFILT_READ,
+         oneshot ? EV_ADD | EV_ONESHOT : EV_ADD | EV_CLEAR, 0, 0, data);
+  return kevent(ctx->poll_fd, &ev, 1, NULL, 0, NULL) == 0;
+#else
+  // select() fallback walks ctx->listening_sockets directly, and cannot
+  // watch parked connections.
+  (void) ctx; (void) fd; (void) data;
+  return !oneshot;
+#endif
+}
+
+static void poller_destroy(struct mg_context *ctx) {
+  if (ctx->poll_fd != INVALID_SOCKET) {
+    (void) closesocket(ctx->poll_fd);
+    ctx->poll_fd = INVALID_SOCKET;
+  }
+}
+
+// Wait until some registered descriptors become readable, or timeout_ms
+// expires (-1 means wait forever). Store their pointers in ready[].
+// Return number of ready descriptors, 0 on timeout, or -1 on error.
+static int poller_wait(struct mg_context *ctx, void **ready, int max_ready,
+                       int timeout_ms) {
+#if defined(USE_EPOLL)
+  struct epoll_event events[32];
+  int i, n;
+
+  if (max_ready > (int) ARRAY_SIZE(events)) {
+    max_ready = (int) ARRAY_SIZE(events);
+  }
+  if ((n = epoll_wait(ctx->poll_fd, events, max_ready, timeout_ms)) > 0) {
+    for (i = 0; i < n; i++) {
+      ready[i] = events[i].data.ptr;
+    }
+  }
+  return n;
+#elif defined(USE_KQUEUE)
+  struct kevent events[32];
+  struct timespec ts, *tsp = NULL;
+  int i, n;
+
+  if (max_ready > (int) ARRAY_SIZE(events)) {
+    max_ready = (int) ARRAY_SIZE(events);
+  }
+  if (timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    tsp = &ts;
+  }
+  if ((n = kevent(ctx->poll_fd, NULL, 0, events, max_ready, tsp)) > 0) {
+    for (i = 0; i < n; i++) {
+      ready[i] = (void *) events[i].udata;
+    }
+  }
+  return n;
+#else
+  fd_set read_set;
+  struct timeval tv, *tvp = NULL;
+  struct socket *sp;
+  int max_fd = -1, n = 0;
+
+  FD_ZERO(&read_set);
+  // Stalled listeners stay readable, watching them would spin
+  for (sp = ctx->listening_sockets; sp != NULL && !ctx->accept_stalled;
+       sp = sp->next) {
+    add_to_set(sp->sock, &read_set, &max_fd);
+  }
+  if (ctx->wakeup_fds[0] != INVALID_SOCKET) {
+    add_to_set(ctx->wakeup_fds[0], &read_set, &max_fd);
+  }
+
+#if defined(_WIN32)
+  // Windows has no selectable pipe to wake us up, poll the stop flag
+  if (timeout_ms < 0 || timeout_ms > 200) {
+    timeout_ms = 200;
+  }
+#endif // _WIN32
+  if (timeout_ms >= 0) {
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    tvp = &tv;
+  }
+
+  if (select(max_fd + 1, &read_set, NULL, NULL, tvp) < 0) {
+#ifdef _WIN32
+    // On windows, if read_set and write_set are empty,
+    // select() returns "Invalid parameter" error
+    // (at least on my Windows XP Pro). So in this case, we sleep here.
+    mg_sleep(1000);
+#endif // _WIN32
+    return -1;
+  }
+
+  for (sp = ctx->listening_sockets; sp != NULL && n < max_ready;
+       sp = sp->next) {
+    if (FD_ISSET(sp->sock, &read_set)) {
+      ready[n++] = sp;
+    }
+  }
+  if (ctx->wakeup_fds[0] != INVALID_SOCKET && n < max_ready &&
+      FD_ISSET(ctx->wakeup_fds[0], &read_set)) {
+    ready[n++] = ctx;
+  }
+  return n;
+#endif
+}
+
+// Wake up the master thread blocked in poller_wait()
+static void wakeup_master(struct mg_context *ctx) {
+  if (ctx->wakeup_fds[1] != INVALID_SOCKET) {
+    (void) write(ctx->wakeup_fds[1], "", 1);
+  }
+}
+
+static int set_wakeup_option(struct mg_context *ctx) {
+#if !defined(_WIN32)
+  if (pipe(ctx->wakeup_fds) != 0) {
+    cry(fc(ctx), "%s: pipe: %s", __func__, strerror(ERRNO));
+    ctx->wakeup_fds[0] = ctx->wakeup_fds[1] = INVALID_SOCKET;
+    return 0;
+  }
+  set_close_on_exec(ctx->wakeup_fds[0]);
+  set_close_on_exec(ctx->wakeup_fds[1]);
+  set_non_blocking_mode(ctx->wakeup_fds[0]);
+  set_non_blocking_mode(ctx->wakeup_fds[1]);
+#endif // !_WIN32
+  return 1;
+}
+
+static int set_poller_option(struct mg_context *ctx) {
+  struct socket *sp;
+
+  if (!poller_init(ctx)) {
+    return 0;
+  }
+  for (sp = ctx->listening_sockets; sp != NULL; sp = sp->next) {
+    if (!poller_add(ctx, sp->sock, sp, 0)) {
+      cry(fc(ctx), "%s: cannot watch socket: %s", __func__, strerror(ERRNO));
+      return 0;
+    }
+  }
+  if (ctx->wakeup_fds[0] != INVALID_SOCKET &&
+      !poller_add(ctx, ctx->wakeup_fds[0], ctx, 0)) {
+    cry(fc(ctx), "%s: cannot watch wakeup pipe: %s", __func__,
+        strerror(ERRNO));
+    return 0;
+  }
+  return 1;
+}
+
+// Accept one connection from the non-blocking listening socket.
+// Return 1 if a connection was taken off the backlog, 0 if it is empty.
+// Return 1 if accept() failed for this one connection only, and the
+// backlog behind it can still be taken.
+static int is_transient_accept_error(int err) {
+#if defined(_WIN32)
+  return err == WSAECONNRESET;
+#else
+  return err == ECONNABORTED || err == EPROTO || err == EPERM ||
+    err == ENETDOWN || err == ENETUNREACH || err == EHOSTUNREACH;
+#endif
+}
+
+// Return 1 if accept() failed for lack of descriptors or memory, which
+// may be there again a bit later.
+static int is_exhausted_accept_error(int err) {
+#if defined(_WIN32)
+  return err == WSAEMFILE || err == WSAENOBUFS;
+#else
+  return err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM;
+#endif
+}
+
+// Take one connection off the listener's backlog. Return 1 if there may
+// be more, 0 if the backlog is empty, and -1 if the process is out of
+// descriptors and the backlog has to be retried later.
+static int accept_new_connection(const struct socket *listener,
+                                 struct mg_context *ctx) {
   struct socket accepted;
   char src_addr[20];
   socklen_t len;
-  int allowed;
+  int allowed, on = 1;
 
+  memset(&accepted, 0, sizeof(accepted));
   len = sizeof(accepted.rsa);
   accepted.lsa = listener->lsa;
-  accepted.sock = accept(listener->sock, &accepted.rsa.sa, &len);
-  if (accepted.sock != INVALID_SOCKET) {
-    allowed = check_acl(ctx, &accepted.rsa);
-    if (allowed) {
-      // Put accepted socket structure into the queue
-      DEBUG_TRACE(("accepted socket %d", accepted.sock));
-      accepted.is_ssl = listener->is_ssl;
-      produce_socket(ctx, &accepted);
-    } else {
-      sockaddr_to_string(src_addr, sizeof(src_addr), &accepted.rsa);
-      cry(fc(ctx), "%s: %s is not allowed to connect", __func__, src_addr);
-      (void) closesocket(accepted.sock);
+  do {
+    accepted.sock = accept(listener->sock, &accepted.rsa.sa, &len);
+  } while (accepted.sock == INVALID_SOCKET && ERRNO == EINTR);
+
+  if (accepted.sock == INVALID_SOCKET) {
+    if (is_exhausted_accept_error(ERRNO)) {
+      if (!ctx->accept_stalled) {
+        cry(fc(ctx), "%s: %s, retrying every second", __func__,
+            strerror(ERRNO));
+      }
+      return -1;
+    }
+    return is_transient_accept_error(ERRNO) ? 1 : 0;
+  }
+
+  allowed = check_acl(ctx, &accepted.rsa);
+  if (allowed) {
+    // Put accepted socket structure into the queue. Workers do blocking IO,
+    // and BSD accept() inherits O_NONBLOCK from the listener.
+    DEBUG_TRACE(("accepted socket %d", accepted.sock));
+    set_blocking_mode(accepted.sock);
+    // Output is buffered already. Nagle's algorithm would only hold back
+    // responses written by user callbacks to pipelined requests.
+    (void) setsockopt(accepted.sock, IPPROTO_TCP, TCP_NODELAY, (void *) &on,
+                      sizeof(on));
+    accepted.is_ssl = listener->is_ssl;
+    if (ctx->deadline > 0) {
+      accepted.deadline = time(NULL) + ctx->deadline;
+    }
+    produce_socket(ctx, &accepted);
+  } else {
+    sockaddr_to_string(src_addr, sizeof(src_addr), &accepted.rsa);
+    cry(fc(ctx), "%s: %s is not allowed to connect", __func__, src_addr);
+    (void) closesocket(accepted.sock);
+  }
+
+  return 1;
+}
+
+// Drain the listener's backlog, readiness is reported only on new arrivals.
+// Return 1 if connections were left behind for lack of descriptors, the
+// master thread then retries once a second.
+static int accept_new_connections(const struct socket *listener,
+                                  struct mg_context *ctx) {
+  int rc;
+
+  while ((rc = accept_new_connection(listener, ctx)) > 0 &&
+         ctx->stop_flag == 0) {
+  }
+  return rc < 0;
+}
+
+// Must be called with ctx->mutex held.
+static void remove_parked_socket(struct mg_context *ctx, struct socket *sp) {
+  if (sp->prev != NULL) {
+    sp->prev->next = sp->next;
+  } else {
+    ctx->parked_sockets = sp->next;
+  }
+  if (sp->next != NULL) {
+    sp->next->prev = sp->prev;
+  }
+}
+
+static void unlink_parked_socket(struct mg_context *ctx, struct socket *sp) {
+  (void) pthread_mutex_lock(&ctx->mutex);
+  remove_parked_socket(ctx, sp);
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+// Hand idle keep-alive connection over to the master thread, which watches
+// it in the poller and queues it for a worker once the next request
+// starts to arrive. This way idle clients do not pin worker threads.
+// Return 1 if connection has been parked, and conn no longer owns it.
+static int park_connection(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+  struct socket *sp;
+
+  if (mg_strcasecmp(ctx->config[PARK_IDLE_CONNECTIONS], "yes") != 0 ||
+      ctx->poll_fd == INVALID_SOCKET ||
+      conn->data_len > 0 ||
+      (conn->ssl != NULL && SSL_pending(conn->ssl) > 0) ||
+      (sp = (struct socket *) malloc(sizeof(*sp))) == NULL) {
+    return 0;
+  }
+
+  *sp = conn->client;
+  sp->ssl = conn->ssl;
+  sp->is_parked = 1;
+  sp->prev = NULL;
+  sp->idle_expires = 0;
+  if (ctx->idle_timeout > 0) {
+    sp->idle_expires = time(NULL) + ctx->idle_timeout;
+  }
+  if (sp->deadline > 0 &&
+      (sp->idle_expires == 0 || sp->deadline < sp->idle_expires)) {
+    sp->idle_expires = sp->deadline;
+  }
+
+  // Link before arming the poller, master may pick it up right away.
+  // Keep the lock until the poller is armed, so that the master does not
+  // expire the socket while we may still have to take it back.
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if ((sp->next = ctx->parked_sockets) != NULL) {
+    sp->next->prev = sp;
+  }
+  ctx->parked_sockets = sp;
+  if (!poller_add(ctx, sp->sock, sp, 1)) {
+    remove_parked_socket(ctx, sp);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    free(sp);
+    return 0;
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  DEBUG_TRACE(("parked socket %d", sp->sock));
+  conn->client.sock = INVALID_SOCKET;
+  conn->ssl = NULL;
+  return 1;
+}
+
+// Parked connection became readable, queue it for a worker.
+static void resume_connection(struct mg_context *ctx, struct socket *sp) {
+  struct socket so;
+
+  unlink_parked_socket(ctx, sp);
+  so = *sp;
+  free(sp);
+  DEBUG_TRACE(("resumed socket %d", so.sock));
+  produce_socket(ctx, &so);
+}
+
+static void close_parked_socket(struct socket *sp) {
+  if (sp->ssl != NULL) {
+    SSL_free(sp->ssl);
+  }
+  (void) closesocket(sp->sock);
+  free(sp);
+}
+
+static void close_all_parked_sockets(struct mg_context *ctx) {
+  struct socket *sp, *tmp;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (sp = ctx->parked_sockets; sp != NULL; sp = tmp) {
+    tmp = sp->next;
+    close_parked_socket(sp);
+  }
+  ctx->parked_sockets = NULL;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+// Close parked connections that stayed idle for too long. Closing the
+// socket also removes it from the poller. Called by the master thread
+// only, so no parked socket can be resumed at the same time.
+static void expire_parked_sockets(struct mg_context *ctx, time_t now) {
+  struct socket *sp, *tmp;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (sp = ctx->parked_sockets; sp != NULL; sp = tmp) {
+    tmp = sp->next;
+    if (sp->idle_expires > 0 && now >= sp->idle_expires) {
+      remove_parked_socket(ctx, sp);
+      DEBUG_TRACE(("expired parked socket %d", sp->sock));
+      close_parked_socket(sp);
     }
   }
+  (void) pthread_mutex_unlock(&ctx->mutex);
 }
 
 static void master_thread(struct mg_context *ctx) {
-  fd_set read_set;
-  struct timeval tv;
+  void *ready[32];
+  char drain[16];
   struct socket *sp;
-  int max_fd;
+  int i, n, timeout_ms, stalled;
+  time_t now, last_expire = 0, last_retry = 0;
 
   // Increase priority of the master thread
 #if defined(_WIN32)
@@ -4283,40 +9833,47 @@ static void master_thread(struct mg_context *ctx) {
   pthread_setschedparam(pthread_self(), SCHED_RR, &sched_param);
 #endif
 
-  while (ctx->stop_flag == 0) {
-    FD_ZERO(&read_set);
-    max_fd = -1;
-
-    // Add listening sockets to the read set
-    for (sp = ctx->listening_sockets; sp != NULL; sp = sp->next) {
-      add_to_set(sp->sock, &read_set, &max_fd);
-    }
-
-    tv.tv_sec = 0;
-    tv.tv_usec = 200 * 1000;
+  // Look for expired parked connections once a second
+  timeout_ms = ctx->idle_timeout > 0 || ctx->deadline > 0 ? 1000 : -1;
 
-    if (select(max_fd + 1, &read_set, NULL, NULL, &tv) < 0) {
-#ifdef _WIN32
-      // On windows, if read_set and write_set are empty,
-      // select() returns "Invalid parameter" error
-      // (at least on my Windows XP Pro). So in this case, we sleep here.
-      mg_sleep(1000);
-#endif // _WIN32
-    } else {
-      for (sp = ctx->listening_sockets; sp != NULL; sp = sp->next) {
-        if (ctx->stop_flag == 0 && FD_ISSET(sp->sock, &read_set)) {
-          accept_new_connection(sp, ctx);
+  while (ctx->stop_flag == 0) {
+    n = poller_wait(ctx, ready, (int) ARRAY_SIZE(ready),
+                    ctx->accept_stalled ? 1000 : timeout_ms);
+    for (i = 0; i < n && ctx->stop_flag == 0; i++) {
+      if (ready[i] == ctx) {
+        while (read(ctx->wakeup_fds[0], drain, sizeof(drain)) > 0) {
         }
+      } else if (((struct socket *) ready[i])->is_parked) {
+        resume_connection(ctx, (struct socket *) ready[i]);
+      } else if (!ctx->accept_stalled) {
+        ctx->accept_stalled =
+          accept_new_connections((struct socket *) ready[i], ctx);
       }
     }
+    if (timeout_ms > 0 && (now = time(NULL)) != last_expire) {
+      last_expire = now;
+      expire_parked_sockets(ctx, now);
+    }
+    // Descriptors may have been freed since, take what is left behind
+    if (ctx->accept_stalled && (now = time(NULL)) != last_retry) {
+      last_retry = now;
+      stalled = 0;
+      for (sp = ctx->listening_sockets; sp != NULL && ctx->stop_flag == 0;
+           sp = sp->next) {
+        stalled |= accept_new_connections(sp, ctx);
+      }
+      ctx->accept_stalled = stalled;
+    }
   }
   DEBUG_TRACE(("stopping workers"));
 
   // Stop signal received: somebody called mg_stop. Quit.
   close_all_listening_sockets(ctx);
+  close_all_parked_sockets(ctx);
+  poller_destroy(ctx);
 
   // Wakeup workers that are waiting for connections to handle.
-  pthread_cond_broadcast(&ctx->sq_full);
+  ec_notify(&ctx->sq_full, 1);
 
   // Wait until all threads finish
   (void) pthread_mutex_lock(&ctx->mutex);
@@ -4325,11 +9882,25 @@ static void master_thread(struct mg_context *ctx) {
   }
   (void) pthread_mutex_unlock(&ctx->mutex);
 
+  // Workers have written out their log buffers, stop the logger
+  if (ctx->log_stop == 0) {
+    ctx->log_stop = 1;
+  }
+  while (ctx->log_stop != 2) {
+    mg_sleep(10);
+  }
+
   // All threads exited, no sync is needed. Destroy mutex and condvars
+  file_cache_clear(ctx);
+  listing_cache_clear(ctx);
   (void) pthread_mutex_destroy(&ctx->mutex);
+  (void) pthread_mutex_destroy(&ctx->fc_mutex);
+  (void) pthread_mutex_destroy(&ctx->lc_mutex);
+  (void) pthread_mutex_destroy(&ctx->z_mutex);
+  (void) pthread_mutex_destroy(&ctx->hc_mutex);
   (void) pthread_cond_destroy(&ctx->cond);
-  (void) pthread_cond_destroy(&ctx->sq_empty);
-  (void) pthread_cond_destroy(&ctx->sq_full);
+  ec_destroy(&ctx->sq_empty);
+  ec_destroy(&ctx->sq_full);
 
 #if !defined(NO_SSL)
   uninitialize_ssl(ctx);
@@ -4343,6 +9914,8 @@ static void master_thread(struct mg_context *ctx) {
 }
 
 static void free_context(struct mg_context *ctx) {
+  struct mg_connection *conn;
+  struct auth_file *f;
   int i;
 
   // Deallocate config parameters
@@ -4351,6 +9924,62 @@ static void free_context(struct mg_context *ctx) {
       free(ctx->config[i]);
   }
 
+  poller_destroy(ctx);
+  free(ctx->queue);
+  free(ctx->fc_buckets);
+  free(ctx->mime_table);
+  free(ctx->mime_suffixes);
+#if defined(USE_FASTCGI)
+  free_fcgi_pools(ctx);
+#endif
+  (void) pthread_mutex_destroy(&ctx->fcgi_mutex);
+  (void) pthread_mutex_destroy(&ctx->put_mutex);
+  (void) pthread_cond_destroy(&ctx->put_cond);
+  while ((conn = ctx->client_pool) != NULL) {
+    ctx->client_pool = conn->next_idle;
+    mg_close_connection(conn);
+  }
+  (void) pthread_mutex_destroy(&ctx->client_mutex);
+  free(ctx->cgi_glob);
+  free(ctx->fcgi_glob);
+  free(ctx->ssi_glob);
+  free(ctx->hide_glob);
+  if (ctx->pc_slots != NULL) {
+    for (i = 0; i < PATH_CACHE_SLOTS; i++) {
+      free(ctx->pc_slots[i].uri);
+    }
+    free(ctx->pc_slots);
+  }
+  for (i = 0; i < PATH_CACHE_LOCKS; i++) {
+    (void) pthread_mutex_destroy(&ctx->pc_mutexes[i]);
+  }
+  free_acl(ctx->acl);
+  for (i = 0; i < NUM_LOGS; i++) {
+    if (ctx->log_files[i] != NULL) {
+      (void) fclose(ctx->log_files[i]);
+    }
+  }
+  (void) pthread_mutex_destroy(&ctx->log_mutex);
+
+  // Deallocate loaded passwords files
+  for (i = 0; i < AUTH_FILE_BUCKETS; i++) {
+    while ((f = ctx->auth_files[i]) != NULL) {
+      ctx->auth_files[i] = f->next;
+      free_auth_file(f);
+    }
+  }
+  (void) pthread_mutex_destroy(&ctx->auth_mutex);
+  if (ctx->hc_slots != NULL) {
+    for (i = 0; i < HEADER_CACHE_SLOTS; i++) {
+      free(ctx->hc_slots[i].path);
+    }
+    free(ctx->hc_slots);
+  }
+  if (ctx->wakeup_fds[0] != INVALID_SOCKET) {
+    (void) close(ctx->wakeup_fds[0]);
+    (void) close(ctx->wakeup_fds[1]);
+  }
+
   // Deallocate SSL context
   if (ctx->ssl_ctx != NULL) {
     SSL_CTX_free(ctx->ssl_ctx);
@@ -4370,6 +9999,7 @@ static void free_context(struct mg_context *ctx) {
 
 void mg_stop(struct mg_context *ctx) {
   ctx->stop_flag = 1;
+  wakeup_master(ctx);
 
   // Wait until mg_fini() stops
   while (ctx->stop_flag != 2) {
@@ -4401,6 +10031,16 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
   }
   ctx->user_callback = user_callback;
   ctx->user_data = user_data;
+  ctx->poll_fd = ctx->wakeup_fds[0] = ctx->wakeup_fds[1] = INVALID_SOCKET;
+  (void) pthread_mutex_init(&ctx->log_mutex, NULL);
+  (void) pthread_mutex_init(&ctx->auth_mutex, NULL);
+  (void) pthread_mutex_init(&ctx->fcgi_mutex, NULL);
+  (void) pthread_mutex_init(&ctx->put_mutex, NULL);
+  (void) pthread_cond_init(&ctx->put_cond, NULL);
+  (void) pthread_mutex_init(&ctx->client_mutex, NULL);
+  for (i = 0; i < PATH_CACHE_LOCKS; i++) {
+    (void) pthread_mutex_init(&ctx->pc_mutexes[i], NULL);
+  }
 
   while (options && (name = *options++) != NULL) {
     if ((i = get_option_index(name)) == -1) {
@@ -4432,11 +10072,23 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
 
   // NOTE(lsm): order is important here. SSL certificates must
   // be initialized before listening ports. UID must be set last.
-  if (!set_gpass_option(ctx) ||
+  if (!set_log_option(ctx) ||
+      !set_gpass_option(ctx) ||
+      !set_queue_option(ctx) ||
+      !set_file_cache_option(ctx) ||
+      !set_mime_option(ctx) ||
+      !set_glob_option(ctx) ||
+      !set_path_cache_option(ctx) ||
+      !set_keep_alive_option(ctx) ||
+      !set_fastcgi_option(ctx) ||
+      !set_put_option(ctx) ||
+      !set_compression_option(ctx) ||
 #if !defined(NO_SSL)
       !set_ssl_option(ctx) ||
 #endif
       !set_ports_option(ctx) ||
+      !set_wakeup_option(ctx) ||
+      !set_poller_option(ctx) ||
 #if !defined(_WIN32)
       !set_uid_option(ctx) ||
 #endif
@@ -4454,9 +10106,21 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
 #endif // !_WIN32
 
   (void) pthread_mutex_init(&ctx->mutex, NULL);
+  (void) pthread_mutex_init(&ctx->fc_mutex, NULL);
+  (void) pthread_mutex_init(&ctx->lc_mutex, NULL);
+  (void) pthread_mutex_init(&ctx->z_mutex, NULL);
+  (void) pthread_mutex_init(&ctx->hc_mutex, NULL);
   (void) pthread_cond_init(&ctx->cond, NULL);
-  (void) pthread_cond_init(&ctx->sq_empty, NULL);
-  (void) pthread_cond_init(&ctx->sq_full, NULL);
+  ec_init(&ctx->sq_empty);
+  ec_init(&ctx->sq_full);
+
+  // Start logger thread if there is something to log
+  if (ctx->log_files[ACCESS_LOG] != NULL ||
+      ctx->log_files[ERROR_LOG] != NULL) {
+    mg_start_thread((mg_thread_func_t) logger_thread, ctx);
+  } else {
+    ctx->log_stop = 2;
+  }
 
   // Start master (listening) thread
   mg_start_thread((mg_thread_func_t) master_thread, ctx);
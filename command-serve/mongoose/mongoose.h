@@ -118,6 +118,12 @@ struct mg_context *mg_start(mg_callback_t callback, void *user_data,
 void mg_stop(struct mg_context *);
 
 
+// Reopen access and error log files, e.g. after they were rotated.
+// Logs are reopened by the logger thread shortly after the call. This
+// function only sets a flag, so it is safe to call from a signal handler.
+void mg_reopen_logs(struct mg_context *);
+
+
 // Get the value of particular configuration parameter.
 // The value returned is read-only. Mongoose does not allow changing
 // configuration at run time.
@@ -256,7 +262,43 @@ struct mg_connection *mg_connect(struct mg_context *ctx,
 void mg_close_connection(struct mg_connection *conn);
 
 
-// Download given URL to a given file.
+// Read the headers of the next HTTP response on a connection opened by
+// mg_connect() or mg_pool_connect(). Requests are written with mg_printf()
+// and mg_write(). Several of them may be sent before the first response
+// is read (HTTP/1.1 pipelining), responses come in the same order.
+// Interim 1xx responses are skipped, HEAD requests are not supported.
+// After that, mg_get_request_info() and mg_get_header() describe the
+// response: request_method holds the protocol, uri the status code and
+// http_version the reason phrase. mg_read() returns the response body, it
+// knows where the body ends from Content-Length or chunked encoding. Body
+// data not read is skipped by the next call.
+// Return:
+//   On success, status code of the response
+//   On error, -1. The connection cannot be used any more.
+int mg_read_response(struct mg_connection *conn);
+
+
+// Get a kept-alive connection to the remote web server from the pool of
+// idle connections of this context, or connect like mg_connect() does if
+// there is none. Host names resolved by either function are cached for
+// a minute.
+// Return:
+//   On success, valid pointer to the connection
+//   On error, NULL
+struct mg_connection *mg_pool_connect(struct mg_context *ctx,
+                                      const char *host, int port,
+                                      int use_ssl);
+
+
+// Give the connection back to the pool when done with it, instead of
+// closing it. All requests sent must have their responses read by then.
+// Connection is closed if the server does not keep it alive, or if the
+// last response body has not been read to its end.
+void mg_pool_release(struct mg_connection *conn);
+
+
+// Download given URL to a given file. The request goes out on a pooled
+// connection, see mg_pool_connect().
 //   url: URL to download
 //   path: file name where to save the data
 //   request_info: pointer to a structure that will hold parsed reply headers
@@ -44,6 +44,19 @@ static char mydesc[] = "A http plugin for serving files";
 
 #define WWW_ROOT 1
 #define WWW_PORT 2
+#define WWW_FILE_CACHE 3
+#define WWW_PATH_CACHE_TTL 4
+#define WWW_KEEP_ALIVE_MAX 5
+#define WWW_IDLE_TIMEOUT 6
+#define WWW_CONNECTION_DEADLINE 7
+#define WWW_COMPRESSION_BUDGET 8
+
+#define DEFAULT_FILE_CACHE "33554432"
+#define DEFAULT_PATH_CACHE_TTL "2"
+#define DEFAULT_KEEP_ALIVE_MAX "1000"
+#define DEFAULT_IDLE_TIMEOUT "15"
+#define DEFAULT_CONNECTION_DEADLINE "600"
+#define DEFAULT_COMPRESSION_BUDGET "100"
 
 int
 pkg_plugin_init(struct pkg_plugin *p)
@@ -56,6 +69,23 @@ pkg_plugin_init(struct pkg_plugin *p)
 
 	pkg_plugin_conf_add_string(p, WWW_ROOT, "WWW_ROOT", PREFIX"/www");
 	pkg_plugin_conf_add_string(p, WWW_PORT, "WWW_PORT", "8080");
+	/* repository metadata is fetched by every pkg update, keep it mapped */
+	pkg_plugin_conf_add_string(p, WWW_FILE_CACHE, "WWW_FILE_CACHE",
+	    DEFAULT_FILE_CACHE);
+	/* repositories change by whole files being renamed into place */
+	pkg_plugin_conf_add_string(p, WWW_PATH_CACHE_TTL, "WWW_PATH_CACHE_TTL",
+	    DEFAULT_PATH_CACHE_TTL);
+	/* pkg upgrade fetches hundreds of packages, reuse the connection */
+	pkg_plugin_conf_add_string(p, WWW_KEEP_ALIVE_MAX, "WWW_KEEP_ALIVE_MAX",
+	    DEFAULT_KEEP_ALIVE_MAX);
+	/* idle clients are dropped instead of holding a connection open */
+	pkg_plugin_conf_add_string(p, WWW_IDLE_TIMEOUT, "WWW_IDLE_TIMEOUT",
+	    DEFAULT_IDLE_TIMEOUT);
+	pkg_plugin_conf_add_string(p, WWW_CONNECTION_DEADLINE, "WWW_CONNECTION_DEADLINE",
+	    DEFAULT_CONNECTION_DEADLINE);
+	/* packages are compressed already, only listings are gzipped */
+	pkg_plugin_conf_add_string(p, WWW_COMPRESSION_BUDGET, "WWW_COMPRESSION_BUDGET",
+	    DEFAULT_COMPRESSION_BUDGET);
 
 	pkg_plugin_parse(p);
 
@@ -84,6 +114,12 @@ plugin_serve_callback(int argc, char **argv)
 	struct stat st;
 	const char *wwwroot = NULL;
 	const char *port = NULL;
+	const char *file_cache = NULL;
+	const char *path_cache_ttl = NULL;
+	const char *keep_alive_max = NULL;
+	const char *idle_timeout = NULL;
+	const char *deadline = NULL;
+	const char *compression_budget = NULL;
         int ch;
 
         while ((ch = getopt(argc, argv, "d:p:")) != -1) {
@@ -109,6 +145,30 @@ plugin_serve_callback(int argc, char **argv)
 	if (wwwroot == NULL)
 		pkg_plugin_conf_string(self, WWW_ROOT, &wwwroot);
 
+	pkg_plugin_conf_string(self, WWW_FILE_CACHE, &file_cache);
+	if (file_cache == NULL)
+		file_cache = DEFAULT_FILE_CACHE;
+
+	pkg_plugin_conf_string(self, WWW_PATH_CACHE_TTL, &path_cache_ttl);
+	if (path_cache_ttl == NULL)
+		path_cache_ttl = DEFAULT_PATH_CACHE_TTL;
+
+	pkg_plugin_conf_string(self, WWW_KEEP_ALIVE_MAX, &keep_alive_max);
+	if (keep_alive_max == NULL)
+		keep_alive_max = DEFAULT_KEEP_ALIVE_MAX;
+
+	pkg_plugin_conf_string(self, WWW_IDLE_TIMEOUT, &idle_timeout);
+	if (idle_timeout == NULL)
+		idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+	pkg_plugin_conf_string(self, WWW_CONNECTION_DEADLINE, &deadline);
+	if (deadline == NULL)
+		deadline = DEFAULT_CONNECTION_DEADLINE;
+
+	pkg_plugin_conf_string(self, WWW_COMPRESSION_BUDGET, &compression_budget);
+	if (compression_budget == NULL)
+		compression_budget = DEFAULT_COMPRESSION_BUDGET;
+
 	if (wwwroot == NULL) {
 		warn("You need to specify a directory for serve");
 		return (EX_USAGE);
@@ -124,6 +184,15 @@ plugin_serve_callback(int argc, char **argv)
 		"listening_ports", port,
 		"document_root", wwwroot,
 		"enable_directory_listing", "yes",
+		"file_cache_size", file_cache,
+		"path_cache_ttl", path_cache_ttl,
+		"enable_keep_alive", "yes",
+		"keep_alive_max_requests", keep_alive_max,
+		"idle_timeout", idle_timeout,
+		"park_idle_connections", "yes",
+		"connection_deadline", deadline,
+		"compression_cpu_budget", compression_budget,
+		"serve_precompressed_files", "yes",
 		NULL, NULL
 	};
 